@@ -244,10 +244,9 @@ int main_function()
 	end_time = ::get_wtime();
 	std::cerr << "done in " << end_time - start_time << " seconds\n";
 	std::cerr << "Curvature cache : "
-	          << curvature_cache_hits/1000 << " khits / "
-	          << curvature_cache_misses/1000 << " kmisses.\n\n"; 
-	curvature_cache_hits = 0;
-	curvature_cache_misses = 0;
+	          << default_curvature_cache().hits()/1000 << " khits / "
+	          << default_curvature_cache().misses()/1000 << " kmisses.\n\n"; 
+	default_curvature_cache().reset_counters();
 	
 
 	// Neighborhood function for curvature.
@@ -325,8 +324,8 @@ int main_function()
 	std::cerr << "Curvature time: " << end_time - start_time << " seconds ";
 	std::cerr << "(" << evaluations << " evaluations).\n";
 	std::cerr << "Curvature cache : "
-	          << curvature_cache_hits/1000 << " khits / "
-	          << curvature_cache_misses/1000 << " kmisses.\n\n"; 
+	          << default_curvature_cache().hits()/1000 << " khits / "
+	          << default_curvature_cache().misses()/1000 << " kmisses.\n\n"; 
 
 	std::cerr << "Writing curve... ";
 	fout.close();
@@ -443,8 +442,8 @@ int main_function()
 		std::cerr << "Torsion time  : " << end_time - start_time << " seconds ";
 		std::cerr << "(" << evaluations << " evaluations).\n";
 		std::cerr << "Torsion cache : " 
-				  << torsion_cache_hits / 1000 << " / "
-				  << torsion_cache_misses / 1000
+				  << default_torsion_cache().hits() / 1000 << " / "
+				  << default_torsion_cache().misses() / 1000
 				  << " khits / kmisses.\n"; 
 
 		std::cerr << "Writing curve... ";
@@ -21,6 +21,7 @@ using ceres::examples::PGMImage;
 #include <curve_extraction/data_term.h>
 #include <curve_extraction/grid_mesh.h>
 #include <curve_extraction/mesh.h>
+#include <curve_extraction/multi_view_data_term.h>
 #include <curve_extraction/shortest_path.h>
 
 using namespace curve_extraction;
@@ -176,8 +177,6 @@ int main_function()
 	}
 	Eigen::Vector3d offset = min_point;
 	Eigen::Vector3d resolution = (max_point - min_point) / double(n - 1);
-	// Square pixels in images.
-	vector<double> voxel_dimensions(3, 1.0);
 
 	// Create the mesh.
 	GridMesh mesh(n, n, n, 4.0, false);
@@ -222,24 +221,28 @@ int main_function()
 	cerr << "Using length regularization " << length_regularization << endl;
 
 	//
-	// Data terms.
+	// Data term. The maximum over the images of the line integral
+	// along the projection of the edge.
 	//
-	vector<std::unique_ptr<PieceWiseConstant>> data_terms;
+	vector<MultiViewDataTerm::View> views(number_of_images);
 	for (int i = 0; i < number_of_images; ++i) {
-		data_terms.emplace_back(new PieceWiseConstant(&(Ds[i].data()[0]),
-		                                           Ds[i].width(),
-		                                           Ds[i].height(),
-		                                           1,
-		                                           voxel_dimensions));
+		views[i].image = &(Ds[i].data()[0]);
+		views[i].width = Ds[i].width();
+		views[i].height = Ds[i].height();
+		for (int r = 0; r < 3; ++r) {
+			for (int c = 0; c < 4; ++c) {
+				views[i].camera[4*r + c] = Ps[i](r, c);
+			}
+		}
 	}
+	MultiViewDataTerm data_term(mesh, views);
+	// Every edge is evaluated many times with curvature regularization.
+	data_term.enable_edge_cache();
+	cerr << "Mesh projected into " << data_term.number_of_views() << " images." << endl;
 
 	auto get_neighbors_length =
 		[&mesh,
-		 number_of_images,
-		 &Ps,
-		 &Ds,
-		 &data_terms,
-		 &mesh_index_to_image_point,
+		 &data_term,
 		 &length_regularization
 		]
 		(int p, std::vector<Neighbor>* neighbors) -> void
@@ -252,19 +255,7 @@ int main_function()
 			float dz = mesh.get_point(p).z - mesh.get_point(*itr).z;
 			double length = sqrt(dx*dx + dy*dy + dz*dz);
 
-			// Go through every image.
-			double data_cost = 0.0;
-			for (int i = 0; i < number_of_images; ++i) {
-				auto coord1 = mesh_index_to_image_point(p, Ps[i], Ds[i]);
-				auto coord2 = mesh_index_to_image_point(*itr, Ps[i], Ds[i]);
-
-				double tmp_cost =
-					data_terms[i]->evaluate_line_integral(
-						coord1.first, coord1.second, 0.0,
-				        coord2.first, coord2.second, 0.0);
-				data_cost = max(tmp_cost, data_cost);
-			}
-
+			double data_cost = data_term.evaluate_line_integral(p, *itr);
 			double cost = data_cost + length_regularization * length;
 
 			neighbors->push_back(Neighbor(*itr, cost));
@@ -432,11 +423,7 @@ int main_function()
 
 	auto get_neighbors_curvature =
 		[&mesh,
-		 number_of_images,
-		 &Ps,
-		 &Ds,
-		 &data_terms,
-		 &mesh_index_to_image_point,
+		 &data_term,
 		 &length_regularization,
 		 &curvature_regularization
 		]
@@ -453,18 +440,7 @@ int main_function()
 			float dz = mesh.get_point(p).z - mesh.get_point(p2).z;
 			double length = sqrt(dx*dx + dy*dy + dz*dz);
 
-			// Go through every image.
-			double data_cost = 0.0;
-			for (int i = 0; i < number_of_images; ++i) {
-				auto coord1 = mesh_index_to_image_point(p,  Ps[i], Ds[i]);
-				auto coord2 = mesh_index_to_image_point(p2, Ps[i], Ds[i]);
-				
-				double tmp_cost =
-					data_terms[i]->evaluate_line_integral(
-						coord1.first, coord1.second, 0.0,
-				        coord2.first, coord2.second, 0.0);
-				data_cost = max(tmp_cost, data_cost);
-			}
+			double data_cost = data_term.evaluate_edge(*itr);
 
 			int q1 = mesh.get_edge(e).first;
 			int q2 = mesh.get_edge(e).second;
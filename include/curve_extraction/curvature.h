@@ -2,22 +2,86 @@
 #ifndef CURVE_EXTRACTION_CURVATURE_H
 #define CURVE_EXTRACTION_CURVATURE_H
 
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
 namespace curve_extraction {
 
-extern int curvature_cache_hits;
-extern int curvature_cache_misses;
+// Cache of values for tuples of n numbers, where two tuples are equal
+// if their elements round to the same multiples of 1e-4. The cache is
+// split into shards, each an open addressing hash table with its own
+// lock, so it may be used from several threads at once.
+//
+// A slot holds a 64-bit hash of the key and the value, 16 bytes for any
+// n. The tables are at most half full and double when they grow, so a
+// value takes 32 to 64 bytes.
+template<int n>
+class QuantizedCache
+{
+public:
+	typedef std::array<std::int64_t, n> Key;
+
+	// At most capacity values are stored; later ones are not.
+	explicit QuantizedCache(std::size_t capacity);
+	~QuantizedCache();
+
+	static std::int64_t quantize(double value);
+
+	// Counts a hit or a miss.
+	bool find(const Key& key, double* value);
+	void insert(const Key& key, double value);
+
+	// Removes all values, but not the hit and miss counts.
+	void clear();
+	// Clears the cache.
+	void set_capacity(std::size_t capacity);
+
+	std::size_t capacity() const { return max_size; }
+	std::size_t size() const     { return num_values; }
+
+	std::size_t hits() const   { return num_hits; }
+	std::size_t misses() const { return num_misses; }
+	void reset_counters();
+
+private:
+	QuantizedCache(const QuantizedCache&);
+	QuantizedCache& operator=(const QuantizedCache&);
+
+	struct Shard;
+	static const int num_shards = 64;
+	std::unique_ptr<Shard[]> shards;
+
+	std::size_t max_size;
+	std::atomic<std::size_t> num_values;
+	std::atomic<std::size_t> num_hits;
+	std::atomic<std::size_t> num_misses;
+};
+
+// The coordinates relative to the first point, the power, the number
+// of approximation points and the size of the floating point type.
+typedef QuantizedCache<9> CurvatureCache;
+// The coordinates relative to their mean and the same three numbers.
+typedef QuantizedCache<15> TorsionCache;
+
+// The caches used when none is given, holding at most 1 000 000 and
+// 10 000 000 values, i.e. up to about 64 MB and 640 MB.
+CurvatureCache& default_curvature_cache();
+TorsionCache& default_torsion_cache();
+
+// Only double and float values are cached.
 template<typename R>
 R compute_curvature(R x1, R y1, R z1,
                     R x2, R y2, R z2,
                     R x3, R y3, R z3,
                     R power = 2.0,
                     bool writable_cache = true,
-                    int n_approximation_points = 200
+                    int n_approximation_points = 200,
+                    CurvatureCache* cache = nullptr
                     );
 
-extern int torsion_cache_hits;
-extern int torsion_cache_misses;
-
 template<typename R>
 R compute_torsion(R x1, R y1, R z1,
                   R x2, R y2, R z2,
@@ -25,7 +89,8 @@ R compute_torsion(R x1, R y1, R z1,
                   R x4, R y4, R z4,
                   R power = 2.0,
                   bool writable_cache = true,
-                  int n_approximation_points = 200);
+                  int n_approximation_points = 200,
+                  TorsionCache* cache = nullptr);
 
 }  // namespace curve_extraction
 
@@ -4,14 +4,35 @@
 
 #include <vector>
 
+#include <curve_extraction/volume_layout.h>
+
 namespace curve_extraction {
 
-class PieceWiseConstant
+// The data terms are templated on the voxel type of the volume and
+// are instantiated for double, float, unsigned short and unsigned
+// char, so that 8 and 16 bit volumes are used without conversion.
+// A voxel with value v has the data cost scale*v + offset.
+//
+// PieceWiseConstant, StencilLineIntegral and TriLinear are the data
+// terms of double volumes.
+//
+// The volume is in column major order unless a VolumeLayout is given,
+// in which case unary points to a volume of layout.size() voxels
+// stored in that layout (see VolumeLayout::reorder).
+
+template<typename Voxel>
+class BasicPieceWiseConstant
 {
 public:
-	PieceWiseConstant(const double * unary,
-	                  int M, int N, int O,
-	                  const std::vector<double>& voxeldimensions);
+	BasicPieceWiseConstant(const Voxel * unary,
+	                       int M, int N, int O,
+	                       const std::vector<double>& voxeldimensions,
+	                       double scale = 1.0, double offset = 0.0);
+
+	BasicPieceWiseConstant(const Voxel * unary,
+	                       const VolumeLayout& layout,
+	                       const std::vector<double>& voxeldimensions,
+	                       double scale = 1.0, double offset = 0.0);
 
 	template<typename R>
 	R evaluate(R x, R y, R z = 0.0) const;
@@ -19,34 +40,240 @@ public:
 	template<typename R>
 	R evaluate_line_integral(R x1, R y1, R z1,
 	                         R x2, R y2, R z2) const;
+
+	// The line integral and its gradient (6 entries) and Hessian (6 x 6,
+	// row major) with respect to (x1, y1, z1, x2, y2, z2), derived from
+	// the traversed segments. Much faster than automatic
+	// differentiation, with the same results. hessian may be null. The
+	// derivatives are zero if the integral is infinite.
+	double evaluate_line_integral(double x1, double y1, double z1,
+	                              double x2, double y2, double z2,
+	                              double* gradient, double* hessian = nullptr) const;
+
+	// Stores prefix sums of the rows of voxels along the chosen axes.
+	// A line which stays within one row along an indexed axis (e.g. an
+	// axis-aligned line) and crosses at least two voxel boundaries is
+	// then integrated in constant time. Uses one double per voxel and
+	// indexed axis.
+	void index_axes(bool x, bool y, bool z);
 private:
+	template<typename> friend class BasicStencilLineIntegral;
+	template<typename> friend class BasicTriLinear;
+
+	// The line integral from the prefix sums, if the line is in an
+	// indexed row.
+	template<typename R>
+	bool row_integral(R x1, R y1, R z1,
+	                  R x2, R y2, R z2,
+	                  R* cost, R* length) const;
+
+	// Sum of the voxels from the center of voxel (x, y, z) to the
+	// center of the voxel steps away along indexed axis a. Not finite
+	// if the row contains infinite voxels.
+	double center_row_sum(int a, int x, int y, int z, int steps) const;
+
+	// Calls segment(begin, end, voxel, begin_axis, end_axis) for every
+	// part of the line inside a single voxel, in order from the start.
+	// begin and end are distances along the line and begin_axis and
+	// end_axis the axes of the voxel boundaries there (-1 at the ends
+	// of the line).
+	template<typename R, typename Segment>
+	void line_segments(R x1, R y1, R z1,
+	                   R x2, R y2, R z2,
+	                   Segment segment) const;
+
 	int xyz_to_ind(double x, double y, double z) const;
 	template<typename R> 	bool inside_volume(R x, R y, R s) const;
 	int M, N, O;
-	const double* unary;
+	const Voxel* unary;
+	VolumeLayout layout;
 	const std::vector<double> voxeldimensions;
+	double scale, offset;
+
+	// Entry r*(size + 1) + i of prefix_sums[a] is the sum of the first
+	// i voxels of row r along axis a, where the rows are numbered by
+	// the next two axes, e.g. y + N*z for the x axis. Empty if the axis
+	// is not indexed.
+	std::vector<double> prefix_sums[3];
 };
 
-class TriLinear
+typedef BasicPieceWiseConstant<double> PieceWiseConstant;
+
+// Line integrals of a PieceWiseConstant volume along a fixed set of
+// integer offsets, e.g. the connectivity of a grid graph.
+//
+// Starting in a voxel center, the voxels crossed by the line and the
+// length inside each of them only depend on the offset. They are
+// computed once per offset, after which a line integral is a short
+// weighted sum of voxel values. The results are the same as those of
+// PieceWiseConstant.
+template<typename Voxel>
+class BasicStencilLineIntegral
 {
 public:
-	TriLinear(const double * unary,
-	          int M, int N, int O,
-	          const std::vector<double>& voxeldimensions);
+	// offsets contains (dx, dy, dz) for every direction.
+	BasicStencilLineIntegral(const Voxel * unary,
+	                         int M, int N, int O,
+	                         const std::vector<double>& voxeldimensions,
+	                         const std::vector<int>& offsets,
+	                         double scale = 1.0, double offset = 0.0);
+
+	// All offsets of length at most dmax, i.e. the edges of a
+	// GridMesh with the same dmax.
+	BasicStencilLineIntegral(const Voxel * unary,
+	                         int M, int N, int O,
+	                         const std::vector<double>& voxeldimensions,
+	                         double dmax,
+	                         double scale = 1.0, double offset = 0.0);
+
+	BasicStencilLineIntegral(const Voxel * unary,
+	                         const VolumeLayout& layout,
+	                         const std::vector<double>& voxeldimensions,
+	                         const std::vector<int>& offsets,
+	                         double scale = 1.0, double offset = 0.0);
+
+	BasicStencilLineIntegral(const Voxel * unary,
+	                         const VolumeLayout& layout,
+	                         const std::vector<double>& voxeldimensions,
+	                         double dmax,
+	                         double scale = 1.0, double offset = 0.0);
+
+	// Number of directions.
+	int size() const { return num_directions; }
+
+	// Index of the direction with offset (dx, dy, dz) or -1.
+	int direction(int dx, int dy, int dz) const;
+
+	// Line integral from the center of voxel (x, y, z) in direction k.
+	// Infinite if the line ends outside the volume.
+	double evaluate_line_integral(int x, int y, int z, int k) const;
+
+	// The line integrals in all directions from the center of voxel
+	// (x, y, z), evaluated together.
+	void evaluate_line_integrals(int x, int y, int z, double* integrals) const;
+
+	// As BasicPieceWiseConstant::index_axes. Directions along an indexed
+	// axis spanning at least min_length voxels then use the prefix sums
+	// instead of the stencils. Shorter stencils read fewer cache lines
+	// than the two rows of prefix sums.
+	void index_axes(bool x, bool y, bool z, int min_length = 64);
+
+	// Arbitrary line. Uses the stencils if the line starts in a voxel
+	// center and goes along one of the offsets.
+	double evaluate_line_integral(double x1, double y1, double z1,
+	                              double x2, double y2, double z2) const;
+
+	template<typename R>
+	R evaluate_line_integral(R x1, R y1, R z1,
+	                         R x2, R y2, R z2) const
+	{
+		return data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2);
+	}
+
+	// As BasicPieceWiseConstant.
+	double evaluate_line_integral(double x1, double y1, double z1,
+	                              double x2, double y2, double z2,
+	                              double* gradient, double* hessian = nullptr) const
+	{
+		return data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2, gradient, hessian);
+	}
+
+private:
+	void create_stencils();
+	int xyz_to_ind(int x, int y, int z) const;
+	bool inside_volume(int x, int y, int z) const;
+
+	BasicPieceWiseConstant<Voxel> data_term;
+	int M, N, O;
+	const Voxel* unary;
+	VolumeLayout layout;
+	double scale, offset;
+
+	int num_directions;
+	int stencil_length;
+	std::vector<int> offsets;
+
+	// Entry i*num_directions + k is the i:th voxel crossed in direction
+	// k, relative to the start voxel, and the length inside it.
+	// Shorter stencils are padded with zero weights. voxel_offset is
+	// the difference in memory, which is the same for every start
+	// voxel in column major order only. Other layouts use the
+	// coordinate differences voxel_x, voxel_y and voxel_z instead.
+	std::vector<int> voxel_offset;
+	std::vector<int> voxel_x, voxel_y, voxel_z;
+	std::vector<double> weight;
+	std::vector<int> num_segments;
+	// Length of the line in every direction.
+	std::vector<double> line_length;
+
+	// Direction index for every offset within max_offset.
+	int max_offset;
+	std::vector<int> direction_table;
+
+	// Entry k is the axis of direction k if it is integrated with the
+	// prefix sums and -1 otherwise. Empty if no axis is indexed.
+	std::vector<int> row_axis;
+};
+
+typedef BasicStencilLineIntegral<double> StencilLineIntegral;
+
+// Trilinear interpolation between the voxel centers. Beyond the
+// outermost centers the border values are extended.
+template<typename Voxel>
+class BasicTriLinear
+{
+public:
+	BasicTriLinear(const Voxel * unary,
+	               int M, int N, int O,
+	               const std::vector<double>& voxeldimensions,
+	               double scale = 1.0, double offset = 0.0);
+
+	BasicTriLinear(const Voxel * unary,
+	               const VolumeLayout& layout,
+	               const std::vector<double>& voxeldimensions,
+	               double scale = 1.0, double offset = 0.0);
 
 	template<typename R>
 	R evaluate(R x, R y, R z = 0.0) const;
 
+	// Exact integral of the interpolated volume along the line.
 	template<typename R>
 	R evaluate_line_integral(R x1, R y1, R z1,
 	                         R x2, R y2, R z2) const;
+
+	// As BasicPieceWiseConstant.
+	double evaluate_line_integral(double x1, double y1, double z1,
+	                              double x2, double y2, double z2,
+	                              double* gradient, double* hessian = nullptr) const;
 private:
-	int xyz_to_ind(double x, double y, double z) const;
+	// The eight voxels around the cell with lower corner (x, y, z).
+	// Returns false if any of them is infinite.
+	bool cell_values(int x, int y, int z, double V[8]) const;
+
+	// Interpolates V at (rx, ry, rz) within the cell.
+	template<typename R>
+	static R interpolate(const double V[8], bool finite,
+	                     const R& rx, const R& ry, const R& rz);
+
+	// The interpolant and its gradient and Hessian (3 x 3).
+	static void interpolate(const double V[8], bool finite,
+	                        double rx, double ry, double rz,
+	                        double* value, double gradient[3], double hessian[9]);
+
+	int xyz_to_ind(int x, int y, int z) const;
+
+	// Used for its voxel traversal, with the voxel boundaries
+	// moved to the voxel centers.
+	BasicPieceWiseConstant<Voxel> cells;
 	int M, N, O;
-	const double* unary;
+	const Voxel* unary;
+	VolumeLayout layout;
 	const std::vector<double> voxeldimensions;
+	double scale, offset;
 };
 
+typedef BasicTriLinear<double> TriLinear;
+
 }  // namespace curve_extraction
 
 #endif
@@ -0,0 +1,75 @@
+// Petter Strandmark 2013.
+#ifndef CURVE_EXTRACTION_MULTI_VIEW_DATA_TERM_H
+#define CURVE_EXTRACTION_MULTI_VIEW_DATA_TERM_H
+
+#include <vector>
+
+#include <curve_extraction/data_term.h>
+#include <curve_extraction/mesh.h>
+
+namespace curve_extraction {
+
+// The data cost of a line in 3D from several 2D images of it: the line
+// is projected into every image and the line integrals of the images
+// along the projections are aggregated.
+//
+// The projections of the mesh points are computed once, when the data
+// term is created, so the mesh must not be transformed afterwards.
+class MultiViewDataTerm
+{
+public:
+	enum Aggregation { max_aggregation, sum_aggregation, soft_max_aggregation };
+
+	// An image of width x height pixels, stored as x + width*y, and its
+	// 3 x 4 camera matrix in row major order. The image is not copied.
+	struct View
+	{
+		const double* image;
+		int width, height;
+		double camera[12];
+	};
+
+	// Soft-max aggregation is temperature*log(sum exp(cost/temperature)),
+	// which approaches the maximum as the temperature goes to zero.
+	MultiViewDataTerm(const Mesh& mesh,
+	                  const std::vector<View>& views,
+	                  Aggregation aggregation = max_aggregation,
+	                  double temperature = 1.0);
+
+	int number_of_views() const { return num_views; }
+
+	// Projection of mesh point p into a view. Points projected outside
+	// the image are moved to the nearest pixel center.
+	double image_x(int p, int view) const { return projections[2*(p*num_views + view)]; }
+	double image_y(int p, int view) const { return projections[2*(p*num_views + view) + 1]; }
+
+	// Cost of the line between mesh points p1 and p2.
+	double evaluate_line_integral(int p1, int p2) const;
+
+	// Cost of edge e of the mesh. Cached if enable_edge_cache has been
+	// called.
+	double evaluate_edge(int e) const;
+
+	// Stores the cost of every edge when it is first evaluated. The
+	// cache is not synchronized, so edges may then only be evaluated
+	// from one thread at a time.
+	void enable_edge_cache();
+
+private:
+	const Mesh& mesh;
+	int num_views;
+	Aggregation aggregation;
+	double temperature;
+
+	std::vector<PieceWiseConstant> images;
+	// Entry 2*(p*num_views + view) is the x coordinate of point p in
+	// the view, followed by the y coordinate.
+	std::vector<double> projections;
+
+	// NaN for edges not yet evaluated.
+	mutable std::vector<double> edge_cache;
+};
+
+}  // namespace curve_extraction
+
+#endif
@@ -87,6 +87,21 @@ double shortest_path(// The number of nodes in the graph.
                      // (optional) Options to the solver.
                      const ShortestPathOptions& options = ShortestPathOptions());
 
+// Same as above, but every node in the start set has an initial
+// distance. This replaces a synthetic source node connected to all
+// start nodes, which would expand them all in a single call to
+// get_neighbors.
+double shortest_path(// The number of nodes in the graph.
+                     int n,
+                     // The nodes from which to compute the path along
+                     // with their initial distances.
+                     const std::vector<std::pair<int, double>>& start_set,
+                     const std::set<int>& end_set,
+                     const std::function<void(int, std::vector<Neighbor>* neighbors)>& get_neighbors,
+                     std::vector<int>* path,
+                     const std::function<double(int)>* get_lower_bound = 0,
+                     const ShortestPathOptions& options = ShortestPathOptions());
+
 // Identical function except that the last argument is
 // a const reference instead of a pointer.
 double shortest_path(int n,
@@ -0,0 +1,75 @@
+// Petter Strandmark 2013.
+#ifndef CURVE_EXTRACTION_VOLUME_LAYOUT_H
+#define CURVE_EXTRACTION_VOLUME_LAYOUT_H
+
+#include <cstddef>
+#include <vector>
+
+namespace curve_extraction {
+
+// The position in memory of voxel (x, y, z) of an M x N x O volume.
+//
+// The position is a sum of one table entry per axis, which covers the
+// column major order of MATLAB, x + M*y + M*N*z, as well as bricked
+// orders where every cube of brick_size^3 voxels is contiguous. In
+// column major order a step in z jumps M*N voxels, so the lines around
+// a voxel touch many cache lines and pages. In a bricked volume they
+// mostly stay within a few bricks.
+class VolumeLayout
+{
+public:
+	// Column major order.
+	VolumeLayout(int M, int N, int O);
+
+	// Bricks of brick_size^3 voxels. The bricks, and the voxels within
+	// each brick, are in column major order. The volume is padded to
+	// whole bricks.
+	static VolumeLayout bricked(int M, int N, int O, int brick_size = 8);
+
+	// Coordinates one voxel outside the volume give the nearest voxel
+	// on the border.
+	int index(int x, int y, int z) const
+	{
+		return x_offset[x + 1] + y_offset[y + 1] + z_offset[z + 1];
+	}
+
+	// Number of voxels stored, including the padding.
+	std::size_t size() const { return num_voxels; }
+
+	bool is_column_major() const { return brick_size == 0; }
+
+	// Copies a volume in column major order into this layout.
+	template<typename Voxel>
+	std::vector<Voxel> reorder(const Voxel* volume) const
+	{
+		std::vector<Voxel> reordered(num_voxels, Voxel(0));
+
+		#ifdef USE_OPENMP
+		#pragma omp parallel for
+		#endif
+		for (int z = 0; z < O; ++z) {
+			for (int y = 0; y < N; ++y) {
+				const Voxel* row = volume + M*y + std::size_t(M)*N*z;
+				for (int x = 0; x < M; ++x) {
+					reordered[index(x, y, z)] = row[x];
+				}
+			}
+		}
+
+		return reordered;
+	}
+
+	int M, N, O;
+
+private:
+	void clamp_borders();
+
+	int brick_size;
+	std::size_t num_voxels;
+	// Entry i + 1 is the term of coordinate i.
+	std::vector<int> x_offset, y_offset, z_offset;
+};
+
+}  // namespace curve_extraction
+
+#endif
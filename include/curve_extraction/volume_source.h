@@ -0,0 +1,99 @@
+// Petter Strandmark 2013.
+#ifndef CURVE_EXTRACTION_VOLUME_SOURCE_H
+#define CURVE_EXTRACTION_VOLUME_SOURCE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace curve_extraction {
+
+// A volume in a file, memory mapped so that only the pages which are
+// used are read, and so that several processes share one copy in the
+// page cache. The voxels are passed to the data terms without copying.
+//
+// The file format is the raw encoding of NRRD: a text header ending
+// with an empty line, e.g.
+//
+//     NRRD0004
+//     type: uint16
+//     dimension: 3
+//     sizes: 512 512 300
+//     spacings: 1 1 2.5
+//     encoding: raw
+//     endian: little
+//
+// followed by the voxels in column major order. The voxels may instead
+// be in a separate raw file, given by "data file: <name>" (relative to
+// the header) and optionally "byte skip: <n>". The types are uint8,
+// uint16, float and double (or their NRRD synonyms).
+class VolumeSource
+{
+public:
+	enum VoxelType { uint8_voxels, uint16_voxels, float_voxels, double_voxels };
+
+	// Hints for the operating system about the order in which the
+	// voxels are read. Sequential access reads ahead aggressively;
+	// random access, e.g. during a search, reads single pages only.
+	enum AccessPattern { normal_access, sequential_access, random_access };
+
+	// Throws std::runtime_error if the file can not be read.
+	explicit VolumeSource(const std::string& file_name,
+	                      AccessPattern access = normal_access);
+	~VolumeSource();
+
+	void advise(AccessPattern access) const;
+
+	VoxelType type() const { return voxel_type; }
+
+	// Voxels along dimension d (0, 1 or 2).
+	int size(int d) const { return sizes[d]; }
+	std::size_t numel() const { return std::size_t(sizes[0])*sizes[1]*sizes[2]; }
+
+	// From the spacings of the header; 1 if there are none.
+	const std::vector<double>& voxel_dimensions() const { return spacings; }
+
+	// The text of the header and the file holding the voxels, e.g. to
+	// recognize a volume without reading its voxels.
+	const std::string& header() const { return header_text; }
+	const std::string& data_file() const { return data_file_name; }
+
+	// The voxels in column major order. Throws std::runtime_error if
+	// Voxel is not the type of the file.
+	template<typename Voxel>
+	const Voxel* voxels() const;
+
+	// Writes a volume which is mapped without copying, i.e. with the
+	// voxels starting on a page boundary.
+	template<typename Voxel>
+	static void write(const std::string& file_name,
+	                  const Voxel* voxels,
+	                  int M, int N, int O,
+	                  const std::vector<double>& voxeldimensions);
+
+private:
+	VolumeSource(const VolumeSource&);
+	VolumeSource& operator=(const VolumeSource&);
+
+	void map(const std::string& data_file_name, std::size_t offset);
+
+	VoxelType voxel_type;
+	int sizes[3];
+	std::vector<double> spacings;
+
+	std::string header_text;
+	std::string data_file_name;
+
+	// The whole mapped file and the voxels within it.
+	char* mapping;
+	std::size_t mapping_size;
+	const char* data;
+
+	// Used instead of a mapping where there is no mmap, or if the
+	// voxels in the file are not aligned.
+	std::vector<double> buffer;
+};
+
+}  // namespace curve_extraction
+
+#endif
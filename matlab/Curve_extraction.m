@@ -6,6 +6,7 @@
 % + length_penalty (length of curve segment)
 % + curvature_penalty |curvature of curve segment|^curvature_power
 % + torsion_penalty |torsion of curve segment|^torsion_power
+% + jounce_penalty |jounce of curve segment|^jounce_power
 %
 % The data cost is given by nearest neighbor interpolation of the data matrix.
 %
@@ -30,9 +31,11 @@ classdef Curve_extraction < Curve_extraction_base
 		length_penalty;
 		curvature_penalty;
 		torsion_penalty;
+		jounce_penalty;
 		
 		curvature_power;
 		torsion_power;
+		jounce_power;
 		
 		length_global_limit;
 		curvature_global_limit;
@@ -55,6 +58,10 @@ classdef Curve_extraction < Curve_extraction_base
 			self.penalty(3) = torsion_penalty;
 		end
 		
+		function set.jounce_penalty(self, jounce_penalty)
+			self.penalty(4) = jounce_penalty;
+		end
+		
 		function length_penalty = get.length_penalty(self)
 			length_penalty = self.penalty(1);
 		end
@@ -67,6 +74,10 @@ classdef Curve_extraction < Curve_extraction_base
 			torsion_penalty = self.penalty(3);
 		end
 		
+		function jounce_penalty = get.jounce_penalty(self)
+			jounce_penalty = self.penalty(4);
+		end
+		
 		% Power
 		function set.curvature_power(self, curvature_power)
 			self.power(2) = curvature_power;
@@ -76,6 +87,10 @@ classdef Curve_extraction < Curve_extraction_base
 			self.power(3) = torsion_power;
 		end
 		
+		function set.jounce_power(self, jounce_power)
+			self.power(4) = jounce_power;
+		end
+		
 		function curvature_power = get.curvature_power(self)
 			curvature_power = self.power(2);
 		end
@@ -83,6 +98,10 @@ classdef Curve_extraction < Curve_extraction_base
 		function torsion_power = get.torsion_power(self)
 			torsion_power = self.power(3);
 		end
+		
+		function jounce_power = get.jounce_power(self)
+			jounce_power = self.power(4);
+		end
 				
 		% Global limit
 		function set.length_global_limit(self, length_global_limit)
@@ -117,6 +136,7 @@ classdef Curve_extraction < Curve_extraction_base
 			cost.length = base_cost.pair;
 			cost.curvature = base_cost.triplet;
 			cost.torsion = base_cost.quad;
+			cost.jounce = base_cost.pentuple;
 		end
 
 		function info = get.info(self)
@@ -126,23 +146,32 @@ classdef Curve_extraction < Curve_extraction_base
 			info.length =  base_info.pair;
 			info.curvature= base_info.triplet;
 			info.torsion = base_info.quad;
+			info.jounce = base_info.pentuple;
 		end
 	end
 	
 	methods
 		
 		% Used when the data cost is defined by by performing linear interpolation a 2D or 3D matrix.
+		% data may also be the name of a NRRD file (see volume_source.h),
+		% which is memory mapped by the mex files instead of loaded.
 		function self = Curve_extraction(data, varargin)
 			self = self@Curve_extraction_base;
 
 			self.data = data;
-			self.problem_size  = size(self.data);
+			if ischar(data)
+				[self.problem_size, spacings] = volume_file_info(data);
+				self.voxel_dimensions = spacings;
+			else
+				self.problem_size  = size(self.data);
+			end
 			
 			self.create_mesh_map(varargin{:});
 			self.set_connectivity_by_radius(self.default_connectivity_radius);
 
 			self.curvature_power = 2;
 			self.torsion_power = 2;
+			self.jounce_power = 2;
 		end
 		
 		% Show information about the stored shortest path and settings.
@@ -172,7 +201,7 @@ classdef Curve_extraction < Curve_extraction_base
 					self.info.length,  self.curvature_power, self.info.curvature,  self.torsion_power, self.info.torsion);
 			end
 
-			if (length(self.problem_size) == 2 && strcmp(self.data_type,'linear_interpolation'))
+			if (length(self.problem_size) == 2 && strcmp(self.data_type,'linear_interpolation') && ~ischar(self.data))
 				cost_im = self.data;
 				cost_im(self.mesh_map ~= 1) = -1;
 				imagesc(double(cost_im))
@@ -29,12 +29,53 @@ classdef (Abstract) Curve_extraction_base < handle
 		% by A*.
 		use_a_star = true;
 
+		% Lower bound used by A* when torsion regularization is used.
+		% 'node': distance in the graph without curvature (default).
+		% 'edge_min', 'edge_uint16', 'edge_uint8': distance in the graph
+		% with curvature. Tighter, but more expensive to compute. Stored as
+		% one float per voxel or as 2 or 1 bytes per voxel and connectivity.
+		a_star_heuristic = 'node';
+
+		% Keep the node A* heuristic between shortest path calls with the same
+		% data, mesh map and connectivity (e.g. in the supergradient iterations).
+		% It is released by "clear mex".
+		cache_a_star_heuristic = true;
+
+		% If non-empty, the node A* heuristic is also stored in and loaded
+		% from this file.
+		a_star_heuristic_file = '';
+
 		% Verbose information from the optimization.
 		verbose = false;
 
 		% Store the visit order when performing shortest path calculations.
 		store_visit_time = false;
 
+		% Cache the data cost of every edge when curvature or torsion
+		% regularization is used. Uses 4 bytes per voxel and connectivity,
+		% and is skipped if that exceeds data_cost_cache_memory (MB).
+		cache_data_cost = true;
+		data_cost_cache_memory = 1024;
+
+		% Compute the complete data cost cache before the shortest path
+		% calculations (in parallel).
+		prefill_data_cost = false;
+
+		% Memory limit (MB) for caching data dependent length costs
+		% (e.g. geodesic length). Uses 4 bytes per voxel and connectivity.
+		pair_cost_cache_memory = 1024;
+
+		% Precompute the data cost of every edge in parallel and keep it
+		% between calls on the same data and connectivity (released by
+		% "clear mex"). One of 'none', 'float32', 'float16' and 'uint16';
+		% the last two use 2 bytes per voxel and connectivity but round
+		% the costs.
+		edge_cost_storage = 'none';
+
+		% If non-empty, the precomputed edge costs are also stored in
+		% and memory mapped from this file.
+		edge_cost_file = '';
+
 		% Number of threads the optimizer uses.
 		% Three parts of the code are parallelized.
 		% 1. All costs in a neighborhood.
@@ -42,7 +83,18 @@ classdef (Abstract) Curve_extraction_base < handle
 		% 3. Local optimization.
 		num_threads = int32(1);
 
+		% Linear interpolation also accepts single, uint8 and uint16 data,
+		% which is used without conversion. A voxel with value v has the
+		% data cost data_scale*v + data_offset.
 		data =  [];
+		data_scale = 1;
+		data_offset = 0;
+
+		% Copy the data into bricks of brick_size^3 voxels (e.g. 8) before
+		% a linear interpolation search, so that the voxels around each
+		% point are close in memory. Helps for volumes much larger than
+		% the processor cache; 0 uses the data as is.
+		brick_size = 0;
 
 		% Defines the connectivity as a delta functions
 		% Each row is a new edge
@@ -131,12 +183,24 @@ classdef (Abstract) Curve_extraction_base < handle
 			settings.local_limit = self.local_limit;
 
 			settings.use_a_star = self.use_a_star;
+			settings.a_star_heuristic = self.a_star_heuristic;
+			settings.cache_a_star_heuristic = self.cache_a_star_heuristic;
+			settings.a_star_heuristic_file = self.a_star_heuristic_file;
 			settings.verbose = self.verbose;
 			settings.data_type = self.data_type;
 			settings.maxiter = self.local_optimization_maxiter;
 			settings.store_visit_time =  self.store_visit_time;
+			settings.cache_data_cost = self.cache_data_cost;
+			settings.prefill_data_cost = self.prefill_data_cost;
+			settings.data_cost_cache_memory = self.data_cost_cache_memory;
+			settings.pair_cost_cache_memory = self.pair_cost_cache_memory;
+			settings.edge_cost_storage = self.edge_cost_storage;
+			settings.edge_cost_file = self.edge_cost_file;
 			settings.descent_method = self.descent_method;
 			settings.voxel_dimensions = self.voxel_dimensions;
+			settings.data_scale = self.data_scale;
+			settings.data_offset = self.data_offset;
+			settings.brick_size = self.brick_size;
 			settings.num_threads = self.num_threads;
 			
 			settings = self.parse_settings(settings);
@@ -144,7 +208,7 @@ classdef (Abstract) Curve_extraction_base < handle
 		
 		% Make sure all data is in correct form.
 		function settings = parse_settings(~, settings)
-			int_entries = {'num_threads', 'maxiter'};
+			int_entries = {'num_threads', 'maxiter', 'brick_size'};
 			for i = 1:numel(int_entries)
 				if (isfield(settings,int_entries{i}))
 					val = int32(getfield(settings,  int_entries{i})); %#ok<*GFLD>
@@ -152,7 +216,8 @@ classdef (Abstract) Curve_extraction_base < handle
 				end
 			end
 			
-			bool_entries = {'verbose','use_a_star','store_visit_time','store_parents' };
+			bool_entries = {'verbose','use_a_star','store_visit_time','store_parents', ...
+			                'cache_data_cost', 'prefill_data_cost', 'cache_a_star_heuristic'};
 			for i = 1:numel(bool_entries)
 				if (isfield(settings,bool_entries{i}))
 					val = logical(getfield(settings,  bool_entries{i}));
@@ -161,8 +226,13 @@ classdef (Abstract) Curve_extraction_base < handle
 			end
 		end
 
+		% The shortest path solvers avoid the disallowed voxels through the
+		% mesh map. Floating point data is also marked with inf, which local
+		% optimization relies on; integer data can not hold inf.
 		function data = preprocess_data(self,data)
-			data(self.disallowed_set) = inf;
+			if isfloat(data)
+				data(self.disallowed_set) = inf;
+			end
 		end
 
 		% Create a mesh_map which is used internally to keep track on
@@ -431,7 +501,13 @@ classdef (Abstract) Curve_extraction_base < handle
 				curve = self.interpolate_more_points(curve, self.local_optimzation_max_curve_segment_length);
 			end
 
-			data = self.preprocess_data(self.data);
+			% Local optimization only avoids disallowed voxels through inf data,
+			% which mapped volume files can not hold.
+			data = self.data;
+			if ~isfloat(data) && ~ischar(data)
+				data = double(data);
+			end
+			data = self.preprocess_data(data);
 
 			settings = gather_settings(self);
 			compile('local_optimization');
@@ -535,6 +611,17 @@ classdef (Abstract) Curve_extraction_base < handle
 				self.descent_method = method;
 		end
 
+		function set.a_star_heuristic(self, heuristic)
+				switch heuristic
+					case {'node', 'edge_min', 'edge_uint16', 'edge_uint8'}
+						%ok
+					otherwise
+						error('Possible A* heuristics = {node, edge_min, edge_uint16, edge_uint8}');
+				end
+
+				self.a_star_heuristic = heuristic;
+		end
+
 		function set.connectivity(self, connectivity)
 
 			assert((size(connectivity,2) ~= 3) ||  (size(connectivity,2) ~= 2))
@@ -556,7 +643,12 @@ classdef (Abstract) Curve_extraction_base < handle
 		end
 
 		function set.data(self, data)
-			if (~isa(data,'double'));
+			compact = isa(data,'single') || isa(data,'uint8') || isa(data,'uint16') || ischar(data);
+			if (compact && strcmp(self.data_type,'linear_interpolation'))
+				self.data = data;
+			elseif (isa(data,'single') && strcmp(self.data_type,'edge'))
+				self.data = data;
+			elseif (~isa(data,'double'));
 				disp('Data-term must be a double, converting.');
 				self.data = double(data);
 			else
@@ -764,11 +856,13 @@ classdef (Abstract) Curve_extraction_base < handle
 			cost.pair = nan;
 			cost.triplet = nan;
 			cost.quad = nan;
+			cost.pentuple = nan;
 			
 			info.data = nan;
 			info.pair = nan;
 			info.triplet = nan;
 			info.quad = nan;
+			info.pentuple = nan;
 
 			
 			if ~isempty(curve)
@@ -779,7 +873,7 @@ classdef (Abstract) Curve_extraction_base < handle
 				compile('curve_info');
 
 				[cost.total, cost.data, cost.pair, cost.triplet, cost.quad, ...
-				info.pair, info.triplet, info.quad] ...
+				info.pair, info.triplet, info.quad, cost.pentuple, info.pentuple] ...
 				= curve_info_mex(self.data_type, self.data, curve,  ...
 													self.connectivity, settings);
 												
@@ -8,6 +8,7 @@
 % + torsion_penalty |torsion of curve segment|^torsion_power
 %
 % The data cost is explicitly defined for each direction by the data matrix (see an example in /examples)
+% The data matrix may be single to halve its memory.
 %
 % This class minimizes:
 % ----
@@ -26,9 +27,10 @@ classdef Curve_extraction_edge < Curve_extraction
 			sz = size(data);
 			self.problem_size = sz(1:end-1);
 			
+			% Before the data, which may then be single.
+			self.data_type = 'edge';
 			self.data = data;
 			self.connectivity = int32(connectivity);
-			self.data_type = 'edge';
 
 			self.create_mesh_map(varargin{:});
 		end
@@ -1,7 +1,17 @@
 % Geodesic shortest path
 %
 % This class find the geodesic shortest path between two sets on a surface.
-% The surface is defined as the function graph of discrete depth map.
+% The surface is defined either as the function graph of discrete depth map
+% (2D data) or as the zero level set of a signed distance volume (3D data),
+% with distances in the units of the voxel dimensions.
+%
+% In a volume, the length of a curve is the length of its projection onto
+% the surface. The projection is accurate close to the surface, so voxels
+% farther from it than surface_band are disallowed.
+%
+% The data is passed on unchanged and the solvers keep to the allowed
+% voxels through the mesh map. Local optimization has no mesh map, but
+% the projected length barely changes when points move off the surface.
 %
 classdef Geodesic_shortest_path < Curve_extraction_base
 	
@@ -11,6 +21,10 @@ classdef Geodesic_shortest_path < Curve_extraction_base
 		data_type = 'geodesic';
 	end
 
+	properties (Constant)
+		surface_band = 1;
+	end
+
 	methods
 		function cost = get.cost(self)
 			base_cost = self.get_cost();
@@ -28,12 +42,26 @@ classdef Geodesic_shortest_path < Curve_extraction_base
 		function self = Geodesic_shortest_path(data, varargin)
 			self = self@Curve_extraction_base;
 
-			if ~ismatrix(data)
-				error('Only 2D dimensional data supported by geodesic shortest path');
+			if ndims(data) > 3
+				error('Only 2D and 3D dimensional data supported by geodesic shortest path');
 			end
 
 			self.data = data;
 			self.problem_size  = size(self.data);
+
+			if ndims(data) == 3
+				if numel(varargin) < 2
+					varargin{2} = false(self.problem_size);
+				end
+
+				far = abs(data) > self.surface_band;
+				if numel(varargin) < 3
+					varargin{3} = far;
+				else
+					varargin{3} = varargin{3} | far;
+				end
+			end
+
 			self.create_mesh_map(varargin{:});
 			self.set_connectivity_by_radius(self.default_connectivity_radius);
 
@@ -53,6 +81,18 @@ classdef Geodesic_shortest_path < Curve_extraction_base
 				curve = self.curve;
 			end
 
+			if ndims(self.data) == 3
+				clf; hold on;
+				surface = patch(isosurface(self.data, 0));
+				set(surface, 'FaceColor', [0.8 0.8 0.8], 'EdgeColor', 'none', 'FaceAlpha', 0.5);
+				camlight; axis equal; view(3);
+
+				if ~isempty(curve)
+					plot3(curve(:,2), curve(:,1), curve(:,3), 'r-', 'linewidth', 2);
+				end
+				return;
+			end
+
 			clf; hold on;
 			msgs = {};
 
@@ -94,11 +134,16 @@ classdef Geodesic_shortest_path < Curve_extraction_base
 			title(sprintf('Curve length: %g.', self.length()));
 			curve3d = self.curve;
 
-			for ind = 1:size(self.curve, 1)
-				x = self.curve(ind, 1);
-				y = self.curve(ind, 2);
-				z = self.voxel_dimensions(3) * interp2(self.data, x, y, 'linear');
-				curve3d(ind, 3) = z;
+			if ndims(self.data) == 3
+				% Same axes as isosurface.
+				curve3d = curve3d(:, [2 1 3]);
+			else
+				for ind = 1:size(self.curve, 1)
+					x = self.curve(ind, 1);
+					y = self.curve(ind, 2);
+					z = self.voxel_dimensions(3) * interp2(self.data, x, y, 'linear');
+					curve3d(ind, 3) = z;
+				end
 			end
 
 			cmap = jet(3);
@@ -118,4 +163,11 @@ classdef Geodesic_shortest_path < Curve_extraction_base
 			L = self.info;
 		end
 	end
+
+	methods (Access = protected)
+		% The length within a voxel interpolates the data and its gradient
+		% from the neighbouring voxels, so no voxel is set to inf.
+		function data = preprocess_data(self, data)
+		end
+	end
 end
\ No newline at end of file
@@ -0,0 +1,38 @@
+% Compares the A* lower bounds available for torsion regularization.
+% The node heuristic ignores curvature and is cheap to compute.
+% The edge heuristics include curvature; they need far fewer
+% evaluations but are more expensive to compute up front.
+close all; clear all;
+addpath([fileparts(mfilename('fullpath')) filesep '..']);
+
+rng(1)
+n = 30;
+data = rand(n,n,20);
+
+start_set = false(size(data));
+end_set = false(size(data));
+disallowed = false(size(data));
+
+start_set(:,:,1) = true;
+end_set(:,:,end) = true;
+
+C = Curve_extraction(data, start_set, end_set, disallowed);
+C.set_connectivity_by_radius(2);
+C.use_a_star = true;
+
+C.length_penalty = 1;
+C.curvature_penalty = 20;
+C.torsion_penalty = 1;
+
+heuristics = {'node', 'edge_min', 'edge_uint16', 'edge_uint8'};
+
+fprintf('%-12s %12s %12s %12s %12s\n', 'heuristic', 'cost', 'evaluations', 'search (s)', 'total (s)');
+for i = 1:numel(heuristics)
+	C.a_star_heuristic = heuristics{i};
+
+	tic;
+	[~, cost, time, evaluations] = C.shortest_path();
+	total = toc;
+
+	fprintf('%-12s %12g %12d %12g %12g\n', heuristics{i}, cost, evaluations, time, total);
+end
@@ -0,0 +1,159 @@
+#pragma once
+
+// Symmetries of the connectivity stencil.
+//
+// The regularization costs only depend on the shape of a curve, so they
+// do not change when the curve is mirrored in an axis or when two axes
+// with the same voxel size are swapped. The directions from
+// get_all_directions.m are closed under these transforms (48 of them in
+// 3D, 8 in 2D). Tables over pairs, triples or quadruples of directions
+// therefore only need to be evaluated once per orbit and can then be
+// filled in with lookups.
+class Connectivity_symmetry
+{
+public:
+  Connectivity_symmetry(const matrix<int>& connectivity,
+                        const std::vector<double>& voxel_dimensions)
+    : num_directions(connectivity.M), opposite(connectivity.M, -1)
+  {
+    const int K = num_directions;
+
+    std::map<std::tuple<int,int,int>, int> direction_index;
+    for (int k = 0; k < K; k++)
+      direction_index[std::make_tuple(connectivity(k,0), connectivity(k,1), connectivity(k,2))] = k;
+
+    std::vector<double> dims(3, 1.0);
+    for (int a = 0; a < 3 && a < voxel_dimensions.size(); a++)
+      dims[a] = voxel_dimensions[a];
+
+    const int permutations[6][3] = { {0,1,2}, {0,2,1}, {1,0,2},
+                                     {1,2,0}, {2,0,1}, {2,1,0} };
+
+    for (int p = 0; p < 6; p++)
+    for (int signs = 0; signs < 8; signs++)
+    {
+      const int* axis = permutations[p];
+
+      // Axes may only be swapped if the voxels have the same size along them.
+      bool valid = dims[axis[0]] == dims[0] &&
+                   dims[axis[1]] == dims[1] &&
+                   dims[axis[2]] == dims[2];
+
+      std::vector<int> image(K);
+      for (int k = 0; k < K && valid; k++)
+      {
+        int v[3];
+        for (int a = 0; a < 3; a++)
+          v[a] = ((signs >> a) & 1 ? -1 : 1) * connectivity(k, axis[a]);
+
+        auto itr = direction_index.find(std::make_tuple(v[0], v[1], v[2]));
+        if (itr == direction_index.end())
+          valid = false;
+        else
+          image[k] = itr->second;
+      }
+
+      if (valid)
+        transforms.push_back(image);
+
+      // All signs flipped.
+      if (valid && p == 0 && signs == 7)
+        opposite = image;
+    }
+  }
+
+  // Number of transforms mapping the stencil onto itself, including
+  // the identity.
+  int size() const
+  {
+    return transforms.size();
+  }
+
+  // Entry n of the result is the smallest index in the orbit of the
+  // tuple of directions with index n = (k1*K + k2)*K + ... + kL.
+  //
+  // If reversible is set, a tuple is also equivalent to its reversal
+  // with every direction negated, i.e. the same curve traversed
+  // backwards.
+  std::vector<int> canonical_tuples(int length, bool reversible = false) const
+  {
+    const int K = num_directions;
+
+    int num_tuples = 1;
+    for (int i = 0; i < length; i++)
+      num_tuples *= K;
+
+    if (opposite[0] == -1)
+      reversible = false;
+
+    std::vector<int> canonical(num_tuples, -1);
+    std::vector<int> tuple(length);
+
+    // Going through the tuples in order, the first tuple of every
+    // orbit is the smallest one.
+    for (int n = 0; n < num_tuples; n++)
+    {
+      if (canonical[n] != -1)
+        continue;
+
+      for (int i = length - 1, rest = n; i >= 0; i--, rest /= K)
+        tuple[i] = rest % K;
+
+      for (const std::vector<int>& image : transforms)
+      {
+        int forward = 0, backward = 0;
+        for (int i = 0; i < length; i++)
+        {
+          forward  = forward*K + image[tuple[i]];
+          backward = backward*K + opposite[image[tuple[length - 1 - i]]];
+        }
+
+        canonical[forward] = n;
+        if (reversible)
+          canonical[backward] = n;
+      }
+    }
+
+    return canonical;
+  }
+
+  // The tuples which are their own canonical representative.
+  static std::vector<int> representatives(const std::vector<int>& canonical)
+  {
+    std::vector<int> result;
+
+    for (int n = 0; n < canonical.size(); n++)
+      if (canonical[n] == n)
+        result.push_back(n);
+
+    return result;
+  }
+
+protected:
+  int num_directions;
+  std::vector<std::vector<int>> transforms;
+  std::vector<int> opposite;
+};
+
+// Sets table[n] = value(n) for one tuple in every orbit and copies
+// the values to the rest of each orbit.
+template<typename T, typename Value>
+void fill_symmetric_table(std::vector<T>& table,
+                          const std::vector<int>& canonical,
+                          Value value)
+{
+  std::vector<int> orbits = Connectivity_symmetry::representatives(canonical);
+
+  #ifdef USE_OPENMP
+  #pragma omp parallel for
+  #endif
+  for (int i = 0; i < orbits.size(); i++)
+    table[orbits[i]] = value(orbits[i]);
+
+  #ifdef USE_OPENMP
+  #pragma omp parallel for
+  #endif
+  for (int n = 0; n < canonical.size(); n++)
+    if (canonical[n] != n)
+      table[n] = table[canonical[n]];
+}
@@ -1,19 +1,24 @@
 // This function both calculates the cost of a curve decomposed into
 // weighted and non weighted data, pair cost, triplet cost, quadruple cost
+// and pentuple cost
 #include "curve_segmentation.h"
 
+// Position of the data volume among the arguments.
+const int data_argument = 1;
+
 // Calls main_function
 #include "instances/mex_wrapper_shortest_path.h"
 
-template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost>
+template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Pentuple_cost>
 void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
-	ASSERT(nlhs == 8);
+	ASSERT(nlhs == 10);
 	ASSERT(nrhs == 4 || nrhs == 5);
 
 	// Parse data
 	int curarg = 1;
-	const matrix<double> data_matrix(prhs[curarg++]);
+	const matrix<typename Data_cost::Voxel_type> data_matrix =
+		data_volume<typename Data_cost::Voxel_type>(prhs[curarg++]);
 	const matrix<double> input_path(prhs[curarg++]);
   const matrix<int> connectivity(prhs[curarg++]);
 	MexParams params(nrhs-curarg, prhs+curarg);
@@ -43,10 +48,12 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   matrix<double> total_pair_cost(1);
   matrix<double> total_triplet_cost(1);
   matrix<double> total_quadruplet_cost(1);
+  matrix<double> total_pentuple_cost(1);
   
   matrix<double> curve_pair(1);
   matrix<double> curve_triplet(1);
   matrix<double> curve_quadruplet(1);
+  matrix<double> curve_pentuple(1);
 
   // Weighted by penalty function
   total_cost(0) = 0;
@@ -54,11 +61,13 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   total_pair_cost(0) = 0;
   total_triplet_cost(0) = 0;
   total_quadruplet_cost(0) = 0;
+  total_pentuple_cost(0) = 0;
 
   // E.g. Length, curvature and torsion of curve
   curve_pair(0) = 0;
   curve_triplet(0) = 0;
   curve_quadruplet(0) = 0;
+  curve_pentuple(0) = 0;
 
   plhs[0] = total_cost;
   plhs[1] = total_data_cost;
@@ -68,6 +77,8 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   plhs[5] = curve_pair;
   plhs[6] = curve_triplet;
   plhs[7] = curve_quadruplet;
+  plhs[8] = total_pentuple_cost;
+  plhs[9] = curve_pentuple;
 
   Data_cost data_cost(data_matrix, connectivity, info_settings);
   Pair_cost pair_cost(data_matrix, info_settings);
@@ -105,6 +116,19 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     curve_quadruplet(0) += quad_cost(p1.xyz, p2.xyz, p3.xyz, p4.xyz);
   }
 
+  // E.g. Jounce
+  Pentuple_cost pentuple_cost(data_matrix, info_settings);
+  for (int k = 0; k < (int)path.M-4; k++)
+  {
+    Point p1(path(k+0,0) -1, path(k+0,1) -1, path(k+0,2) -1);
+    Point p2(path(k+1,0) -1, path(k+1,1) -1, path(k+1,2) -1);
+    Point p3(path(k+2,0) -1, path(k+2,1) -1, path(k+2,2) -1);
+    Point p4(path(k+3,0) -1, path(k+3,1) -1, path(k+3,2) -1);
+    Point p5(path(k+4,0) -1, path(k+4,1) -1, path(k+4,2) -1);
+
+    curve_pentuple(0) += pentuple_cost(p1.xyz, p2.xyz, p3.xyz, p4.xyz, p5.xyz);
+  }
+
 
   // Add weights
   // The if statement is added in order to avoid potential
@@ -124,5 +148,11 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   else
     total_quadruplet_cost(0) = 0;
 
-  total_cost(0) = total_data_cost(0) + total_pair_cost(0) + total_triplet_cost(0) + total_quadruplet_cost(0);
+  if (settings.penalty[3] > 0)
+    total_pentuple_cost(0) = curve_pentuple(0)*settings.penalty[3];
+  else
+    total_pentuple_cost(0) = 0;
+
+  total_cost(0) = total_data_cost(0) + total_pair_cost(0) + total_triplet_cost(0) + total_quadruplet_cost(0)
+                + total_pentuple_cost(0);
 }
\ No newline at end of file
@@ -25,7 +25,9 @@ double get_wtime()
 #include <tuple>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string.h>
+#include <sys/stat.h>
 
 using std::ignore;
 using std::tie;
@@ -34,14 +36,15 @@ using std::tie;
 #include <curve_extraction/data_term.h>
 #include <curve_extraction/grid_mesh.h>
 #include <curve_extraction/shortest_path.h>
+#include <curve_extraction/volume_source.h>
 
 using namespace curve_extraction;
-double timer;
-int M = 1;
-int N = 1;
-int O = 1;
 const int max_index = std::numeric_limits<int>::max();
 enum Descent_method {lbfgs, nelder_mead};
+enum A_star_heuristic {node_heuristic, edge_min_heuristic,
+                       edge_uint16_heuristic, edge_uint8_heuristic};
+enum Edge_cost_storage {no_edge_costs, float32_edge_costs,
+                        float16_edge_costs, uint16_edge_costs};
 
 struct Point
 {
@@ -125,7 +128,11 @@ struct InstanceSettings
   InstanceSettings() :
   penalty(4,0.0),
   power(4,1.0),
-  local_limit(4, std::numeric_limits<double>::infinity())
+  local_limit(4, std::numeric_limits<double>::infinity()),
+  length_local_limit(std::numeric_limits<double>::infinity()),
+  curvature_local_limit(std::numeric_limits<double>::infinity()),
+  torsion_local_limit(std::numeric_limits<double>::infinity()),
+  jounce_local_limit(std::numeric_limits<double>::infinity())
   { }
 
   // penalty[0]: e.g. length
@@ -144,10 +151,22 @@ struct InstanceSettings
 
   bool compute_all_distances;
 
+  bool cache_data_cost;
+  bool prefill_data_cost;
+  double data_cost_cache_memory;
+  double pair_cost_cache_memory;
+
   bool fully_contained_set;
   
   string data_type_str;
 
+  // A voxel with value v has the data cost data_scale*v + data_offset.
+  double data_scale;
+  double data_offset;
+
+  // Store the volume in bricks of brick_size^3 voxels (0: as given).
+  int brick_size;
+
   vector<double> voxel_dimensions;
 
   double function_improvement_tolerance;
@@ -163,6 +182,16 @@ struct InstanceSettings
 
   Descent_method descent_method;
   string descent_method_str;
+
+  A_star_heuristic a_star_heuristic;
+  string a_star_heuristic_str;
+
+  bool cache_a_star_heuristic;
+  string a_star_heuristic_file;
+
+  Edge_cost_storage edge_cost_storage;
+  string edge_cost_storage_str;
+  string edge_cost_file;
 };
 
 InstanceSettings parse_settings(MexParams params)
@@ -186,6 +215,13 @@ InstanceSettings parse_settings(MexParams params)
   for (double& p : settings.local_limit)
     ASSERT(p >= 0);
 
+  // Missing limits are treated as no limit.
+  settings.local_limit.resize(4, std::numeric_limits<double>::infinity());
+  settings.length_local_limit    = settings.local_limit[0];
+  settings.curvature_local_limit = settings.local_limit[1];
+  settings.torsion_local_limit   = settings.local_limit[2];
+  settings.jounce_local_limit    = settings.local_limit[3];
+
   // Whether A* should be used for curvature.
   settings.use_a_star = params.get<bool>("use_a_star", false);
 
@@ -201,6 +237,20 @@ InstanceSettings parse_settings(MexParams params)
   // Visit the full graph
   settings.compute_all_distances = params.get<bool>("compute_all_distances", false);
 
+  // Cache the data cost of every edge in the line graphs.
+  settings.cache_data_cost = params.get<bool>("cache_data_cost", true);
+
+  // Evaluate all data costs in parallel before the search starts.
+  settings.prefill_data_cost = params.get<bool>("prefill_data_cost", false);
+
+  // Memory limit (MB) for the data cost cache.
+  settings.data_cost_cache_memory = params.get<double>("data_cost_cache_memory", 1024);
+  ASSERT(settings.data_cost_cache_memory >= 0);
+
+  // Memory limit (MB) for memoizing data dependent pair costs.
+  settings.pair_cost_cache_memory = params.get<double>("pair_cost_cache_memory", 1024);
+  ASSERT(settings.pair_cost_cache_memory >= 0);
+
   // Used by local optimization
   settings.function_improvement_tolerance = params.get<double>("function_improvement_tolerance", 1e-12);
   settings.argument_improvement_tolerance = params.get<double>("argument_improvement_tolerance", 1e-12);
@@ -223,74 +273,266 @@ InstanceSettings parse_settings(MexParams params)
 
   settings.data_type_str = params.get<string>("data_type", "linear_interpolation");
 
+  // Maps voxel values, e.g. of uint8 volumes, to data costs.
+  settings.data_scale = params.get<double>("data_scale", 1.0);
+  settings.data_offset = params.get<double>("data_offset", 0.0);
+
+  settings.brick_size = params.get<int>("brick_size", 0);
+  ASSERT(settings.brick_size >= 0);
+
+  // Lower bound used by A* in the torsion graph.
+  settings.a_star_heuristic_str = params.get<string>("a_star_heuristic", "node");
+
+  if (settings.a_star_heuristic_str == "node")
+    settings.a_star_heuristic = node_heuristic;
+  else if (settings.a_star_heuristic_str == "edge_min")
+    settings.a_star_heuristic = edge_min_heuristic;
+  else if (settings.a_star_heuristic_str == "edge_uint16")
+    settings.a_star_heuristic = edge_uint16_heuristic;
+  else if (settings.a_star_heuristic_str == "edge_uint8")
+    settings.a_star_heuristic = edge_uint8_heuristic;
+  else
+    throw runtime_error("Unknown A* heuristic");
+
+  // Keep the node-graph A* heuristic between calls.
+  settings.cache_a_star_heuristic = params.get<bool>("cache_a_star_heuristic", true);
+
+  // Load and store the node-graph A* heuristic in this file.
+  settings.a_star_heuristic_file = params.get<string>("a_star_heuristic_file", "");
+
+  // Precompute the data cost of every edge and keep it between calls.
+  settings.edge_cost_storage_str = params.get<string>("edge_cost_storage", "none");
+
+  if (settings.edge_cost_storage_str == "none")
+    settings.edge_cost_storage = no_edge_costs;
+  else if (settings.edge_cost_storage_str == "float32")
+    settings.edge_cost_storage = float32_edge_costs;
+  else if (settings.edge_cost_storage_str == "float16")
+    settings.edge_cost_storage = float16_edge_costs;
+  else if (settings.edge_cost_storage_str == "uint16")
+    settings.edge_cost_storage = uint16_edge_costs;
+  else
+    throw runtime_error("Unknown edge cost storage");
+
+  // Load and store the precomputed edge costs in this file.
+  settings.edge_cost_file = params.get<string>("edge_cost_file", "");
+
 
   return settings;
 }
 
-// Work linear indices like MatLab, but starting from 0.
-// Syntax coordinates (n1,n2,n3), image size (M,N,O);
-bool validind(int n1, int n2, int n3)
+// Size of the voxel grid and its linear indices, which work like
+// MatLab but start from 0. Passed to the solvers explicitly instead of
+// being global, so that several problems can be solved at the same time.
+struct GridGeometry
 {
-  if ( (n1 > M-1 || n2 > N-1 || n3 > O-1) || (n1 < 0 || n2 < 0 || n3 < 0) )
-    return false;
+  GridGeometry(int M = 1, int N = 1, int O = 1) :
+    M(M), N(N), O(O), stride_y(M), stride_z(M*N)
+  { }
 
-  return true;
-}
+  template<typename T>
+  explicit GridGeometry(const matrix<T>& volume) :
+    GridGeometry(volume.M, volume.N, volume.O)
+  { }
 
-bool valid_point(Point p)
-{
-  return validind(p[0],p[1],p[2]);
-}
+  // Syntax coordinates (n1,n2,n3), image size (M,N,O);
+  bool validind(int n1, int n2, int n3) const
+  {
+    if ( (n1 > M-1 || n2 > N-1 || n3 > O-1) || (n1 < 0 || n2 < 0 || n3 < 0) )
+      return false;
 
-// Syntax coordinates (n1,n2,n3), image size (M,N,O);
-int sub2ind(int n1, int n2, int n3)
-{
-  // Linear index
-    return  n1 + n2*M + n3*M*N;
-}
+    return true;
+  }
+
+  bool valid_point(const Point& p) const
+  {
+    return validind(p.xyz[0], p.xyz[1], p.xyz[2]);
+  }
+
+  // Syntax coordinates (n1,n2,n3), image size (M,N,O);
+  int sub2ind(int n1, int n2, int n3) const
+  {
+    return n1 + n2*stride_y + n3*stride_z;
+  }
+
+  int point2ind(const Point& p) const
+  {
+    return sub2ind(p.xyz[0], p.xyz[1], p.xyz[2]);
+  }
+
+  std::tuple<int,int,int> ind2sub(int n) const
+  {
+    int z = n/stride_z;
+    int y = (n - z*stride_z)/stride_y;
+    int x = n - y*stride_y - z*stride_z;
+
+    return std::make_tuple(x,y,z);
+  }
 
-int point2ind(Point p)
+  Point make_point(int n) const
+  {
+    int x,y,z;
+    tie(x,y,z) = ind2sub(n);
+
+    return Point(x,y,z);
+  }
+
+  int numel() const
+  {
+    return stride_z*O;
+  }
+
+  int M, N, O;
+  int stride_y, stride_z;
+};
+
+// Hash used to recognize a problem seen before.
+uint64_t hash_bytes(uint64_t hash, const void* bytes, std::size_t size)
 {
-  return sub2ind(p[0], p[1], p[2]);
+  // FNV-1a, on 8 bytes at a time.
+  const uint64_t prime = 1099511628211ULL;
+  const unsigned char* p = static_cast<const unsigned char*>(bytes);
+
+  std::size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+  {
+    uint64_t word;
+    std::memcpy(&word, p + i, sizeof(word));
+    hash ^= word;
+    hash *= prime;
+  }
+
+  for (; i < size; i++)
+  {
+    hash ^= p[i];
+    hash *= prime;
+  }
+
+  return hash;
 }
 
-std::tuple<int,int,int> ind2sub(int n)
+// Identifies a volume file without reading its voxels: the names, sizes
+// and modification times of the header and data files, and the header.
+uint64_t volume_file_key(const std::string& file_name, const VolumeSource& source)
 {
-  int z = n/(M*N);
-  int y = (n-z*M*N)/M;
-  int x = n - y*M - z*M*N;
+  uint64_t hash = 14695981039346656037ULL;
+  hash = hash_bytes(hash, source.header().data(), source.header().size());
+
+  for (const std::string& name : {file_name, source.data_file()})
+  {
+    struct stat info;
+    int64_t size_and_time[2] = {-1, -1};
+
+    if (stat(name.c_str(), &info) == 0)
+    {
+      size_and_time[0] = info.st_size;
+      size_and_time[1] = info.st_mtime;
+    }
+
+    hash = hash_bytes(hash, name.data(), name.size());
+    hash = hash_bytes(hash, size_and_time, sizeof(size_and_time));
+  }
 
-  return std::make_tuple(x,y,z);
+  return hash;
 }
 
-Point make_point(int n)
+// The data volume may also be given as the name of a NRRD file, which
+// is memory mapped instead of loaded into MATLAB. The most recent file
+// stays mapped between calls and is mapped again if it has changed.
+std::shared_ptr<const VolumeSource> volume_source_cache;
+std::string volume_source_file;
+uint64_t volume_source_key;
+const void* volume_source_voxels;
+std::mutex volume_source_mutex;
+
+std::shared_ptr<const VolumeSource> mapped_volume(const mxArray* file_name)
 {
-  int z = n/(M*N);
-  int y = (n-z*M*N)/M;
-  int x = n - y*M - z*M*N;
+  char buffer[4096];
+  if (mxGetString(file_name, buffer, sizeof(buffer)))
+    mexErrMsgTxt("Volume file name too long.");
+
+  std::lock_guard<std::mutex> lock(volume_source_mutex);
+  if (!volume_source_cache || volume_source_file != buffer ||
+      volume_source_key != volume_file_key(buffer, *volume_source_cache))
+  {
+    std::shared_ptr<const VolumeSource> source(new VolumeSource(buffer));
 
-  return Point(x,y,z);
+    switch (source->type())
+    {
+      case VolumeSource::uint8_voxels:  volume_source_voxels = source->voxels<unsigned char>(); break;
+      case VolumeSource::uint16_voxels: volume_source_voxels = source->voxels<unsigned short>(); break;
+      case VolumeSource::float_voxels:  volume_source_voxels = source->voxels<float>(); break;
+      default:                          volume_source_voxels = source->voxels<double>();
+    }
+
+    volume_source_cache = source;
+    volume_source_file = buffer;
+    volume_source_key = volume_file_key(buffer, *source);
+  }
+
+  return volume_source_cache;
 }
 
-void startTime()
+// Hashes the voxel values, their type and how they map to data costs.
+// The voxels of a mapped file are not read; the file is recognized by
+// volume_file_key instead.
+template<typename Voxel>
+uint64_t hash_data(uint64_t hash, const matrix<Voxel>& data, const InstanceSettings& settings)
 {
-  timer = ::get_wtime();
+  int voxel_size = sizeof(Voxel);
+  hash = hash_bytes(hash, &voxel_size, sizeof(voxel_size));
+
+  bool mapped = false;
+  {
+    std::lock_guard<std::mutex> lock(volume_source_mutex);
+    if (volume_source_cache && data.data == volume_source_voxels)
+    {
+      mapped = true;
+      hash = hash_bytes(hash, &volume_source_key, sizeof(volume_source_key));
+    }
+  }
+
+  if (!mapped)
+    hash = hash_bytes(hash, data.data, data.numel()*sizeof(Voxel));
+
+  hash = hash_bytes(hash, &settings.data_scale, sizeof(double));
+  hash = hash_bytes(hash, &settings.data_offset, sizeof(double));
+
+  return hash;
 }
 
-double endTime()
+// Class of the voxels of the data volume.
+mxClassID data_class(const mxArray* data)
 {
-  double current_time = ::get_wtime();
-  double elapsed = current_time - timer;
-  timer = current_time;
+  if (!mxIsChar(data))
+    return mxGetClassID(data);
 
-  return elapsed;
+  switch (mapped_volume(data)->type())
+  {
+    case VolumeSource::uint8_voxels:  return mxUINT8_CLASS;
+    case VolumeSource::uint16_voxels: return mxUINT16_CLASS;
+    case VolumeSource::float_voxels:  return mxSINGLE_CLASS;
+    default:                          return mxDOUBLE_CLASS;
+  }
 }
 
-double endTime(const char* message)
+// The data volume, without copying the voxels of a mapped file.
+template<typename Voxel>
+matrix<Voxel> data_volume(const mxArray* data)
 {
-  double t = endTime();
-  mexPrintf("%s : %g (s). \n", message, t);
-  return t;
+  if (!mxIsChar(data))
+    return matrix<Voxel>(data);
+
+  auto source = mapped_volume(data);
+
+  matrix<Voxel> volume;
+  volume.data = const_cast<Voxel*>(source->voxels<Voxel>());
+  volume.M = source->size(0);
+  volume.N = source->size(1);
+  volume.O = source->size(2);
+  volume.P = 1;
+
+  return volume;
 }
 
 struct SegmentationOutput
@@ -1,10 +1,16 @@
 // Johannes Ulén and Petter Strandmark 2013
 #include "curve_segmentation.h"
 
+#include <type_traits>
+
 // Avoid explicit instantiation.
 #include "node_segmentation.h"
 #include "edge_segmentation.h"
 #include "edgepair_segmentaion.h"
+#include "edgetriple_segmentation.h"
+
+// Position of the data volume among the arguments.
+const int data_argument = 2;
 
 // Calls main_function
 #include "instances/mex_wrapper_shortest_path.h"
@@ -13,10 +19,11 @@
 // Pair_cost any function of two points.
 // Triplet_cost any function of three points.
 // Quad_cost any function of four points. 
-template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost>
+// Pentuple_cost any function of five points.
+template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Pentuple_cost>
 void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
-  startTime();
+  double start_time = ::get_wtime();
 
   // Check input and outputs
   ASSERT(nrhs == 4 || nrhs == 5);
@@ -28,16 +35,15 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   // 3: End set.
   int curarg =1;
   const matrix<unsigned char> mesh_map(prhs[curarg++]);
-  const matrix<double> data(prhs[curarg++]);
+  const matrix<typename Data_cost::Voxel_type> data =
+    data_volume<typename Data_cost::Voxel_type>(prhs[curarg++]);
   const matrix<int> connectivity(prhs[curarg++]);
 
   // For 2 images third column should be zeros.
   ASSERT(connectivity.N == 3);
   ASSERT(connectivity.ndim() == 2);
 
-  M = mesh_map.M;
-  N = mesh_map.N;
-  O = mesh_map.O;
+  GridGeometry grid(mesh_map);
 
   // Only 2d or 3d grid
   if ((mesh_map.ndim() != 2) && (mesh_map.ndim() != 3))
@@ -46,10 +52,25 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   MexParams params(nrhs-curarg, prhs+curarg); //Structure to hold and parse additional parameters
   InstanceSettings settings = parse_settings(params);
 
+  bool use_triples = false;
   bool use_pairs = false;
   bool use_edges = false;
 
-  if (settings.penalty[2] != 0) {
+  // Geodesic problems have no pentuple cost. The edge triple graph
+  // would then cost time and memory without changing the solution.
+  bool has_pentuple_cost = !std::is_same<Pentuple_cost, Zero_pentuple>::value;
+
+  if (settings.penalty[3] != 0 && !has_pentuple_cost)
+  {
+    if (settings.verbose)
+      mexPrintf("This problem type has no pentuple cost; penalty(4) is ignored.\n");
+
+    settings.penalty[3] = 0;
+  }
+
+  if (settings.penalty[3] != 0) {
+    use_triples = true;
+  } else if (settings.penalty[2] != 0) {
     use_pairs = true;
   } else if (settings.penalty[1] != 0)
   {
@@ -57,14 +78,14 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   }
 
   // No line graph needed hence A* will not be used.
-  if (!use_edges && !use_pairs)
+  if (!use_edges && !use_pairs && !use_triples)
     settings.use_a_star = false;
 
   if (settings.verbose)
     mexPrintf("Connectivity size is %d. \n", connectivity.M);
 
   if (settings.verbose)
-    endTime("Reading data");
+    mexPrintf("Reading data : %g (s). \n", ::get_wtime() - start_time);
 
   #ifdef USE_OPENMP
     int max_threads = omp_get_max_threads();
@@ -103,7 +124,8 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
   if (options.store_visited ||
       (use_edges && options.store_parents) ||
-      (use_pairs && options.store_parents)
+      (use_pairs && options.store_parents) ||
+      (use_triples && options.store_parents)
      )
     dimensions = real_dimensions;
   else
@@ -141,13 +163,14 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
   if (settings.verbose)
   {
-    mexPrintf("Regularization coefficients Pair: %g Triplet: %g Quad: %g. \n",
-              settings.penalty[0], settings.penalty[1], settings.penalty[2]);
-    mexPrintf("Regularization powers Pair: %g Triplet: %g Quad: %g. \n",
-              settings.power[0], settings.power[1], settings.power[2]);
+    mexPrintf("Regularization coefficients Pair: %g Triplet: %g Quad: %g Pentuple: %g. \n",
+              settings.penalty[0], settings.penalty[1], settings.penalty[2], settings.penalty[3]);
+    mexPrintf("Regularization powers Pair: %g Triplet: %g Quad: %g Pentuple: %g. \n",
+              settings.power[0], settings.power[1], settings.power[2], settings.power[3]);
   }
 
   // What kind of variables will be used in the graph?
+  // Pentuple: Triple of edges.
   // Quad: Pair of edges.
   // Triplet: Edges.
   // Pair: Nodes.
@@ -155,20 +178,25 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
   // Triplet and Pair can be calculated on Pair of Edges but this is overkill.
   // Same goes for Pair on edges.
-  if (use_pairs)
+  if (use_triples)
+  {
+    edgetriple_segmentation<Data_cost, Pair_cost, Triplet_cost, Quad_cost, Pentuple_cost>
+    (data, mesh_map, grid, connectivity, settings, options, output);
+  }
+  else if (use_pairs)
   {
     edgepair_segmentation<Data_cost, Pair_cost, Triplet_cost, Quad_cost>
-    (data, mesh_map, connectivity, settings, options, output);
+    (data, mesh_map, grid, connectivity, settings, options, output);
   }
   else if (use_edges)
   {
     edge_segmentation<Data_cost, Pair_cost, Triplet_cost>
-    (data, mesh_map, connectivity, settings, options, output);
+    (data, mesh_map, grid, connectivity, settings, options, output);
   }
   else
   {
     node_segmentation<Data_cost, Pair_cost>
-    (data, mesh_map, connectivity, settings, options, output);
+    (data, mesh_map, grid, connectivity, settings, options, output);
   }
 
   matrix<double>  o_time(1);
@@ -176,7 +204,7 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   matrix<double>  o_cost(1);
 
   int max_dim = 2;
-  if (O > 1)
+  if (grid.O > 1)
     max_dim = 3;
   
   matrix<double>  o_path(points.size(),max_dim);
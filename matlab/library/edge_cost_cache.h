@@ -0,0 +1,242 @@
+#pragma once
+#include <atomic>
+
+#include "edge_cost_tensor.h"
+
+// Disallowed voxels are 0 in the mesh map and no edge may pass through
+// them. Floating point data also marks them with inf, but integer
+// volumes, mapped files and geodesic distance volumes can not, so the
+// solvers check every edge against the mesh map.
+//
+// An edge passes through the voxels whose cells it enters, i.e. the
+// voxels the line integral of PieceWiseConstant sums over.
+class Disallowed_edges
+{
+public:
+  Disallowed_edges(const matrix<unsigned char>& mesh_map,
+                   const matrix<int>& connectivity,
+                   const GridGeometry& grid)
+    : mesh_map(mesh_map), crossed(connectivity.M)
+  {
+    bool any_disallowed = false;
+    for (int i = 0; i < mesh_map.numel() && !any_disallowed; i++)
+      any_disallowed = mesh_map(i) == 0;
+
+    if (!any_disallowed)
+      return;
+
+    for (int k = 0; k < connectivity.M; k++)
+    {
+      int d[3] = {connectivity(k,0), connectivity(k,1), connectivity(k,2)};
+
+      // Where the edge crosses from one cell to the next.
+      std::vector<double> crossings = {0.0, 1.0};
+      for (int i = 0; i < 3; i++)
+        for (int j = 0; j < std::abs(d[i]); j++)
+          crossings.push_back((j + 0.5) / std::abs(d[i]));
+
+      std::sort(crossings.begin(), crossings.end());
+
+      for (int c = 0; c + 1 < crossings.size(); c++)
+      {
+        if (crossings[c + 1] == crossings[c])
+          continue;
+
+        double t = (crossings[c] + crossings[c + 1]) / 2;
+        int offset = grid.sub2ind(std::lround(t*d[0]),
+                                  std::lround(t*d[1]),
+                                  std::lround(t*d[2]));
+
+        if (std::find(crossed[k].begin(), crossed[k].end(), offset) == crossed[k].end())
+          crossed[k].push_back(offset);
+      }
+    }
+  }
+
+  // Whether the edge leaving voxel in direction k passes through a
+  // disallowed voxel, including its end points.
+  bool operator()(int voxel, int k) const
+  {
+    for (int offset : crossed[k])
+      if (mesh_map(voxel + offset) == 0)
+        return true;
+
+    return false;
+  }
+
+protected:
+  const matrix<unsigned char>& mesh_map;
+
+  // Linear offsets of the voxels passed through in each direction,
+  // or nothing if no voxel is disallowed.
+  std::vector<std::vector<int>> crossed;
+};
+
+// Memoizes the data cost of every directed edge (voxel, direction) of the
+// grid. In the line graphs the same edge is evaluated from each of its
+// predecessor states, so the line integral is only computed once.
+// Data dependent pair costs (e.g. geodesic length) are memoized the
+// same way, see memoize_pair_cost.
+//
+// The table is filled lazily; NaN marks an edge not yet evaluated.
+// Different directions never share an entry, so the OpenMP loops
+// over the directions of a voxel can fill it concurrently.
+// If a precomputed Edge_cost_tensor is given, it is used instead.
+// Edges through disallowed voxels cost infinity.
+//
+// Hits and misses are shared between the threads and only counted
+// after count_lookups, i.e. for verbose output.
+template<typename Data_cost>
+class Edge_cost_cache
+{
+public:
+  Edge_cost_cache(const Data_cost& data_cost,
+                  const matrix<int>& connectivity,
+                  const GridGeometry& grid,
+                  bool enabled,
+                  std::shared_ptr<const Edge_cost_tensor> tensor = nullptr,
+                  const Disallowed_edges* disallowed = nullptr)
+    : data_cost(data_cost), delta_point(connectivity), grid(grid),
+      num_directions(connectivity.M), enabled(enabled && !tensor),
+      tensor(tensor), disallowed(disallowed), counting(false),
+      cache_hits(0), cache_misses(0)
+  {
+    if (enabled)
+      costs.resize(std::size_t(grid.numel())*num_directions,
+                   std::numeric_limits<float>::quiet_NaN());
+  }
+
+  // Data cost of the edge from p1 (with index voxel) to p2 in direction k.
+  double operator()(int voxel, int k, Point& p1, Point& p2)
+  {
+    if (disallowed && (*disallowed)(voxel, k))
+      return std::numeric_limits<double>::infinity();
+
+    if (tensor)
+      return (*tensor)(voxel, k);
+
+    if (!enabled)
+      return data_cost(p1.xyz, p2.xyz);
+
+    float& cost = costs[std::size_t(voxel)*num_directions + k];
+
+    if (cost == cost)
+    {
+      if (counting)
+        cache_hits++;
+      return cost;
+    }
+
+    if (counting)
+      cache_misses++;
+
+    // Return the stored value, so that every lookup of the edge agrees.
+    cost = data_cost(p1.xyz, p2.xyz);
+    return double(cost);
+  }
+
+  // Evaluates every edge inside the grid up front.
+  void prefill()
+  {
+    if (!enabled)
+      return;
+
+    int num_voxels = costs.size() / num_directions;
+
+    #ifdef USE_OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int n = 0; n < num_voxels; n++)
+    {
+      Point p1 = grid.make_point(n);
+
+      for (int k = 0; k < num_directions; k++)
+      {
+        Point p2 = delta_point(p1,k);
+
+        if (grid.valid_point(p2))
+          costs[std::size_t(n)*num_directions + k] = data_cost(p1.xyz, p2.xyz);
+      }
+    }
+  }
+
+  void count_lookups()
+  {
+    counting = true;
+  }
+
+  std::size_t hits() const
+  {
+    return cache_hits;
+  }
+
+  std::size_t misses() const
+  {
+    return cache_misses;
+  }
+
+protected:
+  const Data_cost& data_cost;
+  Delta_point delta_point;
+  GridGeometry grid;
+  int num_directions;
+  bool enabled;
+  std::shared_ptr<const Edge_cost_tensor> tensor;
+  const Disallowed_edges* disallowed;
+
+  std::vector<float> costs;
+  bool counting;
+  std::atomic<std::size_t> cache_hits;
+  std::atomic<std::size_t> cache_misses;
+};
+
+// Whether a table with one float per directed edge of the grid fits
+// in max_megabytes.
+bool edge_table_fits(const GridGeometry& grid,
+                     const matrix<int>& connectivity,
+                     double max_megabytes)
+{
+  double bytes = double(grid.numel())*connectivity.M*sizeof(float);
+  return bytes <= max_megabytes*1024*1024;
+}
+
+// Whether the data costs of the line graphs are memoized, which is
+// only done when the table fits within settings.data_cost_cache_memory.
+bool memoize_data_cost(const matrix<int>& connectivity,
+                       const GridGeometry& grid,
+                       const InstanceSettings& settings)
+{
+  if (!settings.cache_data_cost)
+    return false;
+
+  if (edge_table_fits(grid, connectivity, settings.data_cost_cache_memory))
+    return true;
+
+  if (settings.verbose)
+    mexPrintf("Data cost cache would exceed %g MB and is not used.\n",
+              settings.data_cost_cache_memory);
+
+  return false;
+}
+
+// Data dependent pair costs can not be tabulated per direction, so
+// they are memoized per edge instead when the table fits within
+// settings.pair_cost_cache_memory.
+template<typename Pair_cost>
+bool memoize_pair_cost(const Pair_cost& pair_cost,
+                       const matrix<int>& connectivity,
+                       const GridGeometry& grid,
+                       const InstanceSettings& settings)
+{
+  if (!pair_cost.data_dependent || settings.penalty[0] == 0)
+    return false;
+
+  if (edge_table_fits(grid, connectivity, settings.pair_cost_cache_memory))
+    return true;
+
+  if (settings.verbose)
+    mexPrintf("Pair cost cache would exceed %g MB and is not used.\n",
+              settings.pair_cost_cache_memory);
+
+  return false;
+}
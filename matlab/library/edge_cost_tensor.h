@@ -0,0 +1,413 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#include "mapped_file.h"
+
+// The data cost of every directed edge (voxel, direction) of the grid,
+// computed in parallel before the search. Unlike Edge_cost_cache it is
+// kept between calls (and optionally in a file), so repeated solves on
+// the same volume, e.g. supergradient iterations or penalty sweeps,
+// skip the line integrals altogether.
+//
+// float16_edge_costs and uint16_edge_costs halve the memory at the
+// price of precision: float16 keeps about three significant digits,
+// uint16 spreads 65535 levels uniformly over the range of the costs.
+// Infinite costs are kept exactly in all formats.
+
+// IEEE half precision, rounded to nearest even.
+uint16_t float_to_half(float value)
+{
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  uint32_t sign = (bits >> 16) & 0x8000;
+  int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  // Infinity and NaN.
+  if (((bits >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+  if (exponent >= 31)
+    return sign | 0x7c00;
+
+  // Subnormal half.
+  if (exponent <= 0)
+  {
+    if (exponent < -10)
+      return sign;
+
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+
+    if (rest > halfway || (rest == halfway && (half & 1)))
+      half++;
+
+    return sign | half;
+  }
+
+  // A carry out of the mantissa correctly increases the exponent.
+  uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    half++;
+
+  return half;
+}
+
+float half_to_float(uint16_t half)
+{
+  uint32_t sign = uint32_t(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+
+  if (exponent == 0)
+  {
+    float value = std::ldexp(float(mantissa), -24);
+    return sign ? -value : value;
+  }
+
+  uint32_t bits;
+  if (exponent == 31)
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  else
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Layout of a saved tensor: this header followed directly by the
+// values, so a mapped file is used without copying.
+struct Edge_cost_tensor_header
+{
+  char magic[8];
+  uint64_t key;
+  int32_t storage;
+  int32_t num_directions;
+  int64_t num_voxels;
+  double offset;
+  double scale;
+  char padding[16];
+};
+
+class Edge_cost_tensor
+{
+public:
+  // Evaluates data_cost for every edge inside the grid. Edges leaving
+  // the grid get infinite cost.
+  template<typename Data_cost>
+  Edge_cost_tensor(const Data_cost& data_cost,
+                   const matrix<int>& connectivity,
+                   const GridGeometry& grid,
+                   Edge_cost_storage storage,
+                   uint64_t key)
+    : float_values(nullptr), half_values(nullptr)
+  {
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, magic, sizeof(header.magic));
+    header.key = key;
+    header.storage = storage;
+    header.num_directions = connectivity.M;
+    header.num_voxels = grid.numel();
+    header.offset = 0;
+    header.scale = 1;
+
+    const int K = connectivity.M;
+    Delta_point delta_point(connectivity);
+    std::vector<float> costs(std::size_t(grid.numel())*K,
+                             std::numeric_limits<float>::infinity());
+
+    #ifdef USE_OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int n = 0; n < grid.numel(); n++)
+    {
+      Point p1 = grid.make_point(n);
+
+      for (int k = 0; k < K; k++)
+      {
+        Point p2 = delta_point(p1,k);
+
+        if (grid.valid_point(p2))
+          costs[std::size_t(n)*K + k] = data_cost(p1.xyz, p2.xyz);
+      }
+    }
+
+    encode(costs);
+  }
+
+  // Maps a tensor written by save. Returns null if the file is missing
+  // or holds another problem.
+  static std::shared_ptr<const Edge_cost_tensor> load(const string& file_name,
+                                                      uint64_t key,
+                                                      Edge_cost_storage storage)
+  {
+    std::shared_ptr<Edge_cost_tensor> tensor(new Edge_cost_tensor);
+    if (!tensor->file.open(file_name))
+      return nullptr;
+
+    const Edge_cost_tensor_header* saved =
+      reinterpret_cast<const Edge_cost_tensor_header*>(tensor->file.data());
+
+    if (tensor->file.size() < sizeof(Edge_cost_tensor_header) ||
+        std::memcmp(saved->magic, magic, sizeof(saved->magic)) != 0 ||
+        saved->key != key || saved->storage != storage)
+      return nullptr;
+
+    tensor->header = *saved;
+    std::size_t num_values = std::size_t(saved->num_voxels)*saved->num_directions;
+
+    if (tensor->file.size() != sizeof(Edge_cost_tensor_header) + num_values*tensor->value_size())
+      return nullptr;
+
+    const char* values = tensor->file.data() + sizeof(Edge_cost_tensor_header);
+    tensor->float_values = reinterpret_cast<const float*>(values);
+    tensor->half_values = reinterpret_cast<const uint16_t*>(values);
+
+    return tensor;
+  }
+
+  // The tensor is written to a temporary file next to file_name which
+  // then replaces it, so processes that have the old file mapped keep
+  // reading it unchanged.
+  void save(const string& file_name) const
+  {
+#ifndef _WIN32
+    string temp_name = file_name + ".tmp" + std::to_string(getpid());
+#else
+    string temp_name = file_name + ".tmp";
+#endif
+
+    {
+      std::ofstream fout(temp_name, std::ios::binary);
+      if (!fout)
+        throw runtime_error("Could not open edge cost file for writing.");
+
+      fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      if (header.storage == float32_edge_costs)
+        fout.write(reinterpret_cast<const char*>(float_values), memory_usage());
+      else
+        fout.write(reinterpret_cast<const char*>(half_values), memory_usage());
+
+      fout.close();
+      if (!fout)
+      {
+        std::remove(temp_name.c_str());
+        throw runtime_error("Could not write edge cost file.");
+      }
+    }
+
+#ifdef _WIN32
+    // rename does not replace an existing file here.
+    std::remove(file_name.c_str());
+#endif
+
+    if (std::rename(temp_name.c_str(), file_name.c_str()) != 0)
+    {
+      std::remove(temp_name.c_str());
+      throw runtime_error("Could not replace edge cost file.");
+    }
+  }
+
+  // Data cost of the edge leaving voxel in direction k.
+  double operator()(int voxel, int k) const
+  {
+    std::size_t n = std::size_t(voxel)*header.num_directions + k;
+
+    if (header.storage == float32_edge_costs)
+      return float_values[n];
+
+    uint16_t code = half_values[n];
+
+    if (header.storage == float16_edge_costs)
+      return header.scale*half_to_float(code);
+
+    if (code == uint16_infinity)
+      return std::numeric_limits<double>::infinity();
+
+    return header.offset + header.scale*code;
+  }
+
+  uint64_t key() const
+  {
+    return header.key;
+  }
+
+  std::size_t memory_usage() const
+  {
+    return std::size_t(header.num_voxels)*header.num_directions*value_size();
+  }
+
+protected:
+  Edge_cost_tensor() : float_values(nullptr), half_values(nullptr) { }
+
+  std::size_t value_size() const
+  {
+    return header.storage == float32_edge_costs ? sizeof(float) : sizeof(uint16_t);
+  }
+
+  void encode(std::vector<float>& costs)
+  {
+    const float infinity = std::numeric_limits<float>::infinity();
+
+    if (header.storage == float32_edge_costs)
+    {
+      values32.swap(costs);
+      float_values = values32.data();
+      return;
+    }
+
+    float min_cost = infinity, max_cost = -infinity;
+    for (float cost : costs)
+    {
+      if (cost == infinity)
+        continue;
+
+      min_cost = std::min(min_cost, cost);
+      max_cost = std::max(max_cost, cost);
+    }
+
+    if (header.storage == float16_edge_costs)
+    {
+      // A power of two that brings the largest cost just below the
+      // top of the float16 range, so small costs do not become
+      // subnormal.
+      float largest = std::max(std::abs(min_cost), std::abs(max_cost));
+      if (largest > 0 && largest != infinity)
+      {
+        header.scale = std::ldexp(1.0, std::ilogb(largest) - 15);
+        if (largest / header.scale > 65504)
+          header.scale *= 2;
+      }
+    }
+    else if (min_cost < max_cost)
+    {
+      header.offset = min_cost;
+      header.scale = (double(max_cost) - min_cost) / (uint16_infinity - 1);
+    }
+    else if (min_cost == max_cost)
+      header.offset = min_cost;
+
+    values16.resize(costs.size());
+
+    #ifdef USE_OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int i = 0; i < costs.size(); i++)
+    {
+      if (header.storage == float16_edge_costs)
+        values16[i] = float_to_half(float(costs[i] / header.scale));
+      else if (costs[i] == infinity)
+        values16[i] = uint16_infinity;
+      else
+        values16[i] = uint16_t(std::min(std::round((costs[i] - header.offset) / header.scale),
+                                        double(uint16_infinity - 1)));
+    }
+
+    half_values = values16.data();
+  }
+
+  static const uint16_t uint16_infinity = 65535;
+  static const char magic[8];
+
+  Edge_cost_tensor_header header;
+
+  std::vector<float> values32;
+  std::vector<uint16_t> values16;
+  Mapped_file file;
+
+  // Either into the vectors above or into the mapped file.
+  const float* float_values;
+  const uint16_t* half_values;
+};
+
+const char Edge_cost_tensor::magic[8] = {'C','E','D','A','T','A','1','\0'};
+
+// The tensor only holds the data costs. The disallowed voxels are
+// applied on top of it (see Disallowed_edges), so the mesh map is not
+// part of the key and problems with different sets share one tensor.
+template<typename Voxel>
+uint64_t edge_cost_key(const matrix<Voxel>& data,
+                       const GridGeometry& grid,
+                       const matrix<int>& connectivity,
+                       const InstanceSettings& settings)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  int dims[3] = {grid.M, grid.N, grid.O};
+
+  hash = hash_bytes(hash, dims, sizeof(dims));
+  hash = hash_data(hash, data, settings);
+  hash = hash_bytes(hash, connectivity.data, connectivity.numel()*sizeof(int));
+  hash = hash_bytes(hash, settings.data_type_str.data(), settings.data_type_str.size());
+  hash = hash_bytes(hash, settings.voxel_dimensions.data(),
+                    settings.voxel_dimensions.size()*sizeof(double));
+
+  return hash;
+}
+
+// The most recent tensor, shared between calls like the node heuristic.
+std::shared_ptr<const Edge_cost_tensor> edge_cost_tensor_cache;
+std::mutex edge_cost_tensor_mutex;
+
+// The precomputed data costs for this problem, or null if
+// settings.edge_cost_storage is none. Reuses the tensor of the
+// previous call or the one in settings.edge_cost_file if they belong
+// to the same data and connectivity.
+template<typename Data_cost, typename Voxel>
+std::shared_ptr<const Edge_cost_tensor> precomputed_edge_costs(const Data_cost& data_cost,
+                                                               const matrix<Voxel>& data,
+                                                               const matrix<int>& connectivity,
+                                                               const GridGeometry& grid,
+                                                               const InstanceSettings& settings)
+{
+  if (settings.edge_cost_storage == no_edge_costs)
+    return nullptr;
+
+  uint64_t key = edge_cost_key(data, grid, connectivity, settings);
+  std::shared_ptr<const Edge_cost_tensor> tensor;
+
+  {
+    std::lock_guard<std::mutex> lock(edge_cost_tensor_mutex);
+    if (edge_cost_tensor_cache && edge_cost_tensor_cache->key() == key)
+      return edge_cost_tensor_cache;
+  }
+
+  if (!settings.edge_cost_file.empty())
+    tensor = Edge_cost_tensor::load(settings.edge_cost_file, key, settings.edge_cost_storage);
+
+  if (tensor)
+  {
+    if (settings.verbose)
+      mexPrintf("Mapped edge costs from %s.\n", settings.edge_cost_file.c_str());
+  }
+  else
+  {
+    double start_time = ::get_wtime();
+
+    tensor.reset(new Edge_cost_tensor(data_cost, connectivity, grid,
+                                      settings.edge_cost_storage, key));
+
+    if (!settings.edge_cost_file.empty())
+      tensor->save(settings.edge_cost_file);
+
+    if (settings.verbose)
+      mexPrintf("Computed all edge costs (%g MB): %g (s).\n",
+                tensor->memory_usage() / (1024.0*1024.0), ::get_wtime() - start_time);
+  }
+
+  std::lock_guard<std::mutex> lock(edge_cost_tensor_mutex);
+  edge_cost_tensor_cache = tensor;
+
+  return tensor;
+}
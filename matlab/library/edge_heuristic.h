@@ -0,0 +1,267 @@
+#pragma once
+#include <cstdint>
+
+#include "edge_cost_cache.h"
+#include "local_limits.h"
+
+// A* lower bound for the edge pair (torsion) graph computed in the
+// edge (curvature) graph.
+//
+// Every transition of the edge pair graph costs at least as much as
+// the corresponding transition of the edge graph (the torsion term is
+// non-negative), so the edge graph distance from the last edge of an
+// edge pair to the end set is a lower bound. It is much tighter than
+// the node graph distance when the curvature penalty is large.
+
+// Distance from every edge to the end set in the edge graph, computed
+// by running Dijkstra backwards from the end set. Entry voxel*K + k is
+// the cost of the cheapest continuation after the edge leaving voxel in
+// direction k. Unreachable edges get the largest float.
+template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Voxel>
+std::vector<float> edge_distances_to_end(const matrix<Voxel>& data,
+                                         const matrix<unsigned char>& mesh_map,
+                                         const GridGeometry& grid,
+                                         const matrix<int>& connectivity,
+                                         const InstanceSettings& settings,
+                                         Edge_cost_cache<Data_cost>& edge_cost)
+{
+  Pair_cost pair_cost(data, settings);
+  Triplet_cost triplet_cost(data, settings);
+  Delta_point delta_point(connectivity);
+
+  const int K = delta_point.size();
+  int num_edges = mesh_map.numel()*K;
+
+  bool cacheable = true;
+  if ( (pair_cost.data_dependent) && (settings.penalty[0] > 0) )
+      cacheable = false;
+
+  if ( (triplet_cost.data_dependent) && (settings.penalty[1] > 0) )
+      cacheable = false;
+
+  std::vector<double> regularization_cache(K*K);
+
+  if (cacheable)
+  {
+    Connectivity_symmetry symmetry(connectivity, settings.voxel_dimensions);
+    Point p1(0,0,0);
+
+    fill_symmetric_table(regularization_cache, symmetry.canonical_tuples(2),
+      [&](int n) -> double
+      {
+        Point p2 = delta_point(p1, n / K);
+        Point p3 = delta_point(p2, n % K);
+
+        return triplet_cost( p1.xyz, p2.xyz, p3.xyz)
+             + pair_cost(    p2.xyz, p3.xyz);
+      });
+  }
+
+  // Edges which may precede each edge under the local limits.
+  std::vector<char> length_ok =
+    length_limit_table<Pair_cost>(data, connectivity, settings);
+  std::vector<char> curvature_ok =
+    curvature_limit_table<Triplet_cost>(data, connectivity, settings);
+
+  Successor_table predecessors(K, K,
+    [&](int e2, int e1)
+    {
+      return length_ok[e1] && curvature_ok[e1*K + e2];
+    });
+
+  // The search starts in the edges entering the end set.
+  std::set<int> end_edges, no_edges;
+
+  for (int n = 0; n < mesh_map.numel(); ++n)
+  {
+    if (mesh_map(n) != 3)
+      continue;
+
+    Point p1 = grid.make_point(n);
+
+    for (int e1 = 0; e1 < K; e1++)
+    {
+      if (!length_ok[e1])
+        continue;
+
+      Point p2 = delta_point.reverse(p1,e1);
+      if (!grid.valid_point(p2))
+        continue;
+
+      if (settings.fully_contained_set)
+        if (mesh_map(p2[0], p2[1], p2[2]) != 3)
+          continue;
+
+      end_edges.insert(grid.point2ind(p2)*K + e1);
+    }
+  }
+
+  // Reversed edge graph: the neighbors of edge (p2,e2) are the edges
+  // (p1,e1) leading into p2, with the cost of continuing with (p2,e2).
+  auto get_predecessors =
+    [&edge_cost, &pair_cost, &triplet_cost, &regularization_cache,
+     &cacheable, &predecessors, &delta_point, &grid, K]
+    (int e, std::vector<Neighbor>* neighbors) -> void
+  {
+    int element_2 = e / K;
+    int e2 = e % K;
+
+    Point p2 = grid.make_point(element_2);
+    Point p3 = delta_point(p2, e2);
+
+    double data_cost = edge_cost(element_2, e2, p2, p3);
+
+    for (const int* itr = predecessors.begin(e2); itr != predecessors.end(e2); itr++)
+    {
+      int e1 = *itr;
+      Point p1 = delta_point.reverse(p2, e1);
+
+      if (!grid.valid_point(p1))
+        continue;
+
+      double cost = data_cost;
+
+      if (cacheable)
+      {
+        cost += regularization_cache[e1*K + e2];
+      } else
+      {
+        cost += triplet_cost(p1.xyz, p2.xyz, p3.xyz);
+        cost += pair_cost(           p2.xyz, p3.xyz);
+      }
+
+      neighbors->push_back(Neighbor(grid.point2ind(p1)*K + e1, cost));
+    }
+  };
+
+  ShortestPathOptions options;
+  options.compute_all_distances = true;
+
+  std::vector<int> path;
+  shortest_path(num_edges, end_edges, no_edges, get_predecessors, &path, 0, options);
+
+  return std::move(options.distance);
+}
+
+// Compressed storage of the edge graph distances.
+//
+// edge_min:    minimum over the edges entering each voxel, one float per voxel.
+// edge_uint16: per edge, rounded down to 16 bits.
+// edge_uint8:  per edge, rounded down to 8 bits.
+//
+// Rounding is always downwards, so the bound stays a lower bound.
+class Edge_lower_bound
+{
+public:
+  Edge_lower_bound(const std::vector<float>& distances,
+                   const matrix<int>& connectivity,
+                   const GridGeometry& grid,
+                   A_star_heuristic type)
+    : type(type), num_directions(connectivity.M), scale(1)
+  {
+    if (type == edge_min_heuristic)
+    {
+      Delta_point delta_point(connectivity);
+      int num_voxels = distances.size() / num_directions;
+      voxel_distance.resize(num_voxels, unreachable_distance);
+
+      for (int n = 0; n < num_voxels; n++)
+      {
+        Point p1 = grid.make_point(n);
+
+        for (int k = 0; k < num_directions; k++)
+        {
+          Point p2 = delta_point(p1,k);
+          if (!grid.valid_point(p2))
+            continue;
+
+          float& d = voxel_distance[grid.point2ind(p2)];
+          d = std::min(d, distances[n*num_directions + k]);
+        }
+      }
+    }
+    else if (type == edge_uint16_heuristic)
+      quantize(distances, codes16);
+    else if (type == edge_uint8_heuristic)
+      quantize(distances, codes8);
+    else
+      throw runtime_error("Edge_lower_bound: unknown heuristic");
+  }
+
+  // Lower bound on the remaining cost after the edge leaving voxel
+  // in direction k and ending in head.
+  double operator()(int voxel, int k, int head) const
+  {
+    if (type == edge_min_heuristic)
+      return voxel_distance[head];
+
+    int edge = voxel*num_directions + k;
+
+    if (type == edge_uint16_heuristic)
+      return decode(codes16[edge]);
+    else
+      return decode(codes8[edge]);
+  }
+
+  std::size_t memory_usage() const
+  {
+    return voxel_distance.size()*sizeof(float)
+         + codes16.size()*sizeof(uint16_t)
+         + codes8.size()*sizeof(uint8_t);
+  }
+
+protected:
+  template<typename Code>
+  void quantize(const std::vector<float>& distances, std::vector<Code>& codes)
+  {
+    const Code unreachable = std::numeric_limits<Code>::max();
+
+    float max_distance = 0;
+    for (float d : distances)
+      if (d < unreachable_distance)
+        max_distance = std::max(max_distance, d);
+
+    if (max_distance > 0)
+      scale = double(max_distance) / (unreachable - 1);
+
+    codes.resize(distances.size());
+
+    #ifdef USE_OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int i = 0; i < distances.size(); i++)
+    {
+      if (distances[i] >= unreachable_distance)
+      {
+        codes[i] = unreachable;
+        continue;
+      }
+
+      double code = std::min(std::floor(distances[i] / scale), double(unreachable - 1));
+
+      while (code > 0 && code*scale > distances[i])
+        code--;
+
+      codes[i] = Code(code);
+    }
+  }
+
+  template<typename Code>
+  double decode(Code code) const
+  {
+    if (code == std::numeric_limits<Code>::max())
+      return unreachable_distance;
+
+    return code*scale;
+  }
+
+  const float unreachable_distance = std::numeric_limits<float>::max();
+
+  A_star_heuristic type;
+  int num_directions;
+  double scale;
+
+  std::vector<float> voxel_distance;
+  std::vector<uint16_t> codes16;
+  std::vector<uint8_t> codes8;
+};
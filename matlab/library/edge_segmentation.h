@@ -1,4 +1,6 @@
 #include "curve_segmentation.h"
+#include "edge_cost_cache.h"
+#include "local_limits.h"
 
 // The indexing:
 // Assume we have M neighbors in connectivity.
@@ -17,21 +19,21 @@ std::tuple<int,int> root_and_edge(int edge_num, const matrix<int>& connectivity)
 }
 
 // Gives tail of the edge
-Point  tail_of_edge(int edge_num, const matrix<int>& connectivity)
+Point  tail_of_edge(int edge_num, const matrix<int>& connectivity, const GridGeometry& grid)
 {
   int num_points_per_element =  connectivity.M;
   int tail    = edge_num / num_points_per_element;
 
-  return make_point(tail);
+  return grid.make_point(tail);
 }
 
 // Gives head and tail of the edge
-Point  head_of_edge(int edge_num, const matrix<int>& connectivity)
+Point  head_of_edge(int edge_num, const matrix<int>& connectivity, const GridGeometry& grid)
 {
   int num_points_per_element =  connectivity.M;
   int edgeid = edge_num % num_points_per_element;
 
-  Point tail_point = tail_of_edge(edge_num, connectivity);
+  Point tail_point = tail_of_edge(edge_num, connectivity, grid);
 
   return Point( tail_point[0] + connectivity(edgeid,0),
                 tail_point[1] + connectivity(edgeid,1),
@@ -39,66 +41,81 @@ Point  head_of_edge(int edge_num, const matrix<int>& connectivity)
 }
 
 
-std::vector<Point>  edgepath_to_points(const std::vector<int>& path, const matrix<int>& connectivity)
+std::vector<Point>  edgepath_to_points(const std::vector<int>& path, const matrix<int>& connectivity, const GridGeometry& grid)
 {
   std::vector<Point> point_vector;
   Point first();
 
   // Start point
   if (path.size() > 0) {
-     Point tail = tail_of_edge(path[0], connectivity);
+     Point tail = tail_of_edge(path[0], connectivity, grid);
      point_vector.push_back(tail);
   }
 
   for (int i = 0; i < path.size(); i++) {
-     Point head = head_of_edge(path[i], connectivity);
+     Point head = head_of_edge(path[i], connectivity, grid);
      point_vector.push_back(head);
   }
 
   return point_vector;
 }
 
+// Stores the smallest value over the visited edges touching each voxel.
+// Edges with the value unvisited are skipped.
+//
+// Every voxel gathers from the edges leaving it and the edges ending in
+// it, so the voxels are processed in parallel without conflicts and
+// without decoding the index of every edge.
 template<typename nodeT, typename edgeT>
-void store_results_edge(matrix<nodeT>& node_container, std::vector<edgeT>& edge_container, const matrix<int>& connectivity)
+void store_results_edge(matrix<nodeT>& node_container, const std::vector<edgeT>& edge_container, edgeT unvisited, const matrix<int>& connectivity, const GridGeometry& grid)
 {
+  const int K = connectivity.M;
+  Delta_point delta_point(connectivity);
+
   // Initialize.
   for (int i = 0; i < node_container.numel(); ++i)
       node_container(i) = -1;
 
-  // Go through each each edge stored in visit time
-  // if it has been visited then it's != -1
-  std::vector<Point> point_vector(2, make_point(0));
-  for (int i = 0; i < edge_container.size(); i++)
-  {
-    if (edge_container[i] == -1)
-      continue;
+  if (edge_container.empty())
+    return;
 
-    point_vector[0] = tail_of_edge(i, connectivity);
-    point_vector[1] = head_of_edge(i, connectivity);
+  #ifdef USE_OPENMP
+  #pragma omp parallel for
+  #endif
+  for (int n = 0; n < grid.numel(); n++)
+  {
+    Point p = grid.make_point(n);
+    nodeT value = -1;
 
-    for (Point p : point_vector)
+    auto reduce = [&value, unvisited](edgeT edge_value)
     {
-      if (!valid_point(p))
-        continue;
+      if (edge_value == unvisited)
+        return;
 
-      nodeT visit_value = node_container(p[0], p[1], p[2]);
+      if ( (value == -1) || (value > edge_value) )
+        value = edge_value;
+    };
 
-      if ( (visit_value == -1) ||
-          ( (visit_value >= 0) && (visit_value > edge_container[i]) ) )
-      {
-        node_container(p[0], p[1], p[2]) = edge_container[i];
-      }
+    // Edges with n as tail.
+    for (int k = 0; k < K; k++)
+      reduce(edge_container[n*K + k]);
+
+    // Edges with n as head.
+    for (int k = 0; k < K; k++)
+    {
+      Point tail = delta_point.reverse(p,k);
+      if (grid.valid_point(tail))
+        reduce(edge_container[grid.point2ind(tail)*K + k]);
     }
-  }
 
-  return;
+    node_container(n) = value;
+  }
 }
 
-
-
-template<typename Data_cost, typename Pair_cost, typename Triplet_cost>
-void edge_segmentation( const matrix<double>& data,
+template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Voxel>
+void edge_segmentation( const matrix<Voxel>& data,
                         const matrix<unsigned char>& mesh_map,
+                        const GridGeometry& grid,
                         const matrix<int>& connectivity,
                         InstanceSettings& settings,
                         ShortestPathOptions& options
@@ -133,37 +150,85 @@ void edge_segmentation( const matrix<double>& data,
 
   // Filling the cache
   // connectivity.M is the number of edges from each  each node
+  // The costs are evaluated once per orbit of the connectivity symmetries.
   std::vector<double> regularization_cache(num_edges_per_point);
 
   int x,y,z, x2,y2,z2, element_number, element_number_2;
   if (cacheable)
   {
-    Point p1 = make_point(0);
+    Connectivity_symmetry symmetry(connectivity, settings.voxel_dimensions);
+    Point p1(0,0,0);
+
+    fill_symmetric_table(regularization_cache, symmetry.canonical_tuples(2),
+      [&](int n) -> double
+      {
+        Point p2 = delta_point(p1, n / num_points_per_element);
+        Point p3 = delta_point(p2, n % num_points_per_element);
 
-    for (int i = 0; i < delta_point.size(); i++) {
-      Point p2 = delta_point(p1,i);
+        return triplet_cost( p1.xyz, p2.xyz, p3.xyz)
+             + pair_cost(    p2.xyz, p3.xyz);
+      });
+  }
 
-    for (int j = 0; j < delta_point.size(); j++) {
-      Point p3 = delta_point(p2,j);
-      int n = i*num_points_per_element +j;
 
-      regularization_cache[n] = triplet_cost( p1.xyz, p2.xyz, p3.xyz)
-                              + pair_cost(    p2.xyz, p3.xyz);
-    }
-    }
+  // Edges which may follow each edge under the local limits.
+  std::vector<char> length_ok =
+    length_limit_table<Pair_cost>(data, connectivity, settings);
+  std::vector<char> curvature_ok =
+    curvature_limit_table<Triplet_cost>(data, connectivity, settings);
+
+  Successor_table successors(num_points_per_element, num_points_per_element,
+    [&](int e1, int e2)
+    {
+      return length_ok[e2] && curvature_ok[e1*num_points_per_element + e2];
+    });
+
+  if (settings.verbose && successors.removed() > 0)
+    mexPrintf("Local limits removed %d of %d transitions.\n",
+              int(successors.removed()), num_edges_per_point);
+
+  std::shared_ptr<const Edge_cost_tensor> edge_costs =
+    precomputed_edge_costs(data_cost, data, connectivity, grid, settings);
+
+  bool cache_data_cost = !edge_costs && memoize_data_cost(connectivity, grid, settings);
+  Disallowed_edges disallowed(mesh_map, connectivity, grid);
+
+  Edge_cost_cache<Data_cost> edge_cost(data_cost, connectivity, grid,
+                                       cache_data_cost, edge_costs, &disallowed);
+
+  Edge_cost_cache<Pair_cost> pair_memo(pair_cost, connectivity, grid,
+    memoize_pair_cost(pair_cost, connectivity, grid, settings));
+
+  if (settings.verbose)
+  {
+    edge_cost.count_lookups();
+    pair_memo.count_lookups();
   }
 
+  if (cache_data_cost && settings.prefill_data_cost)
+  {
+    if (settings.verbose)
+      mexPrintf("Computing all data costs...");
+
+    edge_cost.prefill();
+
+    if (settings.verbose)
+      mexPrintf("done.\n");
+  }
 
   if (settings.verbose)
     mexPrintf("Creating start/end sets...");
 
-  std::set<int> start_set, end_set;
+  // Start edges with their initial cost, which includes the
+  // length of the first edge.
+  std::vector<std::pair<int, double>> start_set;
+  std::set<int> end_set;
 
   
   // Add edges according to mesh_map
   for (int n = 0; n < mesh_map.numel(); ++n)
   {
-    Point p1 = make_point(n);
+    Point p1 = grid.make_point(n);
 
     // Start set
     if ( mesh_map(p1[0], p1[1], p1[2]) == 2)
@@ -171,18 +236,23 @@ void edge_segmentation( const matrix<double>& data,
       for (int e1 = 0; e1 < delta_point.size(); e1++) 
       { 
 
+        if (!length_ok[e1])
+          continue;
+
         Point p2 = delta_point(p1,e1);
-        if (valid_point(p2))
+        if (grid.valid_point(p2))
         {
           int edge_id = n*num_points_per_element + e1;
-          bool add = true;
 
           // Only add edges _fully_ contained in the start and end set
           if (settings.fully_contained_set)
             if (mesh_map(p2[0], p2[1], p2[2]) != 2) 
               continue;
-          
-          start_set.insert(edge_id);
+
+          double cost  = edge_cost( n, e1, p1, p2);
+          cost        += pair_memo( n, e1, p1, p2);
+
+          start_set.push_back(std::make_pair(edge_id, cost));
         }
       }
     }
@@ -192,10 +262,13 @@ void edge_segmentation( const matrix<double>& data,
     {
       for (int e1 = 0; e1 < delta_point.size(); e1++) 
       { 
+        if (!length_ok[e1])
+          continue;
+
         Point p2 = delta_point.reverse(p1,e1);
-        if (valid_point(p2))
+        if (grid.valid_point(p2))
         {
-          int edge_id = point2ind(p2)*num_points_per_element + e1;
+          int edge_id = grid.point2ind(p2)*num_points_per_element + e1;
 
           if (settings.fully_contained_set)
             if (mesh_map(p2[0], p2[1], p2[2]) != 3) 
@@ -207,125 +280,86 @@ void edge_segmentation( const matrix<double>& data,
     }
   }
 
-  int e_super = num_edges;
-  std::set<int> super_edge;
-  super_edge.insert(e_super);
-
   if (settings.verbose)
     mexPrintf("done.\n");
 
   int evaluations = 0;
   auto get_neighbors =
-    [ &evaluations, &data_cost, &num_points_per_element, &regularization_cache,
-      &e_super, &start_set, &connectivity, &pair_cost, 
-      &cacheable, &triplet_cost, &delta_point]
+    [ &evaluations, &edge_cost, &num_points_per_element, &regularization_cache,
+      &connectivity, &pair_memo,
+      &cacheable, &triplet_cost, &delta_point, &successors, &grid]
     (int e, std::vector<Neighbor>* neighbors) -> void
   {
     evaluations++;
 
-    if (e == e_super)
-    {
-      for (auto itr = start_set.begin();
-           itr != start_set.end();
-           itr++)
-      {
-        int root, k;
-        tie(root, k) = root_and_edge(*itr, connectivity);
+    // "Grow" out an edge pair passing to points p2 and p3.
+    int root, edge_id_1;
+    tie(root, edge_id_1) = root_and_edge(e, connectivity);
 
-        Point p1 = make_point(root);
-        Point p2 = delta_point(p1, k);
+    Point p1 = grid.make_point(root);
+    Point p2 = delta_point(p1, edge_id_1);
+    int element_2 = grid.point2ind(p2);
+    
+    const int* edge_ids = successors.begin(edge_id_1);
+    int num_successors = successors.size(edge_id_1);
 
-        double cost  = data_cost(   p1.xyz, p2.xyz);
-        cost        += pair_cost( p1.xyz, p2.xyz);
+    neighbors->resize(num_successors);
 
-        neighbors->push_back(Neighbor(*itr, cost));
-      }
-    } else
-    {
-      // "Grow" out an edge pair passing to points p2 and p3.
-      int root, edge_id_1;
-      tie(root, edge_id_1) = root_and_edge(e, connectivity);
-
-      Point p1 = make_point(root);
-      Point p2 = delta_point(p1, edge_id_1);
-      
-      neighbors->resize(num_points_per_element);
+    #ifdef USE_OPENMP
+    #pragma omp parallel for
+    #endif
 
-      #ifdef USE_OPENMP
-      #pragma omp parallel for
-      #endif
+    for (int i = 0; i < num_successors; ++i)
+    {
+      int edge_id_2 = edge_ids[i];
+      Point p3 = delta_point(p2, edge_id_2);
+      int dest;
+      double cost;
 
-      for (int edge_id_2 = 0; edge_id_2 < num_points_per_element; ++edge_id_2)
+      if (grid.valid_point(p3))
       {
-        Point p3 = delta_point(p2, edge_id_2);
-        int dest;
-        double cost;
+        dest = element_2*num_points_per_element + edge_id_2;
+        cost = edge_cost(element_2, edge_id_2, p2, p3);
 
-        if (valid_point(p3))
+        if (cacheable)
         {
-          dest = point2ind(p2)*num_points_per_element + edge_id_2;
-          cost = data_cost(p2.xyz, p3.xyz);
-
-          if (cacheable)
-          {
-            // Lookup id
-            int edge_type =  edge_id_1*num_points_per_element + edge_id_2;
-            cost += regularization_cache[edge_type];
-          } else
-          {
-            cost += triplet_cost(p1.xyz,p2.xyz, p3.xyz);
-            cost += pair_cost   (       p2.xyz, p3.xyz);
-          }
-        }
-
-        else {
-          cost = std::numeric_limits<double>::infinity();
-          dest = 0;
+          // Lookup id
+          int edge_type =  edge_id_1*num_points_per_element + edge_id_2;
+          cost += regularization_cache[edge_type];
+        } else
+        {
+          cost += triplet_cost(p1.xyz,p2.xyz, p3.xyz);
+          cost += pair_memo(element_2, edge_id_2, p2, p3);
         }
+      }
 
-        (*neighbors)[edge_id_2] = Neighbor(dest, cost);
+      else {
+        cost = std::numeric_limits<double>::infinity();
+        dest = 0;
       }
+
+      (*neighbors)[i] = Neighbor(dest, cost);
     }
   };
 
-  ShortestPathOptions heuristic_options;
-  heuristic_options.compute_all_distances = true;
-
   // The lower bound function is just the distance
   // without curvature taken into account.
+  Node_lower_bound node_distance;
+
   std::function<double(int)> lower_bound =
-    [&heuristic_options, &connectivity]
+    [&node_distance, &connectivity, &grid]
     (int e) -> double
   {
-    Point p = head_of_edge(e, connectivity);
-    return heuristic_options.distance[point2ind(p)];
+    Point p = head_of_edge(e, connectivity, grid);
+    return node_distance(grid.point2ind(p));
   };
 
   std::function<double(int)>* lower_bound_pointer = nullptr;
 
+  // If all parents are to be stored A* will not help.
   if (settings.use_a_star && !options.store_parents) {
-    // Call node_segmentation. It solves the same problem, but without
-    // the curvature term.
-    // We tell it to compute all distances, and we will get a
-    // vector of the distance from any node to the end set.
-    // (node_segmentation switches the start and end sets.)
-    // If all parents are to be stored A* will not help.
-    double heuristic_runtime = 0;
-    int heuristic_evaluations = 0;
-    double heuristic_cost = 0;
-    matrix<int> empty_matrix;
-    matrix<double> empty_double_matrix;
-
-    SegmentationOutput heuristic_output
-    (output.points, heuristic_runtime, heuristic_evaluations, heuristic_cost, output.visit_time, empty_matrix, empty_double_matrix);
-
-    node_segmentation<Data_cost, Pair_cost>
-                     (data,
-                      mesh_map,
-                      connectivity,
-                      settings,
-                      heuristic_options,
-                      heuristic_output);
+    node_distance = node_lower_bound<Data_cost, Pair_cost>
+                      (data, mesh_map, grid, connectivity, settings);
 
     lower_bound_pointer = &lower_bound;
   }
@@ -345,8 +379,8 @@ void edge_segmentation( const matrix<double>& data,
 
   options.store_parents = false;
 
-  output.cost = shortest_path(num_edges+1,
-                       super_edge,
+  output.cost = shortest_path(num_edges,
+                       start_set,
                        end_set,
                        get_neighbors,
                        &path_edges,
@@ -359,8 +393,7 @@ void edge_segmentation( const matrix<double>& data,
   double end_time = ::get_wtime();
   output.run_time = end_time - start_time;
 
-  path_edges.erase(path_edges.begin());  // Remove super edge
-  output.points = edgepath_to_points(path_edges, connectivity);
+  output.points = edgepath_to_points(path_edges, connectivity, grid);
 
   output.evaluations = evaluations;
   if (settings.verbose)
@@ -370,14 +403,24 @@ void edge_segmentation( const matrix<double>& data,
     mexPrintf("Evaluations: %d, ", output.evaluations);
     mexPrintf("Path length: %d, ", path_edges.size() );
     mexPrintf("Cost:    %g. \n", output.cost);
+
+    if (cache_data_cost)
+      mexPrintf("Data cost cache hits: %d, misses: %d. \n",
+                int(edge_cost.hits()), int(edge_cost.misses()));
+
+    if (pair_memo.misses() > 0)
+      mexPrintf("Pair cost cache hits: %d, misses: %d. \n",
+                int(pair_memo.hits()), int(pair_memo.misses()));
   }
 
+  const float unreached = std::numeric_limits<float>::max();
+
   if (settings.store_distances)
-    store_results_edge<double,float>(output.distances, options.distance, connectivity);
+    store_results_edge<double,float>(output.distances, options.distance, unreached, connectivity, grid);
 
   // Store visit time
   if (options.store_visited)
-    store_results_edge<int,int>(output.visit_time, options.visit_time, connectivity);
+    store_results_edge<int,int>(output.visit_time, options.visit_time, -1, connectivity, grid);
  
   // Store parents
   // Conflicts are resolved by first visit.
@@ -385,33 +428,33 @@ void edge_segmentation( const matrix<double>& data,
   {
     ASSERT(options.store_visited);
 
-    // Initialize.
-    for (int i = 0; i < output.shortest_path_tree.numel(); ++i)
-        output.shortest_path_tree(i) = -1;
+    const int K = connectivity.M;
 
-    // Go through each edge stored in visit time
-    std::vector<Point> point_vector(2, make_point(0));
-    for (int i = 0; i < options.visit_time.size(); i++)
+    // The parent of a voxel is the tail of the edge ending in it
+    // which was visited first.
+    #ifdef USE_OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int n = 0; n < output.shortest_path_tree.numel(); n++)
     {
-      point_vector[0] = tail_of_edge(i, connectivity);
-      if (!valid_point(point_vector[0]))
-        continue;
+      Point head = grid.make_point(n);
+      int time = output.visit_time(n);
+      int parent = -1;
 
-      point_vector[1] = head_of_edge(i, connectivity);
-      if (!valid_point(point_vector[1]))
-        continue;
+      for (int k = 0; k < K && time != -1; k++)
+      {
+        Point tail = delta_point.reverse(head,k);
+        if (!grid.valid_point(tail))
+          continue;
 
-      int time = output.visit_time( point_vector[1][0],
-                                    point_vector[1][1],
-                                    point_vector[1][2]);
+        int tail_index = grid.point2ind(tail);
 
-      // Is this the edge which was here first?
-      if (time == options.visit_time[i])
-      {
-        output.shortest_path_tree(  point_vector[1][0],
-                                    point_vector[1][1],
-                                    point_vector[1][2]) = point2ind(point_vector[0]);
+        // Is this the edge which was here first?
+        if (options.visit_time[tail_index*K + k] == time)
+          parent = tail_index;
       }
+
+      output.shortest_path_tree(n) = parent;
     }
   }
 }
\ No newline at end of file
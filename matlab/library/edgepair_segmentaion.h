@@ -1,4 +1,8 @@
 #include "curve_segmentation.h"
+#include "edge_cost_cache.h"
+#include "local_limits.h"
+#include "edge_heuristic.h"
+#include "connectivity_symmetry.h"
 
 // The indexing:
 // Assume we have M neighbors in connectivity.
@@ -29,7 +33,7 @@ decompose_pair_of_edgepairs(int edgepair_num, const matrix<int>& connectivity)
 
 // Given edgeapir_id return the three element id's associated with that edgepair 
 std::tuple<int, int, int> 
-points_in_a_edgepair(int edgepair_num, const matrix<int>& connectivity)
+points_in_a_edgepair(int edgepair_num, const matrix<int>& connectivity, const GridGeometry& grid)
 {
   int root, edgepair_id;
   tie(root, edgepair_id) = decompose_pair_of_edgepairs(edgepair_num, connectivity);
@@ -38,7 +42,7 @@ points_in_a_edgepair(int edgepair_num, const matrix<int>& connectivity)
   tie(e1, e2) = decompose_edgepair(edgepair_id, connectivity);
 
   int x,y,z,x2,y2,z2, x3,y3,z3;
-  tie(x,y,z)  = ind2sub(root);
+  tie(x,y,z)  = grid.ind2sub(root);
 
   x2 = x + connectivity(e1,0);
   y2 = y + connectivity(e1,1);
@@ -49,77 +53,188 @@ points_in_a_edgepair(int edgepair_num, const matrix<int>& connectivity)
   z3 = z2 + connectivity(e2,2); 
 
   int q2,q3;
-  q2 = sub2ind(x2,y2,z2);
-  q3 = sub2ind(x3,y3,z3);
+  q2 = grid.sub2ind(x2,y2,z2);
+  q3 = grid.sub2ind(x3,y3,z3);
 
   return std::make_tuple(root,q2,q3);
 }
 
-std::vector<Point> pairpath_to_points(const std::vector<int>& path, const matrix<int>& connectivity)
+std::vector<Point> pairpath_to_points(const std::vector<int>& path, const matrix<int>& connectivity, const GridGeometry& grid)
 {
   std::vector<Point> point_vector;
 
   // Start points
   if (path.size() > 0) {
     int p1, p2;
-    tie(p1, p2, ignore) = points_in_a_edgepair(path[0], connectivity);
-    point_vector.push_back( make_point(p1) );
-    point_vector.push_back( make_point(p2) );
+    tie(p1, p2, ignore) = points_in_a_edgepair(path[0], connectivity, grid);
+    point_vector.push_back( grid.make_point(p1) );
+    point_vector.push_back( grid.make_point(p2) );
   }
 
   for (int i = 0; i < path.size(); i++)
   {
     int p3;
-    tie(ignore,ignore, p3) = points_in_a_edgepair(path[i], connectivity);
-    point_vector.push_back( make_point(p3) );
+    tie(ignore,ignore, p3) = points_in_a_edgepair(path[i], connectivity, grid);
+    point_vector.push_back( grid.make_point(p3) );
   }
   
   return point_vector;
 }
 
+// Stores the smallest value over the visited edge pairs touching each
+// voxel. Edge pairs with the value unvisited are skipped.
+//
+// Every voxel gathers from the edge pairs which visit it as their first,
+// second or third point, so the voxels are processed in parallel without
+// conflicts and without decoding the index of every edge pair.
 template<typename nodeT, typename edgepairT>
-void store_results_edgepair(matrix<nodeT>& node_container, std::vector<edgepairT>& edge_container, const matrix<int>& connectivity)
+void store_results_edgepair(matrix<nodeT>& node_container, const std::vector<edgepairT>& edge_container, edgepairT unvisited, const matrix<int>& connectivity, const GridGeometry& grid)
 {
-  // Initialize.
-  for (int i = 0; i < node_container.numel(); ++i) 
-      node_container(i) = -1; 
+  const int K = connectivity.M;
+  Delta_point delta_point(connectivity);
 
-  // Go through each each edge stored in visit time
-  // if it has been visited then it's != -1
-  int p0,p1,p2;
+  // Initialize.
+  for (int i = 0; i < node_container.numel(); ++i)
+      node_container(i) = -1;
 
-  // No empty constructor.
-  std::vector<Point> point_vector(3, make_point(0));
+  if (edge_container.empty())
+    return;
 
-  for (int i = 0; i < edge_container.size(); i++)
+  #ifdef USE_OPENMP
+  #pragma omp parallel for
+  #endif
+  for (int n = 0; n < grid.numel(); n++)
   {
-    if (edge_container[i] == -1)
-      continue;
+    Point p = grid.make_point(n);
+    nodeT value = -1;
+
+    auto reduce = [&value, unvisited](edgepairT pair_value)
+    {
+      if (pair_value == unvisited)
+        return;
+
+      if ( (value == -1) || (value > pair_value) )
+        value = pair_value;
+    };
 
-    tie(p0,p1,p2) = points_in_a_edgepair(i, connectivity);
-    
-    point_vector[0] = make_point(p0);
-    point_vector[1] = make_point(p1);
-    point_vector[2] = make_point(p2);
+    // Edge pairs with n as first point.
+    for (int i = 0; i < K*K; i++)
+      reduce(edge_container[n*K*K + i]);
 
-    for (Point p : point_vector)
+    for (int e1 = 0; e1 < K; e1++)
     {
-      if (!valid_point(p))
-        continue;
+      Point previous = delta_point.reverse(p,e1);
 
-      nodeT visit_value = node_container(p[0],p[1],p[2]);
+      // Edge pairs with n as second point.
+      if (grid.valid_point(previous))
+      {
+        const edgepairT* pairs = &edge_container[grid.point2ind(previous)*K*K + e1*K];
+        for (int e2 = 0; e2 < K; e2++)
+          reduce(pairs[e2]);
+      }
 
-      if ( (visit_value == -1) || 
-          ( (visit_value >= 0) && (visit_value > edge_container[i]) ) )
+      // Edge pairs with n as third point, whose last edge is e1.
+      for (int e0 = 0; e0 < K; e0++)
       {
-        node_container(p[0],p[1],p[2]) = edge_container[i];
+        Point root = delta_point.reverse(previous,e0);
+        if (grid.valid_point(root))
+          reduce(edge_container[grid.point2ind(root)*K*K + e0*K + e1]);
       }
     }
+
+    node_container(n) = value;
   }
 }
-template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost>
-void  edgepair_segmentation(  const matrix<double>& data,
+
+// Index of the direction pointing the opposite way of each
+// direction in the connectivity, or -1 if it is missing.
+std::vector<int> opposite_directions(const matrix<int>& connectivity)
+{
+  std::vector<int> opposite(connectivity.M, -1);
+
+  for (int i = 0; i < connectivity.M; i++)
+  for (int j = 0; j < connectivity.M; j++)
+  {
+    if ( (connectivity(i,0) == -connectivity(j,0)) &&
+         (connectivity(i,1) == -connectivity(j,1)) &&
+         (connectivity(i,2) == -connectivity(j,2)) )
+      opposite[i] = j;
+  }
+
+  return opposite;
+}
+
+// Dense table over all transitions (e1,e2) -> (e2,e3) in the edge pair graph.
+// Entry (e1*K + e2)*K + e3 holds the regularization cost of the
+// transition, or 0 if compute_costs is false. Transitions
+// going straight back (p2 == p4) are marked with infinity.
+//
+// The pair and triplet costs only depend on (e2,e3) and are computed
+// once per orbit of the connectivity symmetries. The quad cost is
+// assumed to be invariant under reversal of the curve as well (true
+// for torsion), so (e1,e2,e3) and (-e3,-e2,-e1) share one evaluation.
+template<typename Pair_cost, typename Triplet_cost, typename Quad_cost>
+std::vector<double> edgepair_transition_table(const Pair_cost& pair_cost,
+                                              const Triplet_cost& triplet_cost,
+                                              const Quad_cost& quad_cost,
+                                              const matrix<int>& connectivity,
+                                              const Connectivity_symmetry& symmetry,
+                                              bool compute_costs)
+{
+  const double infinity = std::numeric_limits<double>::infinity();
+  Delta_point delta_point(connectivity);
+  const int K = delta_point.size();
+
+  std::vector<int> opposite = opposite_directions(connectivity);
+
+  std::vector<double> pair_triplet_cost(K*K, 0.0);
+  std::vector<double> table(K*K*K, 0.0);
+  Point p1(0,0,0);
+
+  if (compute_costs)
+  {
+    fill_symmetric_table(pair_triplet_cost, symmetry.canonical_tuples(2),
+      [&](int n) -> double
+      {
+        Point p2 = delta_point(p1, n / K);
+        Point p3 = delta_point(p2, n % K);
+
+        return  pair_cost(            p2.xyz, p3.xyz)
+             +  triplet_cost( p1.xyz, p2.xyz, p3.xyz);
+      });
+
+    fill_symmetric_table(table, symmetry.canonical_tuples(3, true),
+      [&](int n) -> double
+      {
+        Point p2 = delta_point(p1, n / (K*K));
+        Point p3 = delta_point(p2, (n / K) % K);
+        Point p4 = delta_point(p3, n % K);
+
+        return quad_cost(p1.xyz, p2.xyz, p3.xyz, p4.xyz);
+      });
+  }
+
+  #ifdef USE_OPENMP
+  #pragma omp parallel for
+  #endif
+  for (int n = 0; n < K*K*K; n++)
+  {
+    int e2 = (n / K) % K;
+    int e3 = n % K;
+
+    if (opposite[e2] == e3)
+      table[n] = infinity;
+    else
+      table[n] += pair_triplet_cost[e2*K + e3];
+  }
+
+  return table;
+}
+
+template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Voxel>
+void  edgepair_segmentation(  const matrix<Voxel>& data,
                               const matrix<unsigned char>& mesh_map,
+                              const GridGeometry& grid,
                               const matrix<int>& connectivity,
                               InstanceSettings& settings,
                               ShortestPathOptions& options,
@@ -155,39 +270,71 @@ void  edgepair_segmentation(  const matrix<double>& data,
   if ( (quad_cost.data_dependent) && (settings.penalty[2] > 0) )
       cacheable = false;
 
-  typedef std::tuple<int, int, int> cache_index;
-  std::map<cache_index, double>  cached_values;
-  Point p1 = make_point(0);
+  // Regularization cost of every transition, looked up by
+  // (e1*K + e2)*K + e3. Also marks the infeasible transitions.
+  Connectivity_symmetry symmetry(connectivity, settings.voxel_dimensions);
 
-  auto regularization_cache =
-    [&cached_values, &connectivity, &pair_cost, 
-      &triplet_cost, &quad_cost, &p1, &delta_point] 
-        (int e1,int e2,int e3)-> double
-  {   
-    cache_index index(e1,e2,e3);
-    auto itr = cached_values.find( index );
+  std::vector<double> transition_table =
+    edgepair_transition_table(pair_cost, triplet_cost, quad_cost,
+                              connectivity, symmetry, cacheable);
 
-    if (itr != cached_values.end()) 
-    {
-      return itr->second;
-    }
-    else 
+  // Edges which may follow each edge pair, leaving out the transitions
+  // going straight back and those violating the local limits.
+  const int K = delta_point.size();
+
+  std::vector<char> length_ok =
+    length_limit_table<Pair_cost>(data, connectivity, settings);
+  std::vector<char> curvature_ok =
+    curvature_limit_table<Triplet_cost>(data, connectivity, settings);
+  std::vector<char> torsion_ok =
+    torsion_limit_table<Quad_cost>(data, connectivity, settings);
+
+  Successor_table successors(K*K, K,
+    [&](int edgepair_id, int e3)
     {
-      Point p2 = delta_point(p1,e1);
-      Point p3 = delta_point(p2,e2);
-      Point p4 = delta_point(p3,e3);
+      int n = edgepair_id*K + e3;
+      return transition_table[n] != std::numeric_limits<double>::infinity()
+          && length_ok[e3] && curvature_ok[(edgepair_id % K)*K + e3]
+          && torsion_ok[n];
+    });
 
-      double  cost =   pair_cost(                 p3.xyz, p4.xyz);
-              cost +=  triplet_cost(      p2.xyz, p3.xyz, p4.xyz);
-              cost +=  quad_cost(p1.xyz, p2.xyz, p3.xyz, p4.xyz);
+  if (settings.verbose && successors.removed() > 0)
+    mexPrintf("Local limits removed %d of %d transitions.\n",
+              int(successors.removed()), K*K*K);
 
-      cached_values[ index ] = cost;
-      return cost;
-    }
-  };     
+  std::shared_ptr<const Edge_cost_tensor> edge_costs =
+    precomputed_edge_costs(data_cost, data, connectivity, grid, settings);
+
+  bool cache_data_cost = !edge_costs && memoize_data_cost(connectivity, grid, settings);
+  Disallowed_edges disallowed(mesh_map, connectivity, grid);
+
+  Edge_cost_cache<Data_cost> edge_cost(data_cost, connectivity, grid,
+                                       cache_data_cost, edge_costs, &disallowed);
+
+  Edge_cost_cache<Pair_cost> pair_memo(pair_cost, connectivity, grid,
+    memoize_pair_cost(pair_cost, connectivity, grid, settings));
+
+  if (settings.verbose)
+  {
+    edge_cost.count_lookups();
+    pair_memo.count_lookups();
+  }
+
+  if (cache_data_cost && settings.prefill_data_cost)
+  {
+    if (settings.verbose)
+      mexPrintf("Computing all data costs...");
 
-  // Read mesh_map to find end and start set.
-  std::set<int> start_set_pairs, end_set_pairs;
+    edge_cost.prefill();
+
+    if (settings.verbose)
+      mexPrintf("done.\n");
+  }
+
+  // Read mesh_map to find end and start set. The start edge pairs
+  // come with their initial cost, which covers both edges.
+  std::vector<std::pair<int, double>> start_set_pairs;
+  std::set<int> end_set_pairs;
 
 
   // Takes any point start or end point in the mesh
@@ -195,14 +342,14 @@ void  edgepair_segmentation(  const matrix<double>& data,
   // or end set.
   for (int n = 0; n < mesh_map.numel(); ++n)
   {
-    Point p1 = make_point(n);
+    Point p1 = grid.make_point(n);
 
     // Start set
     if ( mesh_map(p1[0], p1[1], p1[2]) == 2)
     {
       for (int e1 = 0; e1 < delta_point.size(); e1++) { 
         Point p2 = delta_point(p1,e1);
-        if (!valid_point(p2))
+        if (!grid.valid_point(p2))
           continue;
 
         if (settings.fully_contained_set)
@@ -211,13 +358,16 @@ void  edgepair_segmentation(  const matrix<double>& data,
 
         for (int e2 = 0; e2 < delta_point.size(); e2++) 
         {
+          if (!(length_ok[e1] && length_ok[e2] && curvature_ok[e1*K + e2]))
+            continue;
+
           Point p3 = delta_point(p2,e2);
 
           // Symmetric neighborhood leads to useless pair going back to itself.
           if (p1 == p3)
             continue;
 
-          if (!valid_point(p3))
+          if (!grid.valid_point(p3))
              continue;
 
           if (settings.fully_contained_set)
@@ -225,7 +375,15 @@ void  edgepair_segmentation(  const matrix<double>& data,
               continue;
 
           int pair_id = n*num_points_per_element + delta_point.size()*e1 + e2;
-          start_set_pairs.insert(pair_id);
+
+          double  cost  = edge_cost(n, e1, p1, p2);
+                  cost += edge_cost(grid.point2ind(p2), e2, p2, p3);
+
+          cost += triplet_cost(p1.xyz,  p2.xyz,p3.xyz);
+          cost += pair_memo(n, e1, p1, p2);
+          cost += pair_memo(grid.point2ind(p2), e2, p2, p3);
+
+          start_set_pairs.push_back(std::make_pair(pair_id, cost));
         }
       }
     }
@@ -235,7 +393,7 @@ void  edgepair_segmentation(  const matrix<double>& data,
     {
       for (int e1 = 0; e1 < delta_point.size(); e1++) { 
         Point p2 = delta_point.reverse(p1,e1);
-        if (!valid_point(p2))
+        if (!grid.valid_point(p2))
           continue;
 
         if (settings.fully_contained_set)
@@ -244,18 +402,21 @@ void  edgepair_segmentation(  const matrix<double>& data,
 
         for (int e2 = 0; e2 < delta_point.size(); e2++) 
         {
+          if (!(length_ok[e1] && length_ok[e2] && curvature_ok[e1*K + e2]))
+            continue;
+
           Point p3 = delta_point.reverse(p2,e2);
           if (p1 == p3)
             continue;
 
-          if (!valid_point(p3))
+          if (!grid.valid_point(p3))
              continue;
 
           if (settings.fully_contained_set)
             if (mesh_map(p3[0], p3[1], p3[2]) != 3) 
               continue;
 
-          int element_number = point2ind(p3); 
+          int element_number = grid.point2ind(p3); 
 
           int pair_id = element_number*num_points_per_element + delta_point.size()*e1 + e2;
           end_set_pairs.insert(pair_id);
@@ -266,144 +427,129 @@ void  edgepair_segmentation(  const matrix<double>& data,
  
 
   // Note:
-  // A* lower bound is calculated on the node-graph
-  // It is possible to to get a tighter bound
-  // by running it on a edge-graph (including curvature penalty). 
-  // However the resulting complete list of all edge costs might be
-  // prohibitively large for many applications.
-
-  ShortestPathOptions heuristic_options;
-  heuristic_options.compute_all_distances = true;
+  // By default the A* lower bound is calculated on the node-graph.
+  // A tighter bound is obtained from the edge-graph (including the
+  // curvature penalty), see edge_heuristic.h. Its complete list of
+  // edge distances is prohibitively large for many applications, so
+  // it is stored compressed (settings.a_star_heuristic).
+
   // The lower bound function is just the distance
   // without curvature taken into account.
+  Node_lower_bound node_distance;
+
   std::function<double(int)> lower_bound =
-    [&heuristic_options, &connectivity]
+    [&node_distance, &connectivity, &grid]
     (int e) -> double
   {
     int p;
-    tie(ignore, ignore, p) = points_in_a_edgepair(e, connectivity);
-    return heuristic_options.distance[p];
+    tie(ignore, ignore, p) = points_in_a_edgepair(e, connectivity, grid);
+    return node_distance(p);
+  };
+
+  // Edge-graph lower bound, from the last edge of the edge pair.
+  std::unique_ptr<Edge_lower_bound> edge_lower_bound;
+
+  std::function<double(int)> edge_graph_lower_bound =
+    [&edge_lower_bound, &connectivity, &delta_point, &grid]
+    (int e) -> double
+  {
+    int root, edgepair_id, e1, e2;
+    tie(root, edgepair_id) = decompose_pair_of_edgepairs(e, connectivity);
+    tie(e1, e2) = decompose_edgepair(edgepair_id, connectivity);
+
+    Point p1 = grid.make_point(root);
+    Point p2 = delta_point(p1, e1);
+    Point p3 = delta_point(p2, e2);
+
+    return (*edge_lower_bound)(grid.point2ind(p2), e2, grid.point2ind(p3));
   };
 
   std::function<double(int)>* lower_bound_pointer = nullptr;
 
-  if (settings.use_a_star && !options.store_parents) {
-    // Call node_segmentation. It solves the same problem, but without
-    // the curvature term.
-    // We tell it to compute all distances, and we will get a
-    // vector of the distance from any node to the end set.
-    // (node_segmentation switches the start and end sets.)
-    // If all parents are to be stored A* will not help.
-    double heuristic_runtime = 0;
-    int heuristic_evaluations = 0;
-    double heuristic_cost = 0;
-    matrix<int> empty_matrix;
-    matrix<double> empty_double_matrix;
-
-    SegmentationOutput heuristic_output
-    (output.points, heuristic_runtime, heuristic_evaluations, heuristic_cost, output.visit_time, empty_matrix, empty_double_matrix);
-
-    node_segmentation<Data_cost, Pair_cost>
-                     (data,
-                      mesh_map,
-                      connectivity,
-                      settings,
-                      heuristic_options,
-                      heuristic_output);
+  if (settings.use_a_star && !options.store_parents &&
+      settings.a_star_heuristic != node_heuristic) {
+    if (settings.verbose)
+      mexPrintf("Computing edge-graph lower bound...");
+
+    double heuristic_start_time = ::get_wtime();
+
+    edge_lower_bound.reset(new Edge_lower_bound(
+      edge_distances_to_end<Data_cost, Pair_cost, Triplet_cost>
+        (data, mesh_map, grid, connectivity, settings, edge_cost),
+      connectivity,
+      grid,
+      settings.a_star_heuristic));
+
+    if (settings.verbose)
+      mexPrintf("done (%g s, %g MB).\n",
+                ::get_wtime() - heuristic_start_time,
+                edge_lower_bound->memory_usage() / (1024.0*1024.0));
+
+    lower_bound_pointer = &edge_graph_lower_bound;
+  }
+  else if (settings.use_a_star && !options.store_parents) {
+    node_distance = node_lower_bound<Data_cost, Pair_cost>
+                      (data, mesh_map, grid, connectivity, settings);
 
     lower_bound_pointer = &lower_bound;
   }
   
-  // Super_edge which all edges goes out from. This is needed
-  // because otherwise the first edge will have 0 regularization
-  int e_super = num_edges;
-  std::set<int> super_edge;
-  super_edge.insert(e_super);
-
   int evaluations = 0;
  auto get_neighbors_torsion =
-    [&evaluations, &data_cost,
-     &e_super, &connectivity, &start_set_pairs,
-     &pair_cost, &triplet_cost, &quad_cost,
-     &regularization_cache, &cacheable, &delta_point]
+    [&evaluations, &edge_cost,
+     &connectivity,
+     &pair_memo, &triplet_cost, &quad_cost,
+     &transition_table, &successors, &cacheable, &delta_point, &grid]
     (int ep, std::vector<Neighbor>* neighbors) -> void
   {
     evaluations++;
 
-    // Special case
-    if (ep == e_super)
-    {
-      for (auto itr = start_set_pairs.begin();
-           itr != start_set_pairs.end();
-           itr++)
-      {
-        int q1, q2, q3;
-        tie(q1, q2, q3) = points_in_a_edgepair(*itr, connectivity);
-
-        Point p2 = make_point(q1);
-        Point p3 = make_point(q2);
-        Point p4 = make_point(q3);
+    // Given an edgepair find adjacent pairs
+    //
+    // From "this nodes" all neighboring edgepairs start.
+    // o -- o -- o -- o (edge pair)
+    //      ^ this node.
+    int root, edgepair_id;
+    tie(root, edgepair_id) = decompose_pair_of_edgepairs(ep, connectivity);
 
-        double  cost  = data_cost(p2.xyz, p3.xyz);
-                cost += data_cost(p3.xyz, p4.xyz);
+    int e1, e2;
+    tie(e1,e2) = decompose_edgepair(edgepair_id, connectivity);
 
-        cost += triplet_cost(p2.xyz,  p3.xyz,p4.xyz);
-        cost += pair_cost(            p2.xyz,p3.xyz);
-        cost += pair_cost(            p3.xyz,p4.xyz);
+    Point p1 = grid.make_point(root);
+    Point p2 = delta_point(p1,e1);
+    Point p3 = delta_point(p2,e2);
+    int element_3 = grid.point2ind(p3);
 
-        neighbors->push_back(Neighbor(*itr, cost));
-      }
-    }
+    const double* transitions = &transition_table[edgepair_id*delta_point.size()];
 
-    // The usual case
-    else
+    for (const int* e = successors.begin(edgepair_id); e != successors.end(edgepair_id); e++)
     {
-      // Given an edgepair find adjacent pairs
-      //
-      // From "this nodes" all neighboring edgepairs start.
-      // o -- o -- o -- o (edge pair)
-      //      ^ this node.
-      int root, edgepair_id;
-      tie(root, edgepair_id) = decompose_pair_of_edgepairs(ep, connectivity);
-
-      int e1, e2;
-      tie(e1,e2) = decompose_edgepair(edgepair_id, connectivity);
-
-      Point p1 = make_point(root);
-      Point p2 = delta_point(p1,e1);
-      Point p3 = delta_point(p2,e2);
-
-      for (int e3 = 0; e3 < delta_point.size(); e3++) 
-      {
-        Point p4 = delta_point(p3,e3);
-
-        double cost;
-        if (!valid_point(p4))
-          continue;
+      int e3 = *e;
+      Point p4 = delta_point(p3,e3);
 
-        if (p2 == p4)
-          continue;
+      double cost;
+      if (!grid.valid_point(p4))
+        continue;
 
-        // Unary cost
-        cost = data_cost(p3.xyz,p4.xyz);
+      // Unary cost
+      cost = edge_cost(element_3, e3, p3, p4);
 
-        if (cacheable)
-        {
-          cost += regularization_cache(e1,e2,e3);
-        } else
-        {
-          cost += pair_cost(                  p3.xyz, p4.xyz);
-          cost += triplet_cost(       p2.xyz, p3.xyz, p4.xyz);
-          cost += quad_cost( p1.xyz,  p2.xyz, p3.xyz, p4.xyz);
-        }
+      if (cacheable)
+      {
+        cost += transitions[e3];
+      } else
+      {
+        cost += pair_memo(element_3, e3, p3, p4);
+        cost += triplet_cost(       p2.xyz, p3.xyz, p4.xyz);
+        cost += quad_cost( p1.xyz,  p2.xyz, p3.xyz, p4.xyz);
+      }
 
-        // Destination id
-        int edge_pair_id = delta_point.size()*e2 + e3;
+      // Destination id
+      int edge_pair_id = delta_point.size()*e2 + e3;
 
-        // Index of neighboring edgepair.
-        int dest = point2ind(p2)*(delta_point.size()*delta_point.size()) + edge_pair_id;
-        neighbors->push_back(Neighbor(dest, cost));
-      }
+      // Index of neighboring edgepair.
+      int dest = grid.point2ind(p2)*(delta_point.size()*delta_point.size()) + edge_pair_id;
+      neighbors->push_back(Neighbor(dest, cost));
     }
   };
 
@@ -419,8 +565,8 @@ void  edgepair_segmentation(  const matrix<double>& data,
     mexPrintf("Computing shortest distance ...");
 
   double start_time = ::get_wtime();
-  output.cost = shortest_path( num_edges+1,
-                        super_edge,
+  output.cost = shortest_path( num_edges,
+                        start_set_pairs,
                         end_set_pairs,
                         get_neighbors_torsion,
                         &path_pairs,
@@ -432,8 +578,7 @@ void  edgepair_segmentation(  const matrix<double>& data,
 
   double end_time = ::get_wtime();
   output.run_time = end_time - start_time;
-  path_pairs.erase(path_pairs.begin()); // Remove super edge
-  output.points = pairpath_to_points(path_pairs, connectivity);
+  output.points = pairpath_to_points(path_pairs, connectivity, grid);
 
   output.evaluations = evaluations;
   if (settings.verbose)
@@ -443,69 +588,72 @@ void  edgepair_segmentation(  const matrix<double>& data,
     mexPrintf("Evaluations: %d,", output.evaluations);
     mexPrintf("Path length: %d,", path_pairs.size() );
     mexPrintf("Cost:    %g. \n", output.cost);
+
+    if (cache_data_cost)
+      mexPrintf("Data cost cache hits: %d, misses: %d. \n",
+                int(edge_cost.hits()), int(edge_cost.misses()));
+
+    if (pair_memo.misses() > 0)
+      mexPrintf("Pair cost cache hits: %d, misses: %d. \n",
+                int(pair_memo.hits()), int(pair_memo.misses()));
   }
 
   // Store extra information.
+  const float unreached = std::numeric_limits<float>::max();
+
   if (settings.store_distances)
-    store_results_edgepair<double,float>(output.distances, options.distance, connectivity);
+    store_results_edgepair<double,float>(output.distances, options.distance, unreached, connectivity, grid);
 
   if (options.store_visited) 
-    store_results_edgepair<int,int>(output.visit_time, options.visit_time, connectivity);
+    store_results_edgepair<int,int>(output.visit_time, options.visit_time, -1, connectivity, grid);
  
   // Conflicts are resolved by first visit.
   if (options.store_parents)
   {
     ASSERT(options.store_visited);
 
-    // Initialize.
-    for (int i = 0; i < output.shortest_path_tree.numel(); ++i)
-        output.shortest_path_tree(i) = -1;
+    const int K = connectivity.M;
 
-    // Go through each each edge stored in visit time
-    // if it has been visited then it's != -1
-    int p0,p1,p2;
-    std::vector<Point> point_vector(3, make_point(0));
-    for (int i = 0; i < options.visit_time.size(); i++)
+    // The parent of a voxel is the previous point of the edge pair
+    // which was visited first, among those visiting the voxel as
+    // second or third point.
+    #ifdef USE_OPENMP
+    #pragma omp parallel for
+    #endif
+    for (int n = 0; n < output.shortest_path_tree.numel(); n++)
     {
-      tie(p0,p1,p2) = points_in_a_edgepair(i, connectivity);
-      point_vector[0] = make_point(p0);
-      point_vector[1] = make_point(p1);
-      point_vector[2] = make_point(p2);
+      Point p = grid.make_point(n);
+      int time = output.visit_time(n);
+      int parent = -1;
 
-      if (!valid_point(point_vector[0]))
-        continue;
-
-      if (!valid_point(point_vector[1]))
-        continue;
+      for (int e1 = 0; e1 < K && time != -1; e1++)
+      {
+        Point previous = delta_point.reverse(p,e1);
+        if (!grid.valid_point(previous))
+          continue;
 
-      if (!valid_point(point_vector[2]))
-        continue;
+        int previous_index = grid.point2ind(previous);
 
-      // First edge
-      int time = output.visit_time( point_vector[1][0],
-                                    point_vector[1][1],
-                                    point_vector[1][2]);
+        // n as second point; the third point has to be valid.
+        for (int e2 = 0; e2 < K; e2++)
+        {
+          Point p3 = delta_point(p,e2);
+          if (grid.valid_point(p3) &&
+              options.visit_time[previous_index*K*K + e1*K + e2] == time)
+            parent = previous_index;
+        }
 
-      // Is this the edge which was here first?
-      if (time == options.visit_time[i])
-      {
-        output.shortest_path_tree(point_vector[1][0],
-                                  point_vector[1][1],
-                                  point_vector[1][2]) = point2ind(point_vector[0]);
+        // n as third point.
+        for (int e0 = 0; e0 < K; e0++)
+        {
+          Point root = delta_point.reverse(previous,e0);
+          if (grid.valid_point(root) &&
+              options.visit_time[grid.point2ind(root)*K*K + e0*K + e1] == time)
+            parent = previous_index;
+        }
       }
 
-      // Second edge
-      time = output.visit_time( point_vector[2][0],
-                                point_vector[2][1],
-                                point_vector[2][2]);
-
-      // Is this the edge which was here first?
-      if (time == options.visit_time[i])
-      {
-        output.shortest_path_tree(point_vector[2][0],
-                                  point_vector[2][1],
-                                  point_vector[2][2]) = point2ind(point_vector[1]);
-      }
+      output.shortest_path_tree(n) = parent;
     }
   }
 }
\ No newline at end of file
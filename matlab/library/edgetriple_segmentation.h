@@ -0,0 +1,652 @@
+#include "curve_segmentation.h"
+#include "edge_cost_cache.h"
+#include "local_limits.h"
+#include "edge_heuristic.h"
+#include "connectivity_symmetry.h"
+
+#include <cstdint>
+#include <unordered_map>
+
+// The indexing:
+// Assume we have K neighbors in connectivity.
+// Then a triple of edges starting in node i with edges e1, e2 and e3
+// has index i*K*K*K + (e1*K + e2)*K + e3;
+// where e1,e2,e3 are indices defined by the connectivity matrix.
+//
+// This overflows int already for small volumes, so the indices are
+// 64 bit and only the states reached by the search are stored.
+
+typedef std::int64_t triple_index;
+
+std::tuple<triple_index,int> decompose_edgetriple(triple_index triple_num, const matrix<int>& connectivity)
+{
+  int divisor = connectivity.M*connectivity.M*connectivity.M;
+
+  triple_index root_node = triple_num / divisor;
+  int triple_id          = triple_num % divisor;
+
+  return std::make_tuple(root_node, triple_id);
+}
+
+// The four points visited by an edge triple. Called for every state
+// the search touches, so nothing is allocated.
+void points_in_a_edgetriple(triple_index triple_num, const matrix<int>& connectivity, const GridGeometry& grid, Point points[4])
+{
+  const int K = connectivity.M;
+
+  triple_index root;
+  int triple_id;
+  tie(root, triple_id) = decompose_edgetriple(triple_num, connectivity);
+
+  int edges[3] = {triple_id / (K*K), (triple_id / K) % K, triple_id % K};
+
+  points[0] = grid.make_point(root);
+  for (int i = 0; i < 3; i++)
+    for (int d = 0; d < 3; d++)
+      points[i+1][d] = points[i][d] + connectivity(edges[i],d);
+}
+
+// Dense table over all transitions (e1,e2,e3) -> (e2,e3,e4) in the edge
+// triple graph. Entry ((e1*K + e2)*K + e3)*K + e4 holds the regularization
+// cost of the transition, or 0 if compute_costs is false. Transitions
+// going straight back are marked with infinity.
+//
+// Everything except the pentuple cost only depends on (e2,e3,e4) and
+// is taken from the edge pair table. The pentuple cost is evaluated
+// once per orbit of the connectivity symmetries and reversal.
+template<typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Pentuple_cost>
+std::vector<double> edgetriple_transition_table(const Pair_cost& pair_cost,
+                                                const Triplet_cost& triplet_cost,
+                                                const Quad_cost& quad_cost,
+                                                const Pentuple_cost& pentuple_cost,
+                                                const matrix<int>& connectivity,
+                                                const Connectivity_symmetry& symmetry,
+                                                bool compute_costs)
+{
+  Delta_point delta_point(connectivity);
+  const int K = delta_point.size();
+
+  std::vector<double> edgepair_table =
+    edgepair_transition_table(pair_cost, triplet_cost, quad_cost,
+                              connectivity, symmetry, compute_costs);
+
+  std::vector<double> table(K*K*K*K, 0.0);
+  Point p1(0,0,0);
+
+  if (compute_costs)
+  {
+    fill_symmetric_table(table, symmetry.canonical_tuples(4, true),
+      [&](int n) -> double
+      {
+        Point p2 = delta_point(p1, n / (K*K*K));
+        Point p3 = delta_point(p2, (n / (K*K)) % K);
+        Point p4 = delta_point(p3, (n / K) % K);
+        Point p5 = delta_point(p4, n % K);
+
+        return pentuple_cost(p1.xyz, p2.xyz, p3.xyz, p4.xyz, p5.xyz);
+      });
+  }
+
+  #ifdef USE_OPENMP
+  #pragma omp parallel for
+  #endif
+  for (int n = 0; n < K*K*K*K; n++)
+    table[n] += edgepair_table[n % (K*K*K)];
+
+  return table;
+}
+
+// Search state of an edge triple. Only the states reached by the
+// search are stored.
+struct Edgetriple_state
+{
+  Edgetriple_state() :
+    distance(std::numeric_limits<float>::max()),
+    estimate(std::numeric_limits<float>::max()),
+    previous(-1),
+    visit_time(-1)
+  { }
+
+  float distance;
+  float estimate;
+  triple_index previous;
+  int visit_time;
+};
+
+typedef std::unordered_map<triple_index, Edgetriple_state> Edgetriple_states;
+
+// Dijkstra or A* in the edge triple graph, as shortest_path but with
+// 64 bit indices and sparse storage.
+//
+// start_set holds the start states together with their initial distance.
+// get_neighbors(i, &neighbors) appends (destination, distance) pairs.
+// is_end(i) tells whether a state belongs to the end set.
+// get_lower_bound may be null, otherwise A* is used.
+template<typename Neighbors, typename Is_end>
+double edgetriple_shortest_path(const std::vector<std::pair<triple_index, double>>& start_set,
+                                Is_end is_end,
+                                Neighbors get_neighbors,
+                                std::vector<triple_index>* path,
+                                const std::function<double(triple_index)>* get_lower_bound,
+                                const ShortestPathOptions& options,
+                                Edgetriple_states& states)
+{
+  typedef float queue_cost;
+  std::set<std::pair<queue_cost, triple_index> > prio_queue;
+
+  std::vector<std::pair<triple_index, double> > neighbor_storage;
+  neighbor_storage.reserve(100);
+
+  if (start_set.size() == 0)
+    throw runtime_error("edgetriple_shortest_path: empty start set");
+
+  for (auto itr = start_set.begin(); itr != start_set.end(); ++itr)
+  {
+    Edgetriple_state& state = states[itr->first];
+    if (itr->second >= state.distance)
+      continue;
+
+    prio_queue.erase(std::make_pair(state.estimate, itr->first));
+
+    state.distance = itr->second;
+    state.estimate = state.distance;
+    if (get_lower_bound)
+      state.estimate += (*get_lower_bound)(itr->first);
+
+    prio_queue.insert(std::make_pair(state.estimate, itr->first));
+  }
+
+  int n_visited = 0;
+  triple_index end_state = -1;
+
+  while (!prio_queue.empty())
+  {
+    triple_index i = prio_queue.begin()->second;
+    prio_queue.erase(prio_queue.begin());
+
+    Edgetriple_state& current = states[i];
+    current.visit_time = ++n_visited;
+
+    if (current.distance >= std::numeric_limits<queue_cost>::max())
+      throw runtime_error("edgetriple_shortest_path: Path too long.");
+
+    // Is state i a goal state? If so, we are done.
+    if (end_state == -1 && is_end(i))
+    {
+      end_state = i;
+      path->clear();
+      for (triple_index j = i; j != -1; j = states[j].previous)
+        path->push_back(j);
+
+      std::reverse(path->begin(), path->end());
+
+      if (!options.compute_all_distances)
+        return current.distance;
+    }
+
+    double current_distance = current.distance;
+
+    neighbor_storage.clear();
+    get_neighbors(i, &neighbor_storage);
+
+    for (auto itr = neighbor_storage.begin(); itr != neighbor_storage.end(); ++itr)
+    {
+      triple_index j = itr->first;
+      double new_dist = current_distance + itr->second;
+
+      Edgetriple_state& state = states[j];
+
+      if (new_dist < state.distance)
+      {
+        prio_queue.erase(std::make_pair(state.estimate, j));
+
+        state.distance = new_dist;
+        state.previous = i;
+        state.estimate = new_dist;
+        if (get_lower_bound)
+          state.estimate += (*get_lower_bound)(j);
+
+        prio_queue.insert(std::make_pair(state.estimate, j));
+
+        if (options.maximum_queue_size > 0 &&
+            prio_queue.size() > options.maximum_queue_size)
+          throw runtime_error("edgetriple_shortest_path: Maximum queue size reached.");
+      }
+    }
+  }
+
+  if (end_state == -1)
+  {
+    if (!options.compute_all_distances)
+      throw runtime_error("edgetriple_shortest_path: No path found.");
+
+    return -1.0;
+  }
+
+  return states[end_state].distance;
+}
+
+std::vector<Point> triplepath_to_points(const std::vector<triple_index>& path, const matrix<int>& connectivity, const GridGeometry& grid)
+{
+  std::vector<Point> point_vector;
+
+  // Start points
+  if (path.size() > 0)
+  {
+    Point points[4];
+    points_in_a_edgetriple(path[0], connectivity, grid, points);
+    point_vector.insert(point_vector.end(), points, points + 3);
+  }
+
+  for (int i = 0; i < path.size(); i++)
+  {
+    Point points[4];
+    points_in_a_edgetriple(path[i], connectivity, grid, points);
+    point_vector.push_back(points[3]);
+  }
+
+  return point_vector;
+}
+
+// Stores the smallest value over all states visiting each voxel.
+template<typename nodeT, typename Value>
+void store_results_edgetriple(matrix<nodeT>& node_container, const Edgetriple_states& states, Value value, const matrix<int>& connectivity, const GridGeometry& grid)
+{
+  // Initialize.
+  for (int i = 0; i < node_container.numel(); ++i)
+      node_container(i) = -1;
+
+  for (auto itr = states.begin(); itr != states.end(); ++itr)
+  {
+    if (itr->second.visit_time == -1)
+      continue;
+
+    nodeT state_value = value(itr->second);
+
+    Point points[4];
+    points_in_a_edgetriple(itr->first, connectivity, grid, points);
+
+    for (Point& p : points)
+    {
+      nodeT& visit_value = node_container(p[0],p[1],p[2]);
+
+      if ( (visit_value == -1) || (visit_value > state_value) )
+        visit_value = state_value;
+    }
+  }
+}
+
+template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Pentuple_cost, typename Voxel>
+void  edgetriple_segmentation(const matrix<Voxel>& data,
+                              const matrix<unsigned char>& mesh_map,
+                              const GridGeometry& grid,
+                              const matrix<int>& connectivity,
+                              InstanceSettings& settings,
+                              ShortestPathOptions& options,
+                              SegmentationOutput& output
+                             )
+{
+  // Some notation for the edge triple graph
+  // Elements corresponds to points in the original graph
+  // Points corresponds to edge triples in the original graph
+  // Edges correspond to pairs of edge triples in the original graph
+  Data_cost data_cost(data, connectivity, settings);
+  Pair_cost pair_cost(data,settings);
+  Triplet_cost triplet_cost(data, settings);
+  Quad_cost quad_cost(data, settings);
+  Pentuple_cost pentuple_cost(data, settings);
+
+  Delta_point delta_point(connectivity);
+  const int K = delta_point.size();
+
+  if (max_index / K < K*K*K)
+      mexErrMsgTxt("Connectivity is too large for the edge triple graph.");
+
+  bool cacheable = true;
+  if ( (pair_cost.data_dependent) && (settings.penalty[0] > 0) )
+      cacheable = false;
+  if ( (triplet_cost.data_dependent) && (settings.penalty[1] > 0) )
+      cacheable = false;
+  if ( (quad_cost.data_dependent) && (settings.penalty[2] > 0) )
+      cacheable = false;
+  if ( (pentuple_cost.data_dependent) && (settings.penalty[3] > 0) )
+      cacheable = false;
+
+  // Regularization cost of every transition, looked up by
+  // ((e1*K + e2)*K + e3)*K + e4. Also marks the infeasible transitions.
+  Connectivity_symmetry symmetry(connectivity, settings.voxel_dimensions);
+
+  std::vector<double> transition_table =
+    edgetriple_transition_table(pair_cost, triplet_cost, quad_cost, pentuple_cost,
+                                connectivity, symmetry, cacheable);
+
+  std::vector<char> length_ok =
+    length_limit_table<Pair_cost>(data, connectivity, settings);
+  std::vector<char> curvature_ok =
+    curvature_limit_table<Triplet_cost>(data, connectivity, settings);
+  std::vector<char> torsion_ok =
+    torsion_limit_table<Quad_cost>(data, connectivity, settings);
+  std::vector<char> jounce_ok =
+    jounce_limit_table<Pentuple_cost>(data, connectivity, settings);
+
+  // Edges which may follow each edge triple.
+  Successor_table successors(K*K*K, K,
+    [&](int triple_id, int e4)
+    {
+      int n = triple_id*K + e4;
+      return transition_table[n] != std::numeric_limits<double>::infinity()
+          && length_ok[e4] && curvature_ok[n % (K*K)]
+          && torsion_ok[n % (K*K*K)] && jounce_ok[n];
+    });
+
+  if (settings.verbose && successors.removed() > 0)
+    mexPrintf("Local limits removed %d of %d transitions.\n",
+              int(successors.removed()), K*K*K*K);
+
+  std::shared_ptr<const Edge_cost_tensor> edge_costs =
+    precomputed_edge_costs(data_cost, data, connectivity, grid, settings);
+
+  bool cache_data_cost = !edge_costs && memoize_data_cost(connectivity, grid, settings);
+  Disallowed_edges disallowed(mesh_map, connectivity, grid);
+
+  Edge_cost_cache<Data_cost> edge_cost(data_cost, connectivity, grid,
+                                       cache_data_cost, edge_costs, &disallowed);
+
+  Edge_cost_cache<Pair_cost> pair_memo(pair_cost, connectivity, grid,
+    memoize_pair_cost(pair_cost, connectivity, grid, settings));
+
+  if (settings.verbose)
+  {
+    edge_cost.count_lookups();
+    pair_memo.count_lookups();
+  }
+
+  if (cache_data_cost && settings.prefill_data_cost)
+  {
+    if (settings.verbose)
+      mexPrintf("Computing all data costs...");
+
+    edge_cost.prefill();
+
+    if (settings.verbose)
+      mexPrintf("done.\n");
+  }
+
+  std::vector<int> opposite = opposite_directions(connectivity);
+
+  auto in_set = [&mesh_map, &grid](const Point& p, unsigned char label) -> bool
+  {
+    return grid.valid_point(p) && mesh_map(grid.point2ind(p)) == label;
+  };
+
+  // The search starts in every edge triple leaving the start set,
+  // with the cost of its three edges as initial distance.
+  std::vector<std::pair<triple_index, double>> start_set_triples;
+
+  for (int n = 0; n < mesh_map.numel(); ++n)
+  {
+    if (mesh_map(n) != 2)
+      continue;
+
+    Point p1 = grid.make_point(n);
+
+    for (int e1 = 0; e1 < K; e1++)
+    {
+      Point p2 = delta_point(p1,e1);
+      if (!length_ok[e1] || !grid.valid_point(p2))
+        continue;
+
+      if (settings.fully_contained_set && !in_set(p2, 2))
+        continue;
+
+      double cost1 = edge_cost(n, e1, p1, p2) + pair_memo(n, e1, p1, p2);
+
+      for (int e2 = 0; e2 < K; e2++)
+      {
+        Point p3 = delta_point(p2,e2);
+        if (!length_ok[e2] || !curvature_ok[e1*K + e2] || opposite[e1] == e2)
+          continue;
+
+        if (!grid.valid_point(p3))
+          continue;
+
+        if (settings.fully_contained_set && !in_set(p3, 2))
+          continue;
+
+        double cost2 = cost1 + edge_cost(grid.point2ind(p2), e2, p2, p3)
+                             + pair_memo(grid.point2ind(p2), e2, p2, p3)
+                             + triplet_cost(p1.xyz, p2.xyz, p3.xyz);
+
+        int element_3 = grid.point2ind(p3);
+        for (int e3 = 0; e3 < K; e3++)
+        {
+          int triple_id = (e1*K + e2)*K + e3;
+          Point p4 = delta_point(p3,e3);
+
+          if (!length_ok[e3] || !curvature_ok[e2*K + e3] || !torsion_ok[triple_id])
+            continue;
+
+          if (opposite[e2] == e3 || !grid.valid_point(p4))
+            continue;
+
+          if (settings.fully_contained_set && !in_set(p4, 2))
+            continue;
+
+          double cost = cost2 + edge_cost(element_3, e3, p3, p4)
+                              + pair_memo(element_3, e3, p3, p4)
+                              + triplet_cost(p2.xyz, p3.xyz, p4.xyz)
+                              + quad_cost(p1.xyz, p2.xyz, p3.xyz, p4.xyz);
+
+          start_set_triples.push_back(std::make_pair(triple_index(n)*K*K*K + triple_id, cost));
+        }
+      }
+    }
+  }
+
+  // An edge triple ends in the end set if its last point does,
+  // or all points with fully_contained_set.
+  auto is_end =
+    [&connectivity, &grid, &settings, &in_set]
+    (triple_index t) -> bool
+  {
+    Point points[4];
+    points_in_a_edgetriple(t, connectivity, grid, points);
+
+    if (!settings.fully_contained_set)
+      return in_set(points[3], 3);
+
+    for (const Point& p : points)
+      if (!in_set(p, 3))
+        return false;
+
+    return true;
+  };
+
+  // Note:
+  // Every transition of the edge triple graph costs at least as much
+  // as the corresponding transition of the edge pair graph, so the
+  // lower bounds of the edge pair graph are used unchanged; either the
+  // node-graph distance from the last point or the edge-graph distance
+  // from the last edge (settings.a_star_heuristic).
+  Node_lower_bound node_distance;
+
+  std::function<double(triple_index)> lower_bound =
+    [&node_distance, &connectivity, &grid]
+    (triple_index t) -> double
+  {
+    Point points[4];
+    points_in_a_edgetriple(t, connectivity, grid, points);
+    return node_distance(grid.point2ind(points[3]));
+  };
+
+  std::unique_ptr<Edge_lower_bound> edge_lower_bound;
+
+  std::function<double(triple_index)> edge_graph_lower_bound =
+    [&edge_lower_bound, &connectivity, &grid, K]
+    (triple_index t) -> double
+  {
+    Point points[4];
+    points_in_a_edgetriple(t, connectivity, grid, points);
+    return (*edge_lower_bound)(grid.point2ind(points[2]), t % K,
+                               grid.point2ind(points[3]));
+  };
+
+  std::function<double(triple_index)>* lower_bound_pointer = nullptr;
+
+  if (settings.use_a_star && !options.store_parents &&
+      settings.a_star_heuristic != node_heuristic) {
+    if (settings.verbose)
+      mexPrintf("Computing edge-graph lower bound...");
+
+    double heuristic_start_time = ::get_wtime();
+
+    edge_lower_bound.reset(new Edge_lower_bound(
+      edge_distances_to_end<Data_cost, Pair_cost, Triplet_cost>
+        (data, mesh_map, grid, connectivity, settings, edge_cost),
+      connectivity,
+      grid,
+      settings.a_star_heuristic));
+
+    if (settings.verbose)
+      mexPrintf("done (%g s, %g MB).\n",
+                ::get_wtime() - heuristic_start_time,
+                edge_lower_bound->memory_usage() / (1024.0*1024.0));
+
+    lower_bound_pointer = &edge_graph_lower_bound;
+  }
+  else if (settings.use_a_star && !options.store_parents) {
+    node_distance = node_lower_bound<Data_cost, Pair_cost>
+                      (data, mesh_map, grid, connectivity, settings);
+
+    lower_bound_pointer = &lower_bound;
+  }
+
+  int evaluations = 0;
+  auto get_neighbors_jounce =
+    [&evaluations, &edge_cost, &connectivity,
+     &pair_memo, &triplet_cost, &quad_cost, &pentuple_cost,
+     &transition_table, &successors, &cacheable, &delta_point, &grid, K]
+    (triple_index t, std::vector<std::pair<triple_index, double>>* neighbors) -> void
+  {
+    evaluations++;
+
+    // o -- o -- o -- o -- o (edge triple)
+    //      ^ all neighboring edge triples start in this node.
+    int triple_id;
+    tie(ignore, triple_id) = decompose_edgetriple(t, connectivity);
+
+    Point points[4];
+    points_in_a_edgetriple(t, connectivity, grid, points);
+    Point& p1 = points[0];
+    Point& p2 = points[1];
+    Point& p3 = points[2];
+    Point& p4 = points[3];
+    int element_4 = grid.point2ind(p4);
+    triple_index dest_root = triple_index(grid.point2ind(p2))*K*K*K;
+
+    const double* transitions = &transition_table[triple_id*K];
+
+    for (const int* e = successors.begin(triple_id); e != successors.end(triple_id); e++)
+    {
+      int e4 = *e;
+      Point p5 = delta_point(p4,e4);
+
+      if (!grid.valid_point(p5))
+        continue;
+
+      // Unary cost
+      double cost = edge_cost(element_4, e4, p4, p5);
+
+      if (cacheable)
+      {
+        cost += transitions[e4];
+      } else
+      {
+        cost += pair_memo(element_4, e4, p4, p5);
+        cost += triplet_cost(                p3.xyz, p4.xyz, p5.xyz);
+        cost += quad_cost(           p2.xyz, p3.xyz, p4.xyz, p5.xyz);
+        cost += pentuple_cost(p1.xyz, p2.xyz, p3.xyz, p4.xyz, p5.xyz);
+      }
+
+      // Index of neighboring edge triple.
+      triple_index dest = dest_root + (triple_id % (K*K))*K + e4;
+      neighbors->push_back(std::make_pair(dest, cost));
+    }
+  };
+
+  // Compute shortest path
+  Edgetriple_states states;
+  std::vector<triple_index> path_triples;
+
+  if (settings.verbose)
+    mexPrintf("Computing shortest distance ...");
+
+  double start_time = ::get_wtime();
+  output.cost = edgetriple_shortest_path(start_set_triples,
+                                         is_end,
+                                         get_neighbors_jounce,
+                                         &path_triples,
+                                         lower_bound_pointer,
+                                         options,
+                                         states);
+
+  double end_time = ::get_wtime();
+  output.run_time = end_time - start_time;
+  output.points = triplepath_to_points(path_triples, connectivity, grid);
+
+  output.evaluations = evaluations;
+  if (settings.verbose)
+  {
+    mexPrintf("done. \n");
+    mexPrintf("Running time:  %g seconds,", output.run_time);
+    mexPrintf("Evaluations: %d,", output.evaluations);
+    mexPrintf("Path length: %d,", path_triples.size() );
+    mexPrintf("Cost:    %g. \n", output.cost);
+    mexPrintf("Stored states: %d (%g MB). \n", int(states.size()),
+              states.size()*(sizeof(triple_index) + sizeof(Edgetriple_state)) / (1024.0*1024.0));
+
+    if (cache_data_cost)
+      mexPrintf("Data cost cache hits: %d, misses: %d. \n",
+                int(edge_cost.hits()), int(edge_cost.misses()));
+
+    if (pair_memo.misses() > 0)
+      mexPrintf("Pair cost cache hits: %d, misses: %d. \n",
+                int(pair_memo.hits()), int(pair_memo.misses()));
+  }
+
+  // Store extra information.
+  if (settings.store_distances)
+    store_results_edgetriple(output.distances, states,
+      [](const Edgetriple_state& s) { return double(s.distance); },
+      connectivity, grid);
+
+  if (options.store_visited || options.store_parents)
+    store_results_edgetriple(output.visit_time, states,
+      [](const Edgetriple_state& s) { return s.visit_time; },
+      connectivity, grid);
+
+  // Conflicts are resolved by first visit.
+  if (options.store_parents)
+  {
+    for (int i = 0; i < output.shortest_path_tree.numel(); ++i)
+        output.shortest_path_tree(i) = -1;
+
+    for (auto itr = states.begin(); itr != states.end(); ++itr)
+    {
+      if (itr->second.visit_time == -1)
+        continue;
+
+      Point points[4];
+      points_in_a_edgetriple(itr->first, connectivity, grid, points);
+
+      for (int k = 1; k < 4; k++)
+      {
+        Point& p = points[k];
+
+        // Is this the edge triple which was here first?
+        if (output.visit_time(p[0],p[1],p[2]) == itr->second.visit_time)
+          output.shortest_path_tree(p[0],p[1],p[2]) = grid.point2ind(points[k-1]);
+      }
+    }
+  }
+}
@@ -35,6 +35,77 @@ R fractional_part(R x)
 	return x - integer_part;
 }
 
+typedef std::tuple<double, double, double> coefficents;
+
+// Coefficients (d11, d10, d01) of the bilinear interpolation of the
+// height map in the cell with lower corner (x_int, y_int). Samples
+// outside the data are taken from the closest point inside it.
+inline coefficents cell_coefficents(const matrix<double>& data, const vector<double>& vd,
+                                    int x_int, int y_int)
+{
+	auto data_value = [&data](int x, int y) -> double
+	{
+		x = std::max(0, std::min(x, int(data.M) - 1));
+		y = std::max(0, std::min(y, int(data.N) - 1));
+		return data(x,y);
+	};
+
+	double i00 = data_value(x_int + 0, y_int + 0)*vd[2];
+	double i01 = data_value(x_int + 0, y_int + 1)*vd[2];
+	double i10 = data_value(x_int + 1, y_int + 0)*vd[2];
+	double i11 = data_value(x_int + 1, y_int + 1)*vd[2];
+
+	double d11 = (i00 + i11 - i10- i01)/(vd[0]*vd[1]);
+	double d10 = (i10 - i00)/(vd[0]*vd[1]);
+	double d01 = (i01 - i00)/(vd[0]*vd[1]);
+
+	return coefficents(d11,d10,d01);
+}
+
+// Values and gradients of a volume at the eight corners of the voxel
+// with lower corner (x_int, y_int, z_int), indexed by dx + 2*dy + 4*dz.
+// The gradients are central differences in the units of the voxel
+// dimensions, since the trilinear interpolation of the values alone
+// has no second derivatives along the axes. Samples outside the data
+// are taken from the closest point inside it.
+struct voxel_corners
+{
+	double value[8];
+	double gradient[8][3];
+};
+
+inline voxel_corners voxel_corner_values(const matrix<double>& data, const vector<double>& vd,
+                                         int x_int, int y_int, int z_int)
+{
+	const int size[3] = {int(data.M), int(data.N), int(data.O)};
+
+	voxel_corners corners;
+	for (int corner = 0; corner < 8; corner++)
+	{
+		int p[3] = {x_int + (corner & 1), y_int + ((corner >> 1) & 1), z_int + ((corner >> 2) & 1)};
+		for (int i = 0; i < 3; i++)
+			p[i] = std::max(0, std::min(p[i], size[i] - 1));
+
+		corners.value[corner] = data(p[0], p[1], p[2]);
+
+		for (int i = 0; i < 3; i++)
+		{
+			int lo[3] = {p[0], p[1], p[2]};
+			int hi[3] = {p[0], p[1], p[2]};
+			lo[i] = std::max(0, p[i] - 1);
+			hi[i] = std::min(size[i] - 1, p[i] + 1);
+
+			if (hi[i] == lo[i])
+				corners.gradient[corner][i] = 0;
+			else
+				corners.gradient[corner][i] = (data(hi[0], hi[1], hi[2]) - data(lo[0], lo[1], lo[2]))
+				                              / ((hi[i] - lo[i])*vd[i]);
+		}
+	}
+
+	return corners;
+}
+
 // Container
 template<typename R>
 class Boundary_points
@@ -94,19 +165,9 @@ public:
     return pair_tuple(x0,y0,dx,dy, d11, d10, d01);
 	}
 
-	typedef std::tuple<double, double, double> coefficents;
 	coefficents get_coefficents(int x_int, int y_int)
 	{
-		double i00 = data_value(x_int + 0, y_int + 0)*vd[2];
-		double i01 = data_value(x_int + 0, y_int + 1)*vd[2];
-		double i10 = data_value(x_int + 1, y_int + 0)*vd[2];
-		double i11 = data_value(x_int + 1, y_int + 1)*vd[2];
-
-		double d11 = (i00 + i11 - i10- i01)/(vd[0]*vd[1]);
-		double d10 = (i10 - i00)/(vd[0]*vd[1]);
-		double d01 = (i01 - i00)/(vd[0]*vd[1]);
-
-		return coefficents(d11,d10,d01);
+		return cell_coefficents(data, vd, x_int, y_int);
 	}
 
 	// All subsequent points
@@ -117,26 +178,6 @@ public:
 		linear_indices.push_back(linear_index);
   }
 
-  // Sample data or closest point inside data.
-  double data_value(int x, int y) const
-  {
-    x = feasible(x, data.M);
-    y = feasible(y, data.N);
-
-    return data(x,y);
-  }
-
-  int feasible(int x, int M) const
-  {
-    if (x < 0)
-      return 0;
-
-    if (x > M-1)
-      return M-1;
-
-    return x;
-  }
-
 protected:
 	std::vector<R> x;
 	std::vector<R> y;
@@ -179,83 +220,132 @@ class Boundary_points_calculator
 	template<typename R>
 	void add_points_along_a_line_segment(R sx, R sy, R ex, R ey, Boundary_points<R>& points) const
 	{
-		using std::abs;
+		add_points_along_a_line_segment(sx, sy, ex, ey, points, M);
+	}
+
+	// Calls points.add(x, y, linear_index) for every boundary crossing
+	// and the end point, where the cells have linear indices
+	// x_int + y_int*stride.
+	template<typename R, typename Points>
+	void add_points_along_a_line_segment(R sx, R sy, R ex, R ey, Points& points, int stride) const
+	{
 		using std::sqrt;
 
-		R dx = (ex - sx)*vd[0];
-		R dy = (ey - sy)*vd[1];
+		// The crossings are fractions of the line in pixels; the voxel
+		// dimensions are applied in get_pair.
+		R dx = ex - sx;
+		R dy = ey - sy;
 		R line_length = sqrt(dx*dx + dy*dy);
 
-		typedef std::pair<R, int> crossing;
+		static thread_local std::vector<std::pair<R, int>> local_space;
+		std::vector<std::pair<R, int>>* scratch_space = &local_space;
 
-		// Invariant of direction
-		auto intersection =
-		[&]
-		(int index_change, R line_length, R dx, R start,
-		 std::vector<crossing>& crossings) -> void
-		{
-			R k = dx/line_length;
+		int source_id =  int( spii::to_double(sx) )  + int( spii::to_double(sy) )*stride;
 
-			if (abs(k) < 1e-6)
-				return;
+		scratch_space->clear();
+		scratch_space->push_back( std::pair<R, int>(R(-1e-100), 0) );
+		add_crossings(1,line_length, dx, sx, *scratch_space);
+		add_crossings(stride,line_length, dy, sy, *scratch_space);
+		std::sort(scratch_space->begin(), scratch_space->end());
 
-			R current;
-			if (k > 0)
-			{
-				current = 1.0 - fractional_part(start);
-			}
-			else
-			{
-				current = fractional_part(start);
-				index_change = -index_change;
+		// Remove small increments
+		auto prev = scratch_space->begin();
+		auto next = scratch_space->begin();
+		next++;
+		for (; next != scratch_space->end(); prev++, next++)
+		{
+			// (Sorted)
+			if ( (next->first - prev->first) > 1e-6)
+			{				
+				R xc = sx + (next->first)*dx;
+				R yc = sy + (next->first)*dy;
+				points.add(xc,yc, source_id);
 			}
 
-			// -eps to avoid adding last point
-			for (; current < abs(dx) - 1e-6; current = current +1)
-				crossings.push_back( crossing( abs(current/dx) , index_change) );
-		};
+			source_id += next->second;
+		}
+
+		points.add(ex,ey, source_id);
+	}
+
+	// The same for a line in a volume: calls points.add(x, y, z, linear_index)
+	// where the voxels have linear indices x_int + y_int*stride + z_int*slice.
+	template<typename R, typename Points>
+	void add_points_along_a_line_segment(R sx, R sy, R sz, R ex, R ey, R ez,
+	                                     Points& points, int stride, int slice) const
+	{
+		using std::sqrt;
 
-		std::vector<crossing>* scratch_space;
-		#ifdef USE_OPENMP
-			// Maximum 100 threads.
-			// Support for C++11 thread_local is not very good yet.
-			static std::vector<crossing> local_space[100];
-			scratch_space = &local_space[omp_get_thread_num()];
-		#else
-			static std::vector<crossing> local_space;
-			scratch_space = &local_space;
-		#endif
+		R dx = ex - sx;
+		R dy = ey - sy;
+		R dz = ez - sz;
+		R line_length = sqrt(dx*dx + dy*dy + dz*dz);
 
-		int source_id =  int( spii::to_double(sx) )  + int( spii::to_double(sy) )*M;
+		static thread_local std::vector<std::pair<R, int>> local_space;
+		std::vector<std::pair<R, int>>* scratch_space = &local_space;
+
+		int source_id = int( spii::to_double(sx) ) + int( spii::to_double(sy) )*stride
+		              + int( spii::to_double(sz) )*slice;
 
 		scratch_space->clear();
-		scratch_space->push_back( crossing(R(-1e-100), 0) );
-		intersection(1,line_length, dx, sx, *scratch_space);
-		intersection(M,line_length, dy, sy, *scratch_space);
+		scratch_space->push_back( std::pair<R, int>(R(-1e-100), 0) );
+		add_crossings(1, line_length, dx, sx, *scratch_space);
+		add_crossings(stride, line_length, dy, sy, *scratch_space);
+		add_crossings(slice, line_length, dz, sz, *scratch_space);
 		std::sort(scratch_space->begin(), scratch_space->end());
 
-		// Remove small increments
 		auto prev = scratch_space->begin();
 		auto next = scratch_space->begin();
 		next++;
 		for (; next != scratch_space->end(); prev++, next++)
 		{
-			// (Sorted)
 			if ( (next->first - prev->first) > 1e-6)
-			{				
+			{
 				R xc = sx + (next->first)*dx;
 				R yc = sy + (next->first)*dy;
-				points.add(xc,yc, source_id);
+				R zc = sz + (next->first)*dz;
+				points.add(xc,yc,zc, source_id);
 			}
 
 			source_id += next->second;
 		}
 
-		points.add(ex,ey, source_id);
+		points.add(ex,ey,ez, source_id);
 	}
 
   const matrix<double> data;
 	const vector<double> vd;
 	int M; // rows
 	int N; // cols
+
+protected:
+	// Adds the fractions of the line where it crosses a cell boundary
+	// along one axis, together with the change of the linear index.
+	// Invariant of direction.
+	template<typename R>
+	static void add_crossings(int index_change, R line_length, R dx, R start,
+	                          std::vector<std::pair<R, int>>& crossings)
+	{
+		using std::abs;
+
+		R k = dx/line_length;
+
+		if (abs(k) < 1e-6)
+			return;
+
+		R current;
+		if (k > 0)
+		{
+			current = 1.0 - fractional_part(start);
+		}
+		else
+		{
+			current = fractional_part(start);
+			index_change = -index_change;
+		}
+
+		// -eps to avoid adding last point
+		for (; current < abs(dx) - 1e-6; current = current +1)
+			crossings.push_back( std::pair<R, int>( abs(current/dx) , index_change) );
+	}
 };
\ No newline at end of file
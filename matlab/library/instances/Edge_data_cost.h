@@ -1,18 +1,34 @@
 #pragma once
 
-// Explicitly defined cost for each edge.
+// Explicitly defined cost for each edge, as a volume with one extra
+// dimension indexed by the direction in the connectivity. The costs
+// are read as double or float (single in Matlab), which halves the
+// memory of large 3D problems.
+template<typename Voxel>
 class Edge_data_cost 
 {
 public:
+  typedef Voxel Voxel_type;
+
   Edge_data_cost(
-    const matrix<double>& data,
+    const matrix<Voxel>& data,
     const matrix<int>& connectivity,
     const InstanceSettings& settings
   ) : data(data), connectivity(connectivity)
   {
     dims = data.ndim() -1;
 
-    // Create fast table from (dx,dy,dz) to index in connectivity.
+    // Dense table from (dx,dy,dz) to index in connectivity, which is
+    // read concurrently by the search. Offsets not in the connectivity
+    // have index -1.
+    max_offset = 0;
+    for (int i = 0; i < connectivity.M; i++)
+      for (int d = 0; d < dims; d++)
+        max_offset = std::max(max_offset, std::abs(connectivity(i,d)));
+
+    width = 2*max_offset + 1;
+    lookup.resize(width*width*(dims == 3 ? width : 1), -1);
+
     for (int i = 0; i < connectivity.M; i++)
     {
       int dx,dy,dz;
@@ -24,7 +40,7 @@ public:
       else
         dz = 0;
 
-      lookup[ std::tuple<int, int, int>(dx,dy,dz) ] = i;
+      lookup[offset_index(dx,dy,dz)] = i;
     }
   };
 
@@ -37,22 +53,33 @@ public:
     dy = (int) point2[1] - point1[1];
 
     if (dims == 3)
-    {
       dz = (int) point2[2] - point1[2];
-      int index = lookup[std::tuple<int, int, int>(dx,dy,dz)];
-      return data(point1[0], point1[1], point1[2], index);
-    }
     else
-    {
       dz = 0;
-      int index = lookup[std::tuple<int, int, int>(dx,dy,dz)];
+
+    if (std::abs(dx) > max_offset || std::abs(dy) > max_offset || std::abs(dz) > max_offset)
+      return std::numeric_limits<double>::infinity();
+
+    int index = lookup[offset_index(dx,dy,dz)];
+    if (index < 0)
+      return std::numeric_limits<double>::infinity();
+
+    if (dims == 3)
+      return data(point1[0], point1[1], point1[2], index);
+    else
       return data(point1[0], point1[1], index);
-    }
   }
 
 protected:
-  mutable std::map<std::tuple<int, int, int>, int> lookup;
-  const matrix<double> data;
+  int offset_index(int dx, int dy, int dz) const
+  {
+    return (dx + max_offset) + width*((dy + max_offset) + width*(dims == 3 ? dz + max_offset : 0));
+  }
+
+  std::vector<int> lookup;
+  int max_offset;
+  int width;
+  const matrix<Voxel> data;
   const matrix<int> connectivity;
   unsigned char dims;
 };
\ No newline at end of file
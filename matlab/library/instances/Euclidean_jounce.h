@@ -0,0 +1,63 @@
+#pragma once
+#include <spii/auto_diff_term.h>
+
+// Jounce (fourth derivative) of five consecutive points, estimated with
+// the fourth difference p1 - 4 p2 + 6 p3 - 4 p4 + p5 over the mean edge
+// length h. The cost is |jounce|^power integrated over a length h.
+class Euclidean_jounce
+{
+  public:
+    template<typename Voxel>
+    Euclidean_jounce (
+      const matrix<Voxel>& data, 
+      const InstanceSettings& settings)
+      : dims(settings.voxel_dimensions), 
+        penalty(settings.penalty[3]),
+        power(settings.power[3]),
+        data_dependent(false) 
+  {};
+
+  template<typename R>
+  R operator()(const R* const point1,
+               const R* const point2,
+               const R* const point3,
+               const R* const point4,
+               const R* const point5) const
+  {
+    using std::pow;
+    using std::sqrt;
+
+    if (penalty == 0)
+      return R(0);
+
+    const R* const points[5] = {point1, point2, point3, point4, point5};
+
+    R h = 0;
+    for (int i = 1; i < 5; i++)
+    {
+      R d[3];
+      for (int j = 0; j < 3; j++)
+        d[j] = dims[j]*(points[i][j] - points[i-1][j]);
+
+      h += sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]) / 4.0;
+    }
+
+    R squared_difference = 0;
+    for (int j = 0; j < 3; j++)
+    {
+      R d = dims[j]*(point1[j] - 4.0*point2[j] + 6.0*point3[j] - 4.0*point4[j] + point5[j]);
+      squared_difference += d*d;
+    }
+
+    // Straight and evenly spaced, or degenerate.
+    if (spii::to_double(squared_difference) == 0 || spii::to_double(h) == 0)
+      return R(0);
+
+    return penalty * pow(squared_difference, power / 2.0) / pow(h, 4.0*power - 1.0);
+  }
+
+  const vector<double> dims;
+  double penalty;
+  double power;
+  bool data_dependent;  
+};
\ No newline at end of file
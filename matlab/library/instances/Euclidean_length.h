@@ -2,8 +2,9 @@
 class Euclidean_length
 {
   public:
+    template<typename Voxel>
     Euclidean_length (
-      const matrix<double>& data, 
+      const matrix<Voxel>& data, 
       const InstanceSettings& settings)
       : dims(settings.voxel_dimensions), 
         penalty(settings.penalty[0]),
@@ -3,8 +3,9 @@
 class Euclidean_torsion
 {
   public:
+    template<typename Voxel>
     Euclidean_torsion (
-      const matrix<double>& data, 
+      const matrix<Voxel>& data, 
       const InstanceSettings& settings)
       : dims(settings.voxel_dimensions), 
         penalty(settings.penalty[2]),
@@ -1,7 +1,10 @@
 #pragma once
 #include <assert.h>
+#include <cstdlib>
 #include "Boundary_points.h"
 
+// Length of curves on a surface given either as a height map (2D data)
+// or as the zero level set of a signed distance volume (3D data).
 class Geodesic_length
 {
   public:
@@ -10,8 +13,14 @@ class Geodesic_length
       const InstanceSettings& settings)
       : penalty(settings.penalty[0]),
         data_dependent(true),
-        boundary_points_calculator(data, settings.voxel_dimensions)
-   {}
+        boundary_points_calculator(data, settings.voxel_dimensions),
+        data(data),
+        vd(settings.voxel_dimensions),
+        volume(data.O > 1),
+        stencil_offset(volume ? max_volume_stencil_offset : max_stencil_offset)
+   {
+     create_stencils();
+   }
 
     template<typename R>
     inline R sqr(R x) const
@@ -22,9 +31,9 @@ class Geodesic_length
     template<typename R>
     R operator()(const R* const point1, const R* const point2) const
     {
-      using std::abs;
+      if (volume)
+        return penalty*surface_length(point1, point2);
 
-      // For fixed connectivity relative boundary_points can be cached.
       Boundary_points<R> points = boundary_points_calculator( point1[0],point1[1],
                                                               point2[0],point2[1]);
       R cost = 0;
@@ -35,23 +44,56 @@ class Geodesic_length
         double d11,d10,d01;
         tie(x0,y0,dx,dy, d11,d10,d01) = points.get_pair(i);
 
-        R tolerance = 1e-8;
-        if ( (abs(dx) < tolerance) || (abs(dy) < tolerance) || (abs(d11) < tolerance) )
-        {
-          cost += sqrt(sqr(dx)+sqr(dy)+sqr(dx*d10+dy*d01));
-        } else
+        cost += segment_length(x0,y0, dx,dy, d11,d10,d01);
+      }
+
+      return penalty*cost;
+    }
+
+    // Lines between pixel corners (e.g. the edges of the shortest path
+    // graph) are split into cells the same way for every start, so
+    // only the coefficients of the cells are computed per line.
+    double operator()(const double* const point1, const double* const point2) const
+    {
+      const int D = stencil_offset;
+      const int Dz = volume ? D : 0;
+
+      int x = int(point1[0]);
+      int y = int(point1[1]);
+      int z = int(point1[2]);
+      int dx = int(point2[0]) - x;
+      int dy = int(point2[1]) - y;
+      int dz = int(point2[2]) - z;
+
+      bool on_grid = x == point1[0] && y == point1[1] && z == point1[2] &&
+                     x + dx == point2[0] && y + dy == point2[1] && z + dz == point2[2] &&
+                     std::abs(dx) <= D && std::abs(dy) <= D && std::abs(dz) <= Dz;
+
+      if (!on_grid)
+        return operator()<double>(point1, point2);
+
+      int stencil = (dx + D) + (dy + D)*(2*D + 1) + (dz + Dz)*(2*D + 1)*(2*D + 1);
+      double cost = 0;
+
+      for (int i = first_piece[stencil]; i < first_piece[stencil + 1]; i++)
+      {
+        const Stencil_piece& piece = stencil_pieces[i];
+
+        if (volume)
         {
-          R a = 2*d11*dx*dy;
-          R b = (y0*dx+x0*dy)/(2*dx*dy) + (d10*dx+d01*dy)/a;
-          R c = (sqr(dx)+sqr(dy))/(sqr(a));
-          R f = sqr(b)+c;
-          R g = 1+2*b+f;
+          voxel_corners corners = voxel_corner_values(data, vd, x + piece.cell_x,
+                                                                y + piece.cell_y,
+                                                                z + piece.cell_z);
 
-          R p1 = abs(a)/2;
-          R p2 = c*(log ( abs( (b+1+sqrt(g))/(b+sqrt(f)) ) ) );
-          R p3 = (b+1)*sqrt(g)-b*sqrt(f);
+          cost += surface_segment_length(piece.x0,piece.y0,piece.z0,
+                                         piece.dx,piece.dy,piece.dz, corners);
+        }
+        else
+        {
+          double d11,d10,d01;
+          tie(d11,d10,d01) = cell_coefficents(data, vd, x + piece.cell_x, y + piece.cell_y);
 
-          cost += p1*(p2+p3);
+          cost += segment_length(piece.x0,piece.y0, piece.dx,piece.dy, d11,d10,d01);
         }
       }
 
@@ -61,4 +103,227 @@ class Geodesic_length
   double penalty;
   bool data_dependent;
   Boundary_points_calculator boundary_points_calculator;
+
+protected:
+  // Length on the height map of the line from (x0, y0) to
+  // (x0 + dx, y0 + dy) within a cell with coefficients d11, d10, d01.
+  template<typename R>
+  R segment_length(R x0, R y0, R dx, R dy, double d11, double d10, double d01) const
+  {
+    using std::abs;
+
+    R tolerance = 1e-8;
+    if ( (abs(dx) < tolerance) || (abs(dy) < tolerance) || (abs(d11) < tolerance) )
+    {
+      return sqrt(sqr(dx)+sqr(dy)+sqr(dx*d10+dy*d01));
+    } else
+    {
+      R a = 2*d11*dx*dy;
+      R b = (y0*dx+x0*dy)/(2*dx*dy) + (d10*dx+d01*dy)/a;
+      R c = (sqr(dx)+sqr(dy))/(sqr(a));
+      R f = sqr(b)+c;
+      R g = 1+2*b+f;
+
+      R p1 = abs(a)/2;
+      R p2 = c*(log ( abs( (b+1+sqrt(g))/(b+sqrt(f)) ) ) );
+      R p3 = (b+1)*sqrt(g)-b*sqrt(f);
+
+      return p1*(p2+p3);
+    }
+  }
+
+  // Length of the line from point1 to point2 projected onto the zero
+  // level set of the volume, split into voxels.
+  template<typename R>
+  R surface_length(const R* const point1, const R* const point2) const
+  {
+    const int stride = data.M;
+    const int slice = data.M*data.N;
+
+    Line_points<R> points;
+    points.add(point1[0], point1[1], point1[2], 0);
+    boundary_points_calculator.add_points_along_a_line_segment(point1[0], point1[1], point1[2],
+                                                               point2[0], point2[1], point2[2],
+                                                               points, stride, slice);
+
+    R length = 0;
+    for (int i = 1; i < points.x.size(); i++)
+    {
+      int z_int = points.linear_indices[i]/slice;
+      int y_int = (points.linear_indices[i] - z_int*slice)/stride;
+      int x_int = points.linear_indices[i] - z_int*slice - y_int*stride;
+
+      voxel_corners corners = voxel_corner_values(data, vd, x_int, y_int, z_int);
+      length += surface_segment_length(points.x[i-1] - x_int, points.y[i-1] - y_int, points.z[i-1] - z_int,
+                                       points.x[i] - points.x[i-1],
+                                       points.y[i] - points.y[i-1],
+                                       points.z[i] - points.z[i-1], corners);
+    }
+
+    return length;
+  }
+
+  // Length of the closest point projection p - phi(p)*g/|g|^2 onto the
+  // zero level set, with phi and its gradient g interpolated from the
+  // voxel corners, of the line from (x0, y0, z0) to
+  // (x0 + dx, y0 + dy, z0 + dz). The coordinates are in voxels relative
+  // to the voxel corner and phi is in the units of the voxel dimensions.
+  // There is no closed form as for height maps, so the projected line is
+  // approximated by a polyline.
+  template<typename R>
+  R surface_segment_length(R x0, R y0, R z0, R dx, R dy, R dz,
+                           const voxel_corners& corners) const
+  {
+    using std::sqrt;
+
+    R length = 0;
+    R previous[3] = {0, 0, 0};
+    for (int j = 0; j <= surface_samples; j++)
+    {
+      double t = double(j)/surface_samples;
+      R x = x0 + t*dx;
+      R y = y0 + t*dy;
+      R z = z0 + t*dz;
+
+      R phi = 0;
+      R g[3] = {0, 0, 0};
+      for (int corner = 0; corner < 8; corner++)
+      {
+        R w = ((corner & 1) ? x : 1.0 - x)*
+              (((corner >> 1) & 1) ? y : 1.0 - y)*
+              (((corner >> 2) & 1) ? z : 1.0 - z);
+
+        phi = phi + w*corners.value[corner];
+        for (int i = 0; i < 3; i++)
+          g[i] = g[i] + w*corners.gradient[corner][i];
+      }
+
+      R gg = g[0]*g[0] + g[1]*g[1] + g[2]*g[2];
+
+      R projection[3] = {x*vd[0], y*vd[1], z*vd[2]};
+      if (spii::to_double(gg) > 1e-12)
+      {
+        for (int i = 0; i < 3; i++)
+          projection[i] = projection[i] - phi*g[i]/gg;
+      }
+
+      if (j > 0)
+        length += sqrt(sqr(projection[0] - previous[0]) +
+                       sqr(projection[1] - previous[1]) +
+                       sqr(projection[2] - previous[2]));
+
+      for (int i = 0; i < 3; i++)
+        previous[i] = projection[i];
+    }
+
+    return length;
+  }
+
+  // Records the points of a line segment, see
+  // Boundary_points_calculator::add_points_along_a_line_segment.
+  template<typename R>
+  struct Line_points
+  {
+    void add(R _x, R _y, int linear_index)
+    {
+      add(_x, _y, R(0), linear_index);
+    }
+
+    void add(R _x, R _y, R _z, int linear_index)
+    {
+      x.push_back(_x);
+      y.push_back(_y);
+      z.push_back(_z);
+      linear_indices.push_back(linear_index);
+    }
+
+    std::vector<R> x, y, z;
+    std::vector<int> linear_indices;
+  };
+
+  // Splits the lines from a pixel corner to all corners within
+  // stencil_offset into cells, as get_pair does. The lines start at the
+  // corner (D + 1, D + 1, D + 1) of an image wide enough for the linear
+  // indices of the cells to be decoded. Height maps only have dz = 0.
+  void create_stencils()
+  {
+    const int D = stencil_offset;
+    const int Dz = volume ? D : 0;
+    const int origin = D + 1;
+    const int z_origin = volume ? origin : 0;
+    const int stride = 2*D + 3;
+    const int slice = stride*stride;
+
+    first_piece.push_back(0);
+    for (int dz = -Dz; dz <= Dz; dz++)
+    {
+      for (int dy = -D; dy <= D; dy++)
+      {
+        for (int dx = -D; dx <= D; dx++)
+        {
+          Line_points<double> points;
+          points.add(origin, origin, z_origin, 0);
+          if (volume)
+            boundary_points_calculator.add_points_along_a_line_segment(double(origin), double(origin), double(origin),
+                                                                       double(origin + dx), double(origin + dy), double(origin + dz),
+                                                                       points, stride, slice);
+          else
+            boundary_points_calculator.add_points_along_a_line_segment(double(origin), double(origin),
+                                                                       double(origin + dx), double(origin + dy),
+                                                                       points, stride);
+
+          for (int i = 1; i < points.x.size(); i++)
+          {
+            int z_int = volume ? points.linear_indices[i]/slice : 0;
+            int y_int = (points.linear_indices[i] - z_int*slice)/stride;
+            int x_int = points.linear_indices[i] - z_int*slice - y_int*stride;
+
+            // Pieces on height maps are in the units of the voxel
+            // dimensions (see segment_length) and in volumes in voxels
+            // (see surface_segment_length).
+            double sx = volume ? 1.0 : vd[0];
+            double sy = volume ? 1.0 : vd[1];
+
+            Stencil_piece piece;
+            piece.cell_x = x_int - origin;
+            piece.cell_y = y_int - origin;
+            piece.cell_z = z_int - z_origin;
+            piece.x0 = (points.x[i-1] - x_int)*sx;
+            piece.y0 = (points.y[i-1] - y_int)*sy;
+            piece.z0 = points.z[i-1] - z_int;
+            piece.dx = (points.x[i] - points.x[i-1])*sx;
+            piece.dy = (points.y[i] - points.y[i-1])*sy;
+            piece.dz = points.z[i] - points.z[i-1];
+            stencil_pieces.push_back(piece);
+          }
+
+          first_piece.push_back(stencil_pieces.size());
+        }
+      }
+    }
+  }
+
+  // Part of a line within one cell, with the cell relative to the
+  // start of the line and the rest as returned by get_pair.
+  struct Stencil_piece
+  {
+    int cell_x, cell_y, cell_z;
+    double x0, y0, z0, dx, dy, dz;
+  };
+
+  static const int max_stencil_offset = 8;
+  static const int max_volume_stencil_offset = 4;
+  // Number of line pieces per voxel in surface_segment_length.
+  static const int surface_samples = 4;
+
+  const matrix<double> data;
+  const vector<double> vd;
+  const bool volume;
+  const int stencil_offset;
+
+  // The pieces of the line with offset (dx, dy, dz) are
+  // first_piece[s] ... first_piece[s + 1] - 1, where
+  // s = (dx + D) + (dy + D)*(2*D + 1) + (dz + Dz)*(2*D + 1)^2.
+  std::vector<Stencil_piece> stencil_pieces;
+  std::vector<int> first_piece;
 };
\ No newline at end of file
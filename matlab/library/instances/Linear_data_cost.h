@@ -1,13 +1,46 @@
 #pragma once
 
+// Edges along the connectivity are integrated with precomputed
+// stencils, other lines (e.g. in local optimization) directly.
+std::vector<int> connectivity_offsets(const matrix<int>& connectivity)
+{
+  std::vector<int> offsets;
+
+  for (int k = 0; k < connectivity.M; k++)
+    for (int d = 0; d < 3; d++)
+      offsets.push_back(connectivity(k,d));
+
+  return offsets;
+}
+
+VolumeLayout volume_layout(int M, int N, int O, const InstanceSettings& settings)
+{
+  if (settings.brick_size > 0)
+    return VolumeLayout::bricked(M, N, O, settings.brick_size);
+  else
+    return VolumeLayout(M, N, O);
+}
+
+// Reads volumes of type Voxel (double, float, unsigned short or
+// unsigned char) without conversion. With settings.brick_size the
+// volume is copied into bricks, which are shared between copies of
+// the data cost.
+template<typename Voxel>
 class Linear_data_cost
 {
   public: 
+    typedef Voxel Voxel_type;
+
     Linear_data_cost(
-          const matrix<double>& data, 
+          const matrix<Voxel>& data, 
           const matrix<int>& connectivity,
           const InstanceSettings& settings) :
-          data_term(data.data, data.M, data.N, data.O, settings.voxel_dimensions)
+          layout(volume_layout(data.M, data.N, data.O, settings)),
+          bricks(layout.is_column_major() ? nullptr :
+                 std::make_shared<const std::vector<Voxel>>(layout.reorder(data.data))),
+          data_term(bricks ? bricks->data() : data.data, layout, settings.voxel_dimensions,
+                    connectivity_offsets(connectivity),
+                    settings.data_scale, settings.data_offset)
   {};
 
   template<typename R>
@@ -17,6 +50,18 @@ class Linear_data_cost
                                             point2[0],point2[1],point2[2]);
   }
 
+  // The cost with its gradient and Hessian (6 x 6, may be null) with
+  // respect to both points.
+  double evaluate(const double* point1, const double* point2,
+                  double* gradient, double* hessian) const
+  {
+    return data_term.evaluate_line_integral(point1[0],point1[1],point1[2],
+                                            point2[0],point2[1],point2[2],
+                                            gradient, hessian);
+  }
+
 protected:
-  const PieceWiseConstant data_term;
+  const VolumeLayout layout;
+  const std::shared_ptr<const std::vector<Voxel>> bricks;
+  const BasicStencilLineIntegral<Voxel> data_term;
 };
\ No newline at end of file
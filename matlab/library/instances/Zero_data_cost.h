@@ -3,6 +3,8 @@
 class Zero_data_cost
 {
 public:
+  typedef double Voxel_type;
+
   Zero_data_cost(
     const matrix<double>& data,
     const matrix<int>& connectivity,
@@ -15,4 +17,14 @@ public:
   {
     return R(0);
   }
+
+  double evaluate(const double* point1, const double* point2,
+                  double* gradient, double* hessian) const
+  {
+    std::fill(gradient, gradient + 6, 0.0);
+    if (hessian)
+      std::fill(hessian, hessian + 36, 0.0);
+
+    return 0;
+  }
 };
\ No newline at end of file
@@ -3,8 +3,9 @@
 class Zero_pair
 {
   public:
+    template<typename Voxel>
     Zero_pair (
-      const matrix<double>& data, 
+      const matrix<Voxel>& data, 
       const InstanceSettings& settings)
       : data_dependent(false)
    {};
@@ -3,8 +3,9 @@
 class Zero_pentuple
 {
   public:
+    template<typename Voxel>
     Zero_pentuple (
-      const matrix<double>& data, 
+      const matrix<Voxel>& data, 
       const InstanceSettings& settings) :  
         data_dependent(false)
       {};
@@ -3,8 +3,9 @@
 class Zero_quad
 {
   public:
+    template<typename Voxel>
     Zero_quad (
-      const matrix<double>& data, 
+      const matrix<Voxel>& data, 
       const InstanceSettings& settings)
       :  data_dependent(false) {};
 
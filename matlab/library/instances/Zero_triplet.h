@@ -3,8 +3,9 @@
 class Zero_triplet
 {
   public:
+    template<typename Voxel>
     Zero_triplet (
-      const matrix<double>& data, 
+      const matrix<Voxel>& data, 
       const InstanceSettings& settings) :
     data_dependent(false)
   {};
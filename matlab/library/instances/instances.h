@@ -5,6 +5,7 @@
 #include "Euclidean_length.h"
 #include "Euclidean_curvature.h"
 #include "Euclidean_torsion.h"
+#include "Euclidean_jounce.h"
 
 #include "Geodesic_length.h"
 
@@ -1,8 +1,39 @@
 #pragma once
 
-template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost>
+template<typename Data_cost, typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Pentuple_cost>
 void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
 
+// Linear interpolation of the voxel type of the data volume, so that
+// single, uint8 and uint16 volumes (or files) are used without conversion.
+template<typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Pentuple_cost>
+void linear_interpolation_main(const mxArray* data, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  switch (data_class(data))
+  {
+    case mxSINGLE_CLASS:
+      main_function< Linear_data_cost<float>, Pair_cost, Triplet_cost, Quad_cost, Pentuple_cost>(nlhs, plhs, nrhs, prhs);
+      break;
+    case mxUINT16_CLASS:
+      main_function< Linear_data_cost<unsigned short>, Pair_cost, Triplet_cost, Quad_cost, Pentuple_cost>(nlhs, plhs, nrhs, prhs);
+      break;
+    case mxUINT8_CLASS:
+      main_function< Linear_data_cost<unsigned char>, Pair_cost, Triplet_cost, Quad_cost, Pentuple_cost>(nlhs, plhs, nrhs, prhs);
+      break;
+    default:
+      main_function< Linear_data_cost<double>, Pair_cost, Triplet_cost, Quad_cost, Pentuple_cost>(nlhs, plhs, nrhs, prhs);
+  }
+}
+
+// Edge costs stored as single are used without conversion.
+template<typename Pair_cost, typename Triplet_cost, typename Quad_cost, typename Pentuple_cost>
+void edge_main(const mxArray* data, int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  if (data_class(data) == mxSINGLE_CLASS)
+    main_function< Edge_data_cost<float>, Pair_cost, Triplet_cost, Quad_cost, Pentuple_cost>(nlhs, plhs, nrhs, prhs);
+  else
+    main_function< Edge_data_cost<double>, Pair_cost, Triplet_cost, Quad_cost, Pentuple_cost>(nlhs, plhs, nrhs, prhs);
+}
+
 void mexFunction(int            nlhs,     /* number of expected outputs */
                  mxArray        *plhs[],  /* mxArray output pointer array */
                  int            nrhs,     /* number of inputs */
@@ -13,11 +44,11 @@ void mexFunction(int            nlhs,     /* number of expected outputs */
    throw runtime_error("First argument must be a string.");
 
   if (!strcmp(problem_type,"linear_interpolation"))
-    main_function< Linear_data_cost, Euclidean_length, Euclidean_curvature, Euclidean_torsion>(nlhs, plhs, nrhs, prhs);
+    linear_interpolation_main< Euclidean_length, Euclidean_curvature, Euclidean_torsion, Euclidean_jounce>(prhs[data_argument], nlhs, plhs, nrhs, prhs);
   else if (!strcmp(problem_type,"edge"))
-    main_function< Edge_data_cost, Euclidean_length, Euclidean_curvature, Euclidean_torsion>(nlhs, plhs, nrhs, prhs); 
+    edge_main< Euclidean_length, Euclidean_curvature, Euclidean_torsion, Euclidean_jounce>(prhs[data_argument], nlhs, plhs, nrhs, prhs);
   else if (!strcmp(problem_type,"geodesic"))
-    main_function< Zero_data_cost, Geodesic_length, Zero_triplet, Zero_quad>(nlhs, plhs, nrhs, prhs);
+    main_function< Zero_data_cost, Geodesic_length, Zero_triplet, Zero_quad, Zero_pentuple>(nlhs, plhs, nrhs, prhs);
   else
     throw runtime_error("Unknown data type");
 }
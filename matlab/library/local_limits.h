@@ -0,0 +1,203 @@
+#pragma once
+#include "connectivity_symmetry.h"
+
+// Local limits are hard constraints on every part of the curve:
+// local_limit[0] bounds the length of each edge, local_limit[1] the
+// curvature of each pair of edges, local_limit[2] the torsion
+// of each triple of edges and local_limit[3] the jounce of each
+// quadruple of edges.
+//
+// The quantities are measured by the cost functions with unit penalty,
+// as in curve_info_mex. Data dependent functions differ between voxels
+// and can not be tabulated, so they are not limited. The tables are
+// evaluated once per orbit of the connectivity symmetries.
+
+// Settings with every penalty set to one.
+InstanceSettings unit_penalty_settings(const InstanceSettings& settings)
+{
+  InstanceSettings unit_settings = settings;
+
+  for (double& penalty : unit_settings.penalty)
+    penalty = 1;
+
+  return unit_settings;
+}
+
+// Entry k is 1 if direction k satisfies the length limit.
+template<typename Pair_cost, typename Voxel>
+std::vector<char> length_limit_table(const matrix<Voxel>& data,
+                                     const matrix<int>& connectivity,
+                                     const InstanceSettings& settings)
+{
+  const int K = connectivity.M;
+  std::vector<char> table(K, 1);
+
+  if (settings.length_local_limit == std::numeric_limits<double>::infinity())
+    return table;
+
+  Pair_cost length(data, unit_penalty_settings(settings));
+  if (length.data_dependent)
+    return table;
+
+  Delta_point delta_point(connectivity);
+  Point p1(0,0,0);
+
+  for (int k = 0; k < K; k++)
+  {
+    Point p2 = delta_point(p1,k);
+    table[k] = length(p1.xyz, p2.xyz) <= settings.length_local_limit;
+  }
+
+  return table;
+}
+
+// Entry e1*K + e2 is 1 if the edge pair (e1,e2) satisfies the curvature limit.
+template<typename Triplet_cost, typename Voxel>
+std::vector<char> curvature_limit_table(const matrix<Voxel>& data,
+                                        const matrix<int>& connectivity,
+                                        const InstanceSettings& settings)
+{
+  const int K = connectivity.M;
+  std::vector<char> table(K*K, 1);
+
+  if (settings.curvature_local_limit == std::numeric_limits<double>::infinity())
+    return table;
+
+  Triplet_cost curvature(data, unit_penalty_settings(settings));
+  if (curvature.data_dependent)
+    return table;
+
+  Delta_point delta_point(connectivity);
+  Connectivity_symmetry symmetry(connectivity, settings.voxel_dimensions);
+  Point p1(0,0,0);
+
+  fill_symmetric_table(table, symmetry.canonical_tuples(2, true),
+    [&](int n) -> char
+    {
+      Point p2 = delta_point(p1, n / K);
+      Point p3 = delta_point(p2, n % K);
+      return curvature(p1.xyz, p2.xyz, p3.xyz) <= settings.curvature_local_limit;
+    });
+
+  return table;
+}
+
+// Entry (e1*K + e2)*K + e3 is 1 if the edge triple (e1,e2,e3)
+// satisfies the torsion limit.
+template<typename Quad_cost, typename Voxel>
+std::vector<char> torsion_limit_table(const matrix<Voxel>& data,
+                                      const matrix<int>& connectivity,
+                                      const InstanceSettings& settings)
+{
+  const int K = connectivity.M;
+  std::vector<char> table(K*K*K, 1);
+
+  if (settings.torsion_local_limit == std::numeric_limits<double>::infinity())
+    return table;
+
+  Quad_cost torsion(data, unit_penalty_settings(settings));
+  if (torsion.data_dependent)
+    return table;
+
+  Delta_point delta_point(connectivity);
+  Connectivity_symmetry symmetry(connectivity, settings.voxel_dimensions);
+  Point p1(0,0,0);
+
+  fill_symmetric_table(table, symmetry.canonical_tuples(3, true),
+    [&](int n) -> char
+    {
+      Point p2 = delta_point(p1, n / (K*K));
+      Point p3 = delta_point(p2, (n / K) % K);
+      Point p4 = delta_point(p3, n % K);
+      return torsion(p1.xyz, p2.xyz, p3.xyz, p4.xyz) <= settings.torsion_local_limit;
+    });
+
+  return table;
+}
+
+// Entry ((e1*K + e2)*K + e3)*K + e4 is 1 if the edge quadruple
+// (e1,e2,e3,e4) satisfies the jounce limit.
+template<typename Pentuple_cost, typename Voxel>
+std::vector<char> jounce_limit_table(const matrix<Voxel>& data,
+                                     const matrix<int>& connectivity,
+                                     const InstanceSettings& settings)
+{
+  const int K = connectivity.M;
+  std::vector<char> table(K*K*K*K, 1);
+
+  if (settings.jounce_local_limit == std::numeric_limits<double>::infinity())
+    return table;
+
+  Pentuple_cost jounce(data, unit_penalty_settings(settings));
+  if (jounce.data_dependent)
+    return table;
+
+  Delta_point delta_point(connectivity);
+  Connectivity_symmetry symmetry(connectivity, settings.voxel_dimensions);
+  Point p1(0,0,0);
+
+  fill_symmetric_table(table, symmetry.canonical_tuples(4, true),
+    [&](int n) -> char
+    {
+      Point p2 = delta_point(p1, n / (K*K*K));
+      Point p3 = delta_point(p2, (n / (K*K)) % K);
+      Point p4 = delta_point(p3, (n / K) % K);
+      Point p5 = delta_point(p4, n % K);
+      return jounce(p1.xyz, p2.xyz, p3.xyz, p4.xyz, p5.xyz) <= settings.jounce_local_limit;
+    });
+
+  return table;
+}
+
+// Compact lists of the directions which may follow each state of a
+// line graph (a direction in the node graph, an edge in the edge graph,
+// an edge pair in the edge pair graph, an edge triple in the edge
+// triple graph). The engines only iterate over
+// these, so transitions removed by the local limits are never evaluated.
+class Successor_table
+{
+public:
+  // feasible(s, k) decides whether direction k may follow state s.
+  template<typename Feasible>
+  Successor_table(int num_states, int num_directions, Feasible feasible)
+    : offsets(num_states + 1, 0)
+  {
+    for (int s = 0; s < num_states; s++)
+    {
+      for (int k = 0; k < num_directions; k++)
+      {
+        if (feasible(s,k))
+          directions.push_back(k);
+      }
+
+      offsets[s+1] = directions.size();
+    }
+
+    num_removed = std::size_t(num_states)*num_directions - directions.size();
+  }
+
+  int size(int state) const
+  {
+    return offsets[state+1] - offsets[state];
+  }
+
+  const int* begin(int state) const
+  {
+    return directions.data() + offsets[state];
+  }
+
+  const int* end(int state) const
+  {
+    return directions.data() + offsets[state+1];
+  }
+
+  std::size_t removed() const
+  {
+    return num_removed;
+  }
+
+protected:
+  std::vector<int> offsets;
+  std::vector<int> directions;
+  std::size_t num_removed;
+};
@@ -10,6 +10,7 @@
 #include <limits>
 
 #include <spii/auto_diff_term.h>
+#include <spii/term.h>
 #include <spii/transformations.h>
 #include <spii/solver.h>
 
@@ -23,6 +24,70 @@ void mex_log_function(const std::string& str)
 	mexPrintf("%s\n", str.c_str());
 }
 
+// Position of the data volume among the arguments.
+const int data_argument = 1;
+
+// The data cost between two points, differentiated by the data cost
+// itself. Automatic differentiation of the line integrals carries
+// dense derivative arrays through the voxel traversal and is several
+// times slower.
+template<typename Data_cost>
+class Data_cost_term : public Term
+{
+public:
+	Data_cost_term(const matrix<typename Data_cost::Voxel_type>& data,
+	               const matrix<int>& connectivity,
+	               const InstanceSettings& settings)
+		: data_cost(data, connectivity, settings)
+	{ }
+
+	int number_of_variables() const override
+	{
+		return 2;
+	}
+
+	int variable_dimension(int var) const override
+	{
+		return 3;
+	}
+
+	double evaluate(double * const * const variables) const override
+	{
+		return data_cost(variables[0], variables[1]);
+	}
+
+	double evaluate(double * const * const variables,
+	                std::vector<Eigen::VectorXd>* gradient) const override
+	{
+		double g[6];
+		double value = data_cost.evaluate(variables[0], variables[1], g, nullptr);
+		for (int i = 0; i < 6; ++i)
+			(*gradient)[i / 3](i % 3) = g[i];
+
+		return value;
+	}
+
+	double evaluate(double * const * const variables,
+	                std::vector<Eigen::VectorXd>* gradient,
+	                std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		double g[6];
+		double H[36];
+		double value = data_cost.evaluate(variables[0], variables[1], g, H);
+		for (int i = 0; i < 6; ++i)
+		{
+			(*gradient)[i / 3](i % 3) = g[i];
+			for (int j = 0; j < 6; ++j)
+				(*hessian)[i / 3][j / 3](i % 3, j % 3) = H[6*i + j];
+		}
+
+		return value;
+	}
+
+private:
+	const Data_cost data_cost;
+};
+
 // Calls main_function
 #include "instances/mex_wrapper_local_optimization.h"
 
@@ -36,7 +101,8 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 	ASSERT(nlhs == 4)
 
 	int curarg = 1;
-	const matrix<double> data_matrix(prhs[curarg++]);
+	const matrix<typename Data_cost::Voxel_type> data_matrix =
+		data_volume<typename Data_cost::Voxel_type>(prhs[curarg++]);
 	const matrix<double> input_path(prhs[curarg++]);
 	const matrix<int> connectivity(prhs[curarg++]);
 
@@ -103,8 +169,8 @@ void main_function(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 	f.set_constant(points[n-1].xyz, true);
 
 	// Adding data cost
-	 auto data = std::make_shared<AutoDiffTerm<Data_cost, 3, 3>>
-	 			(data_matrix, connectivity, settings);
+	auto data = std::make_shared<Data_cost_term<Data_cost>>
+				(data_matrix, connectivity, settings);
 
 	for (int i = 1; i < n; ++i)
 		f.add_term(data, points[i-1].xyz, points[i].xyz);
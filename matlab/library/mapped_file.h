@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdio>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. The file is memory mapped where
+// possible, so large files are available immediately and only the
+// pages that are used are read. Elsewhere it is read into memory.
+class Mapped_file
+{
+public:
+  Mapped_file() : bytes(nullptr), num_bytes(0) { }
+
+  ~Mapped_file()
+  {
+    close();
+  }
+
+  // Returns false if the file could not be opened.
+  bool open(const string& file_name)
+  {
+    close();
+
+#ifndef _WIN32
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+      ::close(fd);
+      return false;
+    }
+
+    void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+      return false;
+
+    bytes = static_cast<const char*>(mapping);
+    num_bytes = info.st_size;
+    return true;
+#else
+    FILE* file = std::fopen(file_name.c_str(), "rb");
+    if (!file)
+      return false;
+
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+
+    if (size > 0)
+    {
+      buffer.resize(size);
+      if (std::fread(buffer.data(), 1, size, file) != std::size_t(size))
+        buffer.clear();
+    }
+    std::fclose(file);
+
+    bytes = buffer.data();
+    num_bytes = buffer.size();
+    return num_bytes > 0;
+#endif
+  }
+
+  void close()
+  {
+#ifndef _WIN32
+    if (bytes)
+      munmap(const_cast<char*>(bytes), num_bytes);
+#endif
+    buffer.clear();
+    bytes = nullptr;
+    num_bytes = 0;
+  }
+
+  const char* data() const
+  {
+    return bytes;
+  }
+
+  std::size_t size() const
+  {
+    return num_bytes;
+  }
+
+private:
+  Mapped_file(const Mapped_file&);
+  Mapped_file& operator=(const Mapped_file&);
+
+  const char* bytes;
+  std::size_t num_bytes;
+  std::vector<char> buffer;
+};
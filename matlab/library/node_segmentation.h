@@ -1,9 +1,17 @@
 #include "curve_segmentation.h"
+#include "edge_cost_cache.h"
+#include "local_limits.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
 
 // Main nodes (start and end set flipped to accommodate for A*)
-template<typename Data_cost, typename Pair_cost>
-void node_segmentation( const matrix<double>& data,
+template<typename Data_cost, typename Pair_cost, typename Voxel>
+void node_segmentation( const matrix<Voxel>& data,
                         const matrix<unsigned char>& mesh_map,
+                        const GridGeometry& grid,
                         const matrix<int>& connectivity,
                         InstanceSettings& settings,
                         ShortestPathOptions& options,
@@ -29,7 +37,7 @@ void node_segmentation( const matrix<double>& data,
    // Pre-calculate regularization cost for every connectivity
   if (cacheable) 
   {
-    Point p1 = make_point(0);
+    Point p1(0,0,0);
 
     for (int k = 0; k < delta_point.size(); k++)
     {
@@ -42,48 +50,83 @@ void node_segmentation( const matrix<double>& data,
     }
   }
 
+  // Data dependent pair costs are memoized per edge instead.
+  Edge_cost_cache<Pair_cost> pair_memo(pair_cost, connectivity, grid,
+    memoize_pair_cost(pair_cost, connectivity, grid, settings));
+
+  if (settings.verbose)
+    pair_memo.count_lookups();
+
+  std::shared_ptr<const Edge_cost_tensor> edge_costs =
+    precomputed_edge_costs(data_cost, data, connectivity, grid, settings);
+
+  Disallowed_edges disallowed(mesh_map, connectivity, grid);
+
+  // Directions satisfying the length limit.
+  std::vector<char> length_ok =
+    length_limit_table<Pair_cost>(data, connectivity, settings);
+
+  Successor_table successors(1, delta_point.size(),
+    [&length_ok](int, int k) { return length_ok[k] != 0; });
+
+  if (settings.verbose && successors.removed() > 0)
+    mexPrintf("Local limits removed %d directions.\n", int(successors.removed()));
+
+  const int* directions = successors.begin(0);
+  int num_directions = successors.size(0);
+
   int evaluations = 0;
   auto get_neighbors =
-    [&evaluations, &data_cost, 
+    [&evaluations, &data_cost, &edge_costs,
       &regularization_cache, &cacheable, 
-      &pair_cost, &delta_point, &reverse_direction]
+      &pair_memo, &delta_point, &reverse_direction,
+      &directions, &num_directions, &disallowed, &grid]
     (int n, std::vector<Neighbor>* neighbors) -> void
   {
     evaluations++;
-    Point p1 = make_point(n);
+    Point p1 = grid.make_point(n);
 
-    neighbors->resize(delta_point.size());
+    neighbors->resize(num_directions);
 
     #ifdef USE_OPENMP
     #pragma omp parallel for
     #endif
-    for (int k = 0; k < delta_point.size(); k++)
+    for (int i = 0; i < num_directions; i++)
     {
+      int k = directions[i];
       Point p2 = delta_point(p1,k);
       int dest;
       double cost;
 
-      if (valid_point(p2))
+      // The edge goes from n to p2, or from p2 to n when reversed.
+      if (grid.valid_point(p2) &&
+          !disallowed(reverse_direction ? grid.point2ind(p2) : n, k))
       {
-        dest = point2ind(p2);
+        dest = grid.point2ind(p2);
 
         if (!reverse_direction)
         {
-          cost = data_cost(p1.xyz, p2.xyz);
+          if (edge_costs)
+            cost = (*edge_costs)(n, k);
+          else
+            cost = data_cost(p1.xyz, p2.xyz);
         
           if (cacheable)
             cost += regularization_cache[k];
           else
-            cost += pair_cost(p1.xyz,p2.xyz);
+            cost += pair_memo(n, k, p1, p2);
         }
         else
         {
-          cost = data_cost(p2.xyz, p1.xyz);
+          if (edge_costs)
+            cost = (*edge_costs)(dest, k);
+          else
+            cost = data_cost(p2.xyz, p1.xyz);
 
           if (cacheable)
             cost += regularization_cache[k];
           else
-            cost += pair_cost(p2.xyz,p1.xyz);
+            cost += pair_memo(dest, k, p2, p1);
 
         } 
       } 
@@ -92,7 +135,7 @@ void node_segmentation( const matrix<double>& data,
         dest = 0;
       }
 
-      (*neighbors)[k] = Neighbor(dest, cost);
+      (*neighbors)[i] = Neighbor(dest, cost);
     }
   };
 
@@ -153,7 +196,7 @@ void node_segmentation( const matrix<double>& data,
 
   // Convert from inds to points
   for (auto id : path_nodes)
-    output.points.push_back( make_point(id) );
+    output.points.push_back( grid.make_point(id) );
 
   output.evaluations = evaluations;
 
@@ -164,6 +207,10 @@ void node_segmentation( const matrix<double>& data,
     mexPrintf("Evaluations: %d, ", output.evaluations);
     mexPrintf("Path length: %d, ", path_nodes.size() );
     mexPrintf("Cost:    %g. \n", output.cost);
+
+    if (pair_memo.misses() > 0)
+      mexPrintf("Pair cost cache hits: %d, misses: %d. \n",
+                int(pair_memo.hits()), int(pair_memo.misses()));
   }
 
   if (settings.store_distances)
@@ -183,4 +230,197 @@ void node_segmentation( const matrix<double>& data,
     for (int i = 0; i < output.shortest_path_tree.numel(); i++)
       output.shortest_path_tree(i) = options.parents[i];
   }  
-}
\ No newline at end of file
+}
+
+// The node graph distances to the end set are the A* lower bound of the
+// edge and edge pair graphs. Computing them is a full Dijkstra, so they
+// are kept between calls to the mex file, e.g. the supergradient
+// iterations which solve the same problem with different penalties.
+struct Node_heuristic
+{
+  // Hash of everything except the length penalty that the
+  // distances depend on.
+  uint64_t key;
+  double length_penalty;
+  std::vector<float> distance;
+};
+
+// The most recent heuristic. Entries are never modified after they are
+// shared, so solves running in other threads may keep using theirs.
+std::shared_ptr<const Node_heuristic> node_heuristic_cache;
+std::mutex node_heuristic_mutex;
+
+// Smallest l2/l1 for which the cached distances are reused.
+const double min_node_heuristic_scale = 0.5;
+
+// Lower bound on the distance from a node to the end set.
+//
+// With nonnegative data costs, distances computed with length
+// penalty l1 times min(1, l2/l1) are a lower bound for penalty l2.
+// The cached distances are therefore reused, rescaled, when only
+// the length penalty has changed. A much smaller scale would leave
+// little of the bound, so the distances are then recomputed.
+struct Node_lower_bound
+{
+  double operator()(int node) const
+  {
+    return scale*heuristic->distance[node];
+  }
+
+  std::shared_ptr<const Node_heuristic> heuristic;
+  double scale;
+};
+
+template<typename Voxel>
+uint64_t node_heuristic_key(const matrix<Voxel>& data,
+                            const matrix<unsigned char>& mesh_map,
+                            const GridGeometry& grid,
+                            const matrix<int>& connectivity,
+                            const InstanceSettings& settings)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  int dims[3] = {grid.M, grid.N, grid.O};
+
+  // The whole mesh map, since the distances also depend on the
+  // disallowed voxels, which the data does not always mark.
+  hash = hash_bytes(hash, dims, sizeof(dims));
+  hash = hash_data(hash, data, settings);
+  hash = hash_bytes(hash, mesh_map.data, mesh_map.numel());
+  hash = hash_bytes(hash, connectivity.data, connectivity.numel()*sizeof(int));
+  hash = hash_bytes(hash, settings.data_type_str.data(), settings.data_type_str.size());
+  hash = hash_bytes(hash, settings.voxel_dimensions.data(),
+                    settings.voxel_dimensions.size()*sizeof(double));
+  hash = hash_bytes(hash, &settings.length_local_limit, sizeof(double));
+
+  return hash;
+}
+
+// Returns null if the file is missing or holds another problem.
+std::shared_ptr<const Node_heuristic> load_node_heuristic(const string& file_name, uint64_t key)
+{
+  std::ifstream fin(file_name, std::ios::binary);
+  if (!fin)
+    return nullptr;
+
+  std::shared_ptr<Node_heuristic> heuristic(new Node_heuristic);
+  uint64_t size;
+  fin.read(reinterpret_cast<char*>(&heuristic->key), sizeof(uint64_t));
+  fin.read(reinterpret_cast<char*>(&heuristic->length_penalty), sizeof(double));
+  fin.read(reinterpret_cast<char*>(&size), sizeof(size));
+
+  if (!fin || heuristic->key != key)
+    return nullptr;
+
+  heuristic->distance.resize(size);
+  fin.read(reinterpret_cast<char*>(heuristic->distance.data()), size*sizeof(float));
+
+  if (!fin)
+    return nullptr;
+
+  return heuristic;
+}
+
+void save_node_heuristic(const string& file_name, const Node_heuristic& heuristic)
+{
+  std::ofstream fout(file_name, std::ios::binary);
+  if (!fout)
+    throw runtime_error("Could not open A* heuristic file for writing.");
+
+  uint64_t size = heuristic.distance.size();
+  fout.write(reinterpret_cast<const char*>(&heuristic.key), sizeof(uint64_t));
+  fout.write(reinterpret_cast<const char*>(&heuristic.length_penalty), sizeof(double));
+  fout.write(reinterpret_cast<const char*>(&size), sizeof(size));
+  fout.write(reinterpret_cast<const char*>(heuristic.distance.data()),
+             size*sizeof(float));
+}
+
+template<typename Data_cost, typename Pair_cost, typename Voxel>
+Node_lower_bound node_lower_bound(const matrix<Voxel>& data,
+                                  const matrix<unsigned char>& mesh_map,
+                                  const GridGeometry& grid,
+                                  const matrix<int>& connectivity,
+                                  InstanceSettings& settings)
+{
+  uint64_t key = node_heuristic_key(data, mesh_map, grid, connectivity, settings);
+  double length_penalty = settings.penalty[0];
+
+  std::shared_ptr<const Node_heuristic> heuristic;
+
+  if (settings.cache_a_star_heuristic)
+  {
+    std::lock_guard<std::mutex> lock(node_heuristic_mutex);
+    if (node_heuristic_cache && node_heuristic_cache->key == key)
+      heuristic = node_heuristic_cache;
+  }
+
+  if (!heuristic && !settings.a_star_heuristic_file.empty())
+    heuristic = load_node_heuristic(settings.a_star_heuristic_file, key);
+
+  if (heuristic && length_penalty < min_node_heuristic_scale*heuristic->length_penalty)
+  {
+    if (settings.verbose)
+      mexPrintf("Length penalty decreased; recomputing A* heuristic.\n");
+
+    heuristic = nullptr;
+  }
+
+  if (heuristic)
+  {
+    if (settings.verbose)
+      mexPrintf("Reusing A* heuristic.\n");
+  }
+  else
+  {
+    // Call node_segmentation. It solves the same problem, but without
+    // the curvature term.
+    // We tell it to compute all distances, and we will get a
+    // vector of the distance from any node to the end set.
+    // (node_segmentation switches the start and end sets.)
+    ShortestPathOptions heuristic_options;
+    heuristic_options.compute_all_distances = true;
+
+    std::vector<Point> points;
+    double heuristic_runtime = 0;
+    int heuristic_evaluations = 0;
+    double heuristic_cost = 0;
+    matrix<int> empty_matrix;
+    matrix<double> empty_double_matrix;
+
+    SegmentationOutput heuristic_output
+    (points, heuristic_runtime, heuristic_evaluations, heuristic_cost, empty_matrix, empty_matrix, empty_double_matrix);
+
+    node_segmentation<Data_cost, Pair_cost>
+                     (data,
+                      mesh_map,
+                      grid,
+                      connectivity,
+                      settings,
+                      heuristic_options,
+                      heuristic_output);
+
+    std::shared_ptr<Node_heuristic> computed(new Node_heuristic);
+    computed->key = key;
+    computed->length_penalty = length_penalty;
+    computed->distance = std::move(heuristic_options.distance);
+
+    if (!settings.a_star_heuristic_file.empty())
+      save_node_heuristic(settings.a_star_heuristic_file, *computed);
+
+    heuristic = computed;
+  }
+
+  if (settings.cache_a_star_heuristic)
+  {
+    std::lock_guard<std::mutex> lock(node_heuristic_mutex);
+    node_heuristic_cache = heuristic;
+  }
+
+  Node_lower_bound lower_bound;
+  lower_bound.heuristic = heuristic;
+  lower_bound.scale = 1;
+
+  if (length_penalty < heuristic->length_penalty)
+    lower_bound.scale = length_penalty / heuristic->length_penalty;
+
+  return lower_bound;
+}
@@ -0,0 +1,39 @@
+% Reads the header of a NRRD volume file, see volume_source.h.
+% sizes and spacings have one entry per dimension; the spacings are 1
+% if the header has none.
+function [sizes, spacings] = volume_file_info(file_name)
+
+fid = fopen(file_name, 'r');
+if fid < 0
+    error('Could not open %s.', file_name);
+end
+cleanup = onCleanup(@() fclose(fid));
+
+line = fgetl(fid);
+if ~ischar(line) || ~strncmp(line, 'NRRD', 4)
+    error('%s is not a NRRD file.', file_name);
+end
+
+sizes = [];
+spacings = [];
+line = fgetl(fid);
+while ischar(line) && ~isempty(strtrim(line))
+    [field, value] = strtok(line, ':');
+    value = strtrim(value(2:end));
+
+    if strcmp(field, 'sizes')
+        sizes = sscanf(value, '%d')';
+    elseif strcmp(field, 'spacings')
+        spacings = sscanf(value, '%f')';
+    end
+
+    line = fgetl(fid);
+end
+
+if isempty(sizes)
+    error('%s has no sizes.', file_name);
+end
+
+if numel(spacings) ~= numel(sizes) || any(~isfinite(spacings)) || any(spacings <= 0)
+    spacings = ones(size(sizes));
+end
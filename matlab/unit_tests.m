@@ -334,6 +334,85 @@ classdef unit_tests < matlab.unittest.TestCase
 			obj.verifyEqual( sum(noninf),  2.826056638509035e+02, 'AbsTol', 1e-4);
 		end
 		
+		% Integer data can not mark the disallowed voxels with inf, so the
+		% solvers have to avoid them through the mesh map.
+		function disallowed_integer_data(obj)
+			problem_size = [20 20];
+			data = zeros(problem_size, 'uint8');
+
+			start_set = false(problem_size);
+			end_set = false(problem_size);
+			disallowed_set = false(problem_size);
+
+			start_set(10,2) = true;
+			end_set(10,end-1) = true;
+
+			% A wall with a gap at one end.
+			disallowed_set(1:end-3,10) = true;
+
+			C = Curve_extraction(data, start_set, end_set, disallowed_set);
+			C.set_connectivity_by_radius(2);
+			C.length_penalty = 1;
+
+			for curvature_penalty = [0 1]
+				C.curvature_penalty = curvature_penalty;
+				[curve, cost] = C.shortest_path();
+				obj.verifyLessThan(cost.total, inf);
+
+				% No part of the curve passes through the wall.
+				for i = 1:size(curve,1)-1
+					for t = linspace(0,1,101)
+						p = round((1-t)*curve(i,:) + t*curve(i+1,:));
+						obj.verifyFalse(disallowed_set(p(1),p(2)));
+					end
+				end
+			end
+		end
+
+		%% Jounce
+		% Solved in the edge triple graph.
+		function jounce(obj)
+			rng(obj.rng_seed);
+			problem_size = [7 7];
+			start_set = false(problem_size);
+			end_set = false(problem_size);
+			start_set(2,2) = true;
+			end_set(6,5) = true;
+
+			C = Curve_extraction(rand(problem_size), start_set, end_set);
+			C.set_connectivity_by_radius(1.5);
+			C.length_penalty = 1;
+			C.curvature_penalty = 0.5;
+			C.torsion_penalty = 0.5;
+			tol = 1e-4;
+
+			[pair_curve, pair_cost] = C.shortest_path();
+
+			% A negligible penalty gives the edge pair solution.
+			C.jounce_penalty = 1e-100;
+			[curve, cost] = C.shortest_path();
+			obj.verifyEqual(curve, pair_curve);
+			obj.verifyEqual(cost.total, pair_cost.total, 'AbsTol', tol);
+
+			import matlab.unittest.constraints.*;
+			for jounce_penalty = [0.05 0.5 5]
+				C.jounce_penalty = jounce_penalty;
+				C.use_a_star = false;
+				[curve, cost] = C.shortest_path();
+
+				% Optimal, so at most the cost of the edge pair solution
+				% with the jounce included.
+				with_jounce = C.curve_info(pair_curve);
+				obj.verifyThat(cost.total, IsLessThanOrEqualTo(with_jounce.total + tol));
+				obj.verifyThat(cost.total, IsGreaterThanOrEqualTo(pair_cost.total - tol));
+
+				C.use_a_star = true;
+				[a_curve, a_cost] = C.shortest_path();
+				obj.verifyEqual(numel(curve), numel(a_curve));
+				obj.verifyEqual(cost.total, a_cost.total, 'AbsTol', tol);
+			end
+		end
+
 		%% Non symmetric connectivity.
 		function non_symmetric_connectivity(obj)
 			C = obj.linear_obj;
@@ -525,6 +604,32 @@ classdef unit_tests < matlab.unittest.TestCase
 			
 		end
 
+		% Geodesic on the zero level set of a signed distance volume.
+		function geodesic_volume(obj)
+			problem_size = [30 30 30];
+			[yy,xx,zz] = meshgrid(1:problem_size(2),1:problem_size(1),1:problem_size(3));
+			r = 10;
+			distance = sqrt((xx-16).^2 + (yy-16).^2 + (zz-16).^2) - r;
+
+			start_set = false(problem_size);
+			end_set = false(problem_size);
+			start_set(16+r,16,16) = true;
+			end_set(16,16+r,16) = true;
+
+			C = Geodesic_shortest_path(distance, start_set, end_set);
+			C.set_connectivity_by_radius(3);
+
+			import matlab.unittest.constraints.*;
+
+			% A quarter of a great circle.
+			C.shortest_path();
+			obj.verifyThat(C.length, IsLessThanOrEqualTo(1.1*r*pi/2));
+			obj.verifyThat(C.length, IsGreaterThanOrEqualTo(0.95*r*pi/2));
+
+			C.local_optimization();
+			obj.verifyThat(C.length, IsLessThanOrEqualTo(1.05*r*pi/2));
+		end
+
 		function explicit_data_term(obj)
 			linear_data = rand(50,50);
 
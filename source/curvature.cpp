@@ -4,8 +4,9 @@
 #include <cmath>
 #include <iostream>
 #include <limits>
-#include <map>
+#include <mutex>
 #include <stdexcept>
+#include <vector>
 
 // To be able to provide curvature computation
 // with automatic differentiation.
@@ -44,28 +45,173 @@ F<F<double, n>, n> abs(F<F<double, n>, n> x)
 
 }
 
-// This struct is a tuple of floating point values.
-// Two tuples are considered equal if no two elements
-// differ by more than 1e-4.
-template<typename R, int n>
-struct FloatingPointCacheEntry
+namespace curve_extraction
 {
-	R data[n];
 
-	bool operator<(const FloatingPointCacheEntry& rhs) const
+template<int n>
+struct QuantizedCache<n>::Shard
+{
+	// The key is only kept as its hash, zero for an empty slot.
+	struct Slot
+	{
+		std::uint64_t hash;
+		double value;
+	};
+
+	Shard() : size(0) { }
+
+	std::mutex mutex;
+	// Empty or a power of two, at most half full.
+	std::vector<Slot> slots;
+	std::size_t size;
+};
+
+namespace
+{
+	// Each element is mixed in with the SplitMix64 finalizer, so two keys
+	// have the same hash with probability 2^-64 and the hash may stand in
+	// for the key. Never zero.
+	template<int n>
+	std::uint64_t hash_key(const std::array<std::int64_t, n>& key)
 	{
-		const R tol = R(1e-4);
+		std::uint64_t hash = 0;
 		for (int i = 0; i < n; ++i) {
-			if (data[i] < rhs.data[i] - tol) {
-				return true;
+			hash = (hash ^ std::uint64_t(key[i])) + 0x9e3779b97f4a7c15ULL;
+			hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+			hash ^= hash >> 31;
+		}
+		return hash == 0 ? 1 : hash;
+	}
+}
+
+template<int n>
+QuantizedCache<n>::QuantizedCache(std::size_t capacity)
+	: shards(new Shard[num_shards]), max_size(capacity),
+	  num_values(0), num_hits(0), num_misses(0)
+{
+}
+
+template<int n>
+QuantizedCache<n>::~QuantizedCache()
+{
+}
+
+template<int n>
+std::int64_t QuantizedCache<n>::quantize(double value)
+{
+	return std::llround(value * 1e4);
+}
+
+template<int n>
+bool QuantizedCache<n>::find(const Key& key, double* value)
+{
+	if (num_values > 0) {
+		std::uint64_t hash = hash_key<n>(key);
+		Shard& shard = shards[hash % num_shards];
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (!shard.slots.empty()) {
+			std::size_t mask = shard.slots.size() - 1;
+			for (std::size_t i = (hash / num_shards) & mask; shard.slots[i].hash != 0; i = (i + 1) & mask) {
+				if (shard.slots[i].hash == hash) {
+					*value = shard.slots[i].value;
+					num_hits++;
+					return true;
+				}
 			}
-			if (rhs.data[i] < data[i] - tol) {
-				return false;
+		}
+	}
+
+	num_misses++;
+	return false;
+}
+
+template<int n>
+void QuantizedCache<n>::insert(const Key& key, double value)
+{
+	if (num_values >= max_size) {
+		return;
+	}
+
+	std::uint64_t hash = hash_key<n>(key);
+	Shard& shard = shards[hash % num_shards];
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	// Grow the table and reinsert the values.
+	if (2 * (shard.size + 1) > shard.slots.size()) {
+		std::vector<typename Shard::Slot> old_slots(std::max(std::size_t(16), 2 * shard.slots.size()));
+		old_slots.swap(shard.slots);
+
+		std::size_t mask = shard.slots.size() - 1;
+		for (const auto& slot : old_slots) {
+			if (slot.hash != 0) {
+				std::size_t i = (slot.hash / num_shards) & mask;
+				while (shard.slots[i].hash != 0) {
+					i = (i + 1) & mask;
+				}
+				shard.slots[i] = slot;
 			}
 		}
-		return false;
 	}
-};
+
+	std::size_t mask = shard.slots.size() - 1;
+	std::size_t i = (hash / num_shards) & mask;
+	for (; shard.slots[i].hash != 0; i = (i + 1) & mask) {
+		if (shard.slots[i].hash == hash) {
+			shard.slots[i].value = value;
+			return;
+		}
+	}
+
+	shard.slots[i].hash = hash;
+	shard.slots[i].value = value;
+	shard.size++;
+	num_values++;
+}
+
+template<int n>
+void QuantizedCache<n>::clear()
+{
+	for (int s = 0; s < num_shards; ++s) {
+		std::lock_guard<std::mutex> lock(shards[s].mutex);
+		num_values -= shards[s].size;
+		std::vector<typename Shard::Slot>().swap(shards[s].slots);
+		shards[s].size = 0;
+	}
+}
+
+template<int n>
+void QuantizedCache<n>::set_capacity(std::size_t capacity)
+{
+	clear();
+	max_size = capacity;
+}
+
+template<int n>
+void QuantizedCache<n>::reset_counters()
+{
+	num_hits = 0;
+	num_misses = 0;
+}
+
+template class QuantizedCache<9>;
+template class QuantizedCache<15>;
+
+CurvatureCache& default_curvature_cache()
+{
+	static CurvatureCache cache(1000000);
+	return cache;
+}
+
+TorsionCache& default_torsion_cache()
+{
+	static TorsionCache cache(10000000);
+	return cache;
+}
+
+}  // namespace curve_extraction
 
 template<typename R>
 struct use_cache
@@ -132,41 +278,39 @@ R compute_curvature_internal(R x1, R y1, R z1,
 	return sum;
 }
 
-int curve_extraction::curvature_cache_hits   = 0;
-int curve_extraction::curvature_cache_misses = 0;
-
 template<typename R>
 R curve_extraction::compute_curvature(R x1, R y1, R z1,
                                       R x2, R y2, R z2,
                                       R x3, R y3, R z3,
-                                      R p, bool writable_cache, int n)
+                                      R p, bool writable_cache, int n,
+                                      CurvatureCache* cache)
 {
-	static std::map<FloatingPointCacheEntry<R, 8>, R> curvature_cache;
-	const std::size_t max_cache_size = 1000000;
-	FloatingPointCacheEntry<R, 8> entry;
+	using spii::to_double;
+
+	if (cache == nullptr) {
+		cache = &default_curvature_cache();
+	}
+	CurvatureCache::Key key;
 
 	if (use_cache<R>::value) {
-		// The static cache of curvature values allows 
+		// The cache of curvature values allows 
 		// for much faster computations if the coordinates
 		// come from a regular grid.
-		// Create the entry by subtracting the mean from the coordinates.
-		entry.data[0] = x2 - x1;
-		entry.data[1] = x3 - x1;
-		entry.data[2] = y2 - y1;
-		entry.data[3] = y3 - y1;
-		entry.data[4] = z2 - z1;
-		entry.data[5] = z3 - z1;
+		// Create the key by subtracting the first point from the coordinates.
+		key[0] = CurvatureCache::quantize(to_double(x2 - x1));
+		key[1] = CurvatureCache::quantize(to_double(x3 - x1));
+		key[2] = CurvatureCache::quantize(to_double(y2 - y1));
+		key[3] = CurvatureCache::quantize(to_double(y3 - y1));
+		key[4] = CurvatureCache::quantize(to_double(z2 - z1));
+		key[5] = CurvatureCache::quantize(to_double(z3 - z1));
 		// p and n should also be in the cache.
-		entry.data[6] = p;
-		entry.data[7] = R(n);
+		key[6] = CurvatureCache::quantize(to_double(p));
+		key[7] = n;
+		key[8] = sizeof(R);
 		// If the value is in the cache, return it.
-		auto itr = curvature_cache.find(entry);
-		if (itr != curvature_cache.end()) {
-			curvature_cache_hits++;
-			return itr->second;
-		}
-		else {
-			curvature_cache_misses++;
+		double cached_value;
+		if (cache->find(key, &cached_value)) {
+			return R(cached_value);
 		}
 	}
 
@@ -174,64 +318,61 @@ R curve_extraction::compute_curvature(R x1, R y1, R z1,
 	                                     x2, y2, z2,
 	                                     x3, y3, z3, p, n);
 	if (use_cache<R>::value) {
-		if (writable_cache && curvature_cache.size() < max_cache_size) {
-			curvature_cache[entry] = value;
+		if (writable_cache) {
+			cache->insert(key, to_double(value));
 		}
 	}
 
 	return value;
 }
 
-int curve_extraction::torsion_cache_hits   = 0;
-int curve_extraction::torsion_cache_misses = 0;
-
 template<typename R>
 R curve_extraction::compute_torsion(R x1, R y1, R z1,
                                     R x2, R y2, R z2,
                                     R x3, R y3, R z3,
                                     R x4, R y4, R z4,
-                                    R p, bool writable_cache, int n)
+                                    R p, bool writable_cache, int n,
+                                    TorsionCache* cache)
 {
 	using std::pow;
 	using std::sqrt;
 	using std::atan2;
 	using std::abs;
+	using spii::to_double;
 
-	// The static cache of torsion values allows 
+	// The cache of torsion values allows 
 	// for much faster computations if the coordinates
 	// come from a regular grid.
-	static std::map<FloatingPointCacheEntry<R, 14>, R> torsion_cache;
-	const std::size_t max_cache_size = 10000000;
-	FloatingPointCacheEntry<R, 14> entry;
+	if (cache == nullptr) {
+		cache = &default_torsion_cache();
+	}
+	TorsionCache::Key key;
 
 	if (use_cache<R>::value) {
-		// Create the entry by subtracting the mean from the coordinates.
-		R mx = (x1 + x2 + x3 + x4) / R(4.0);
-		R my = (y1 + y2 + y3 + y4) / R(4.0);
-		R mz = (z1 + z2 + z3 + z4) / R(4.0);
-		entry.data[0]  = x1 - mx;
-		entry.data[1]  = x2 - mx;
-		entry.data[2]  = x3 - mx;
-		entry.data[3]  = x4 - mx;
-		entry.data[4]  = y1 - my;
-		entry.data[5]  = y2 - my;
-		entry.data[6]  = y3 - my;
-		entry.data[7]  = y4 - my;
-		entry.data[8]  = z1 - mz;
-		entry.data[9]  = z2 - mz;
-		entry.data[10] = z3 - mz;
-		entry.data[11] = z4 - mz;
+		// Create the key by subtracting the mean from the coordinates.
+		double mx = to_double(x1 + x2 + x3 + x4) / 4.0;
+		double my = to_double(y1 + y2 + y3 + y4) / 4.0;
+		double mz = to_double(z1 + z2 + z3 + z4) / 4.0;
+		key[0]  = TorsionCache::quantize(to_double(x1) - mx);
+		key[1]  = TorsionCache::quantize(to_double(x2) - mx);
+		key[2]  = TorsionCache::quantize(to_double(x3) - mx);
+		key[3]  = TorsionCache::quantize(to_double(x4) - mx);
+		key[4]  = TorsionCache::quantize(to_double(y1) - my);
+		key[5]  = TorsionCache::quantize(to_double(y2) - my);
+		key[6]  = TorsionCache::quantize(to_double(y3) - my);
+		key[7]  = TorsionCache::quantize(to_double(y4) - my);
+		key[8]  = TorsionCache::quantize(to_double(z1) - mz);
+		key[9]  = TorsionCache::quantize(to_double(z2) - mz);
+		key[10] = TorsionCache::quantize(to_double(z3) - mz);
+		key[11] = TorsionCache::quantize(to_double(z4) - mz);
 		// p and n should also be in the cache.
-		entry.data[12] = p;
-		entry.data[13] = R(n);
+		key[12] = TorsionCache::quantize(to_double(p));
+		key[13] = n;
+		key[14] = sizeof(R);
 		// If the value is in the cache, return it.
-		auto itr = torsion_cache.find(entry);
-		if (itr != torsion_cache.end()) {
-			torsion_cache_hits++;
-			return itr->second;
-		}
-		else {
-			torsion_cache_misses++;
+		double cached_value;
+		if (cache->find(key, &cached_value)) {
+			return R(cached_value);
 		}
 	}
 
@@ -275,8 +416,8 @@ R curve_extraction::compute_torsion(R x1, R y1, R z1,
 
 	if (use_cache<R>::value) {
 		// Set the cache and return.
-		if (writable_cache && torsion_cache.size() < max_cache_size) {
-			torsion_cache[entry] = sum;
+		if (writable_cache) {
+			cache->insert(key, to_double(sum));
 		}
 	}
 
@@ -285,13 +426,15 @@ R curve_extraction::compute_torsion(R x1, R y1, R z1,
 
 #define INSTANTIATE_CURVATURE(R) \
 	template           \
-	R curve_extraction::compute_curvature(R, R, R, R, R, R, R, R, R, R, bool, int);
+	R curve_extraction::compute_curvature(R, R, R, R, R, R, R, R, R, R, bool, int, \
+	                                      curve_extraction::CurvatureCache*);
 INSTANTIATE_CURVATURE(double);
 INSTANTIATE_CURVATURE(float);
 
 #define INSTANTIATE_TORSION(R) \
 	template           \
-	R curve_extraction::compute_torsion(R, R, R, R, R, R, R, R, R, R, R, R, R, bool, int);
+	R curve_extraction::compute_torsion(R, R, R, R, R, R, R, R, R, R, R, R, R, bool, int, \
+	                                    curve_extraction::TorsionCache*);
 INSTANTIATE_TORSION(double);
 INSTANTIATE_TORSION(float);
 
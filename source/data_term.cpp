@@ -1,81 +1,62 @@
 // Petter Strandmark 2013.
 #include <algorithm>
-
-#ifdef USE_OPENMP
-#include <omp.h>
-#endif
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
 
 #include <spii-thirdparty/fadiff.h>
 #include <spii/auto_diff_term.h>
 using spii::to_double;
 
 #include <curve_extraction/data_term.h>
+#include "line_segments.h"
 
-namespace fadbad
-{
-
-template<unsigned n>
-F<double, n> abs(F<double, n> x)
-{
-	if (to_double(x) < 0) {
-		return -x;
-	}
-	else {
-		return x;
-	}
-}
-
-template<unsigned n>
-F<F<double, n>, n> abs(F<F<double, n>, n> x)
+namespace curve_extraction
 {
-	if (to_double(x) < 0) {
-		return -x;
-	}
-	else {
-		return x;
-	}
-}
 
-}
+template<typename Voxel>
+BasicPieceWiseConstant<Voxel>::BasicPieceWiseConstant(const Voxel * unary_,
+                                                      int M_, int N_, int O_,
+                                                      const std::vector<double>& voxeldimensions_,
+                                                      double scale_, double offset_)
 
-namespace curve_extraction
-{
+	: BasicPieceWiseConstant(unary_, VolumeLayout(M_, N_, O_), voxeldimensions_, scale_, offset_)
+{ }
 
-PieceWiseConstant::PieceWiseConstant(const double * unary_,
-                                     int M_, int N_, int O_,
-                                     const std::vector<double>& voxeldimensions_)
+template<typename Voxel>
+BasicPieceWiseConstant<Voxel>::BasicPieceWiseConstant(const Voxel * unary_,
+                                                      const VolumeLayout& layout_,
+                                                      const std::vector<double>& voxeldimensions_,
+                                                      double scale_, double offset_)
 
-	: M(M_), N(N_), O(O_), unary(unary_), voxeldimensions(voxeldimensions_)
+	: M(layout_.M), N(layout_.N), O(layout_.O), unary(unary_), layout(layout_),
+	  voxeldimensions(voxeldimensions_), scale(scale_), offset(offset_)
 { }
 
 
 //
 //  pixel ix = 5 has real coordinates [4.5, 5.5).
 //
-int PieceWiseConstant::xyz_to_ind(double x, double y, double z) const
+template<typename Voxel>
+int BasicPieceWiseConstant<Voxel>::xyz_to_ind(double x, double y, double z) const
 {
 	int ix = std::max(std::min(int(x + 0.5), M - 1), 0);
 	int iy = std::max(std::min(int(y + 0.5), N - 1), 0);
 	int iz = std::max(std::min(int(z + 0.5), O - 1), 0);
-	return ix + M * iy + M * N * iz;
+	return layout.index(ix, iy, iz);
 }
 
+template<typename Voxel>
 template<typename R>
-R PieceWiseConstant::evaluate(R x, R y, R z) const
+R BasicPieceWiseConstant<Voxel>::evaluate(R x, R y, R z) const
 {
-	return unary[xyz_to_ind(to_double(x), to_double(y), to_double(z))];
-}
-
-template<typename R> 
-R fractional_part(R x)
-{
-	double integer_part;
-	modf(spii::to_double(x), &integer_part);
-	return x - integer_part;
+	return scale*double(unary[xyz_to_ind(to_double(x), to_double(y), to_double(z))]) + offset;
 }
 
+template<typename Voxel>
 template<typename R>
-bool PieceWiseConstant::inside_volume(R x, R y, R z) const
+bool BasicPieceWiseConstant<Voxel>::inside_volume(R x, R y, R z) const
 {
 	if (to_double(x) < -0.5)
 		return false;
@@ -94,107 +75,496 @@ bool PieceWiseConstant::inside_volume(R x, R y, R z) const
 	return true;
 }
 
+template<typename Voxel>
 template<typename R>
-R PieceWiseConstant::evaluate_line_integral(R sx, R sy, R sz,
-                                            R ex, R ey, R ez) const
+R BasicPieceWiseConstant<Voxel>::evaluate_line_integral(R sx, R sy, R sz,
+                                                        R ex, R ey, R ez) const
 {
-	using std::sqrt;
-	using std::abs;
-
 	if (!inside_volume(sx,sy,sz))
 		return R(std::numeric_limits<double>::infinity());
 
 	if (!inside_volume(ex,ey,ez))
 		return R(std::numeric_limits<double>::infinity());
 
+	R cost = 0;
+	R length = 0;
+	if (!row_integral(sx, sy, sz, ex, ey, ez, &cost, &length)) {
+		line_segments(sx, sy, sz, ex, ey, ez,
+			[this, &cost, &length](const R& begin, const R& end, int voxel, int, int) -> void
+			{
+				cost += (end - begin) * double(unary[voxel]);
+				length += end - begin;
+			});
+	}
+
+	return scale*cost + offset*length;
+}
+
+template<typename Voxel>
+double BasicPieceWiseConstant<Voxel>::evaluate_line_integral(double sx, double sy, double sz,
+                                                             double ex, double ey, double ez,
+                                                             double* gradient, double* hessian) const
+{
+	LineIntegralDerivatives derivatives(sx, sy, sz, ex, ey, ez, voxeldimensions, hessian != nullptr);
+
+	if (!inside_volume(sx, sy, sz) || !inside_volume(ex, ey, ez)) {
+		derivatives.add_infinite();
+	}
+	else {
+		line_segments(sx, sy, sz, ex, ey, ez,
+			[this, &derivatives](double begin, double end, int voxel, int begin_axis, int end_axis) -> void
+			{
+				derivatives.add_constant(begin, end, begin_axis, end_axis,
+				                         scale*double(unary[voxel]) + offset);
+			});
+	}
+
+	return derivatives.finish(gradient, hessian);
+}
+
+template<typename Voxel>
+void BasicPieceWiseConstant<Voxel>::index_axes(bool x, bool y, bool z)
+{
+	const bool indexed[3] = {x, y, z};
+	const int size[3] = {M, N, O};
+
+	for (int a = 0; a < 3; ++a) {
+		std::vector<double>().swap(prefix_sums[a]);
+		if (!indexed[a]) {
+			continue;
+		}
+
+		int b = (a + 1) % 3;
+		int c = (a + 2) % 3;
+		int num_rows = size[b]*size[c];
+		prefix_sums[a].resize(std::size_t(num_rows)*(size[a] + 1));
+
+		#ifdef USE_OPENMP
+		#pragma omp parallel for
+		#endif
+		for (int row = 0; row < num_rows; ++row) {
+			int voxel[3];
+			voxel[b] = row % size[b];
+			voxel[c] = row / size[b];
+
+			double* prefix = &prefix_sums[a][std::size_t(row)*(size[a] + 1)];
+			prefix[0] = 0;
+			for (int i = 0; i < size[a]; ++i) {
+				voxel[a] = i;
+				prefix[i + 1] = prefix[i] + double(unary[layout.index(voxel[0], voxel[1], voxel[2])]);
+			}
+		}
+	}
+}
+
+template<typename Voxel>
+template<typename R>
+bool BasicPieceWiseConstant<Voxel>::row_integral(R sx, R sy, R sz,
+                                                 R ex, R ey, R ez,
+                                                 R* cost, R* length) const
+{
+	using std::sqrt;
+
+	const R start[3] = {sx, sy, sz};
+	const R end[3]   = {ex, ey, ez};
+	const int size[3] = {M, N, O};
+
+	// The voxel index may only change along one axis, and by at least
+	// two (shorter lines are traversed quickly anyway).
+	int a = -1;
+	int voxel[3];
+	for (int d = 0; d < 3; ++d) {
+		voxel[d] = std::min(int(to_double(start[d]) + 0.5), size[d] - 1);
+		int last = std::min(int(to_double(end[d]) + 0.5), size[d] - 1);
+		if (last != voxel[d]) {
+			if (a >= 0 || std::abs(last - voxel[d]) < 2) {
+				return false;
+			}
+			a = d;
+		}
+	}
+
+	if (a < 0 || prefix_sums[a].empty()) {
+		return false;
+	}
+
+	int b = (a + 1) % 3;
+	int c = (a + 2) % 3;
+	const double* prefix = &prefix_sums[a][std::size_t(voxel[b] + size[b]*voxel[c])*(size[a] + 1)];
+
+	// Integral along the row up to coordinate t.
+	auto row_sum = [prefix, &size, a](const R& t) -> R
+	{
+		R u = t + 0.5;
+		int i = std::min(int(to_double(u)), size[a] - 1);
+		return prefix[i] + (u - double(i))*(prefix[i + 1] - prefix[i]);
+	};
+
 	R dx = (ex - sx)*voxeldimensions[0];
 	R dy = (ey - sy)*voxeldimensions[1];
 	R dz = (ez - sz)*voxeldimensions[2];
-
 	R line_length = sqrt(dx*dx + dy*dy + dz*dz);
 
-	typedef std::pair<R, int> crossing;
+	// The length of the line per unit along the row is constant.
+	R integral = line_length * (row_sum(end[a]) - row_sum(start[a])) / (end[a] - start[a]);
+
+	// Differences of infinite sums are left to the traversal.
+	if (!std::isfinite(to_double(integral))) {
+		return false;
+	}
+
+	*cost = integral;
+	*length = line_length;
+	return true;
+}
+
+template<typename Voxel>
+double BasicPieceWiseConstant<Voxel>::center_row_sum(int a, int x, int y, int z, int steps) const
+{
+	const int size[3] = {M, N, O};
+	const int voxel[3] = {x, y, z};
+	int b = (a + 1) % 3;
+	int c = (a + 2) % 3;
+	const double* prefix = &prefix_sums[a][std::size_t(voxel[b] + size[b]*voxel[c])*(size[a] + 1)];
+
+	// Half of the first and last voxels.
+	int first = std::min(voxel[a], voxel[a] + steps);
+	int last  = std::max(voxel[a], voxel[a] + steps);
+	return 0.5*(prefix[last] + prefix[last + 1]) - 0.5*(prefix[first] + prefix[first + 1]);
+}
 
-	// Integral invariant of direction
-	auto set_crossings =
-	[]
-	(int index_change, R k, R dx, R start,
-	 std::vector<crossing>& crossings) -> void
+
+template<typename Voxel>
+BasicStencilLineIntegral<Voxel>::BasicStencilLineIntegral(const Voxel * unary_,
+                                                          int M_, int N_, int O_,
+                                                          const std::vector<double>& voxeldimensions,
+                                                          const std::vector<int>& offsets_,
+                                                          double scale_, double offset_)
+
+	: BasicStencilLineIntegral(unary_, VolumeLayout(M_, N_, O_), voxeldimensions,
+	                           offsets_, scale_, offset_)
+{ }
+
+template<typename Voxel>
+BasicStencilLineIntegral<Voxel>::BasicStencilLineIntegral(const Voxel * unary_,
+                                                          int M_, int N_, int O_,
+                                                          const std::vector<double>& voxeldimensions,
+                                                          double dmax,
+                                                          double scale_, double offset_)
+
+	: BasicStencilLineIntegral(unary_, VolumeLayout(M_, N_, O_), voxeldimensions,
+	                           dmax, scale_, offset_)
+{ }
+
+template<typename Voxel>
+BasicStencilLineIntegral<Voxel>::BasicStencilLineIntegral(const Voxel * unary_,
+                                                          const VolumeLayout& layout_,
+                                                          const std::vector<double>& voxeldimensions,
+                                                          const std::vector<int>& offsets_,
+                                                          double scale_, double offset_)
+
+	: data_term(unary_, layout_, voxeldimensions, scale_, offset_),
+	  M(layout_.M), N(layout_.N), O(layout_.O), unary(unary_), layout(layout_),
+	  scale(scale_), offset(offset_), offsets(offsets_)
+{
+	if (offsets.size() % 3 != 0) {
+		throw std::runtime_error("StencilLineIntegral: offsets should have three entries per direction.");
+	}
+
+	create_stencils();
+}
+
+template<typename Voxel>
+BasicStencilLineIntegral<Voxel>::BasicStencilLineIntegral(const Voxel * unary_,
+                                                          const VolumeLayout& layout_,
+                                                          const std::vector<double>& voxeldimensions,
+                                                          double dmax,
+                                                          double scale_, double offset_)
+
+	: data_term(unary_, layout_, voxeldimensions, scale_, offset_),
+	  M(layout_.M), N(layout_.N), O(layout_.O), unary(unary_), layout(layout_),
+	  scale(scale_), offset(offset_)
+{
+	auto gcd = [](int a, int b) -> int
 	{
-		if (abs(to_double(k)) <= 1e-4f)
-			return;
+		while (b != 0) {
+			int r = a % b;
+			a = b;
+			b = r;
+		}
+		return a;
+	};
 
-		auto shifted_start = start + 0.5;
-		R current = 1.0 - fractional_part(shifted_start);
+	// Like GridMesh, only the shortest offset in every direction.
+	int r = int(dmax);
+	for (int dz = -r; dz <= r; ++dz) {
+	for (int dy = -r; dy <= r; ++dy) {
+	for (int dx = -r; dx <= r; ++dx) {
+		int d = dx*dx + dy*dy + dz*dz;
+		if (d == 0 || d > dmax*dmax + 1e-6) {
+			continue;
+		}
 
-		if (k < 0) {
-			current = 1.0 - current;
-			index_change = -index_change;
+		if (gcd(gcd(std::abs(dx), std::abs(dy)), std::abs(dz)) != 1) {
+			continue;
 		}
 
-		for (; to_double(current) <= abs(to_double(dx)); current = current + 1.0) {
-			crossings.push_back( crossing( abs(current/k), index_change) );
+		offsets.push_back(dx);
+		offsets.push_back(dy);
+		offsets.push_back(dz);
+	}}}
+
+	create_stencils();
+}
+
+template<typename Voxel>
+void BasicStencilLineIntegral<Voxel>::create_stencils()
+{
+	num_directions = offsets.size() / 3;
+	const int K = num_directions;
+
+	max_offset = 0;
+	for (int d : offsets) {
+		max_offset = std::max(max_offset, std::abs(d));
+	}
+
+	int table_side = 2*max_offset + 1;
+	direction_table.resize(table_side*table_side*table_side, -1);
+
+	std::vector<std::vector<std::pair<int, double>>> stencils(K);
+
+	// The voxels are found in column major order and converted to the
+	// layout of the volume below.
+	BasicPieceWiseConstant<Voxel> column_major(unary, M, N, O, data_term.voxeldimensions);
+
+	for (int k = 0; k < K; ++k) {
+		int dx = offsets[3*k];
+		int dy = offsets[3*k + 1];
+		int dz = offsets[3*k + 2];
+
+		int& table_entry = direction_table[ (dx + max_offset)
+		                                  + (dy + max_offset)*table_side
+		                                  + (dz + max_offset)*table_side*table_side];
+		if (table_entry < 0) {
+			table_entry = k;
 		}
-	};
 
-	// Have a static vector for temporary storage.
-	// Avoids memory allocations for almost all calls.
-	std::vector<crossing>* scratch_space;
-	#ifdef USE_OPENMP
-		// Maximum 100 threads.
-		// Support for C++11 thread_local is not very good yet.
-		static std::vector<crossing> local_space[100];
-		scratch_space = &local_space[omp_get_thread_num()];
-	#else
-		static std::vector<crossing> local_space;
-		scratch_space = &local_space;
-	#endif
+		// Start in the first voxel from which the line stays in the volume.
+		int sx = std::max(-dx, 0);
+		int sy = std::max(-dy, 0);
+		int sz = std::max(-dz, 0);
 
-	scratch_space->clear();
-	scratch_space->push_back( crossing(0.0f, 0) ); // start
+		if (!inside_volume(sx, sy, sz) || !inside_volume(sx + dx, sy + dy, sz + dz)) {
+			continue;
+		}
 
-	// x
-	R kx = dx/line_length;
-	set_crossings(1, kx, dx, sx, *scratch_space);
+		int start_voxel = sx + M*sy + M*N*sz;
+		column_major.template line_segments<double>(sx, sy, sz, sx + dx, sy + dy, sz + dz,
+			[&stencils, k, start_voxel](double begin, double end, int voxel, int, int) -> void
+			{
+				stencils[k].push_back(std::make_pair(voxel - start_voxel, end - begin));
+			});
+	}
 
-	// y
-	R ky = dy/line_length;
-	set_crossings(M, ky, dy, sy, *scratch_space);
+	stencil_length = 0;
+	for (const auto& stencil : stencils) {
+		stencil_length = std::max(stencil_length, int(stencil.size()));
+	}
 
-	// z
-	R kz = dz/line_length;
-	set_crossings(M*N, kz, dz, sz, *scratch_space);
+	voxel_offset.resize(stencil_length*K, 0);
+	voxel_x.resize(stencil_length*K, 0);
+	voxel_y.resize(stencil_length*K, 0);
+	voxel_z.resize(stencil_length*K, 0);
+	weight.resize(stencil_length*K, 0.0);
+	num_segments.resize(K);
+	line_length.resize(K, 0.0);
+
+	for (int k = 0; k < K; ++k) {
+		num_segments[k] = stencils[k].size();
+
+		// Start voxel of the stencil.
+		int sx = std::max(-offsets[3*k], 0);
+		int sy = std::max(-offsets[3*k + 1], 0);
+		int sz = std::max(-offsets[3*k + 2], 0);
+
+		for (int i = 0; i < num_segments[k]; ++i) {
+			int voxel = stencils[k][i].first + sx + M*sy + M*N*sz;
+			voxel_x[i*K + k] = voxel % M - sx;
+			voxel_y[i*K + k] = (voxel / M) % N - sy;
+			voxel_z[i*K + k] = voxel / (M*N) - sz;
+
+			voxel_offset[i*K + k] = stencils[k][i].first;
+			weight[i*K + k]       = stencils[k][i].second;
+			line_length[k]       += stencils[k][i].second;
+		}
+	}
+}
 
-	// last stretch
-	scratch_space->push_back( crossing(line_length, 0) );
+template<typename Voxel>
+int BasicStencilLineIntegral<Voxel>::xyz_to_ind(int x, int y, int z) const
+{
+	return layout.index(x, y, z);
+}
 
-	// Sort vector.
-	std::sort(scratch_space->begin(), scratch_space->end());
-	auto crossings_end = scratch_space->end();
+template<typename Voxel>
+bool BasicStencilLineIntegral<Voxel>::inside_volume(int x, int y, int z) const
+{
+	return x >= 0 && x < M && y >= 0 && y < N && z >= 0 && z < O;
+}
 
-	auto prev = scratch_space->begin();
-	auto next = scratch_space->begin();
+template<typename Voxel>
+int BasicStencilLineIntegral<Voxel>::direction(int dx, int dy, int dz) const
+{
+	if (std::abs(dx) > max_offset || std::abs(dy) > max_offset || std::abs(dz) > max_offset) {
+		return -1;
+	}
 
-	int source_id = xyz_to_ind(to_double(sx), to_double(sy), to_double(sz));
+	int table_side = 2*max_offset + 1;
+	return direction_table[ (dx + max_offset)
+	                      + (dy + max_offset)*table_side
+	                      + (dz + max_offset)*table_side*table_side];
+}
 
-	R cost = 0;
-	for (next++;
-	     next != crossings_end;
-	     prev++,next++)
-	{
-		R distance = (next->first - prev->first);
+template<typename Voxel>
+double BasicStencilLineIntegral<Voxel>::evaluate_line_integral(int x, int y, int z, int k) const
+{
+	const int* d = &offsets[3*k];
+	if (!inside_volume(x, y, z) ||
+	    !inside_volume(x + d[0], y + d[1], z + d[2])) {
+		return std::numeric_limits<double>::infinity();
+	}
 
-		// Removes small distances without this small numerical
-		// error might lead the data cost to sample in the wrong region.
-		// If the cost is \inf this is a problem no matter how tiny the distance.
-		if (distance > 1e-6)
-			cost += distance * unary[source_id];
+	if (!row_axis.empty() && row_axis[k] >= 0) {
+		int a = row_axis[k];
+		double sum = data_term.center_row_sum(a, x, y, z, d[a]);
+		// Differences of infinite sums are left to the stencils.
+		if (std::isfinite(sum)) {
+			return scale*data_term.voxeldimensions[a]*sum + offset*line_length[k];
+		}
+	}
+
+	const int K = num_directions;
+
+	double cost = 0;
+	if (layout.is_column_major()) {
+		const Voxel* start = unary + xyz_to_ind(x, y, z);
+		for (int i = 0; i < num_segments[k]; ++i) {
+			cost += weight[i*K + k] * double(start[voxel_offset[i*K + k]]);
+		}
+	}
+	else {
+		for (int i = 0; i < num_segments[k]; ++i) {
+			int voxel = xyz_to_ind(x + voxel_x[i*K + k], y + voxel_y[i*K + k], z + voxel_z[i*K + k]);
+			cost += weight[i*K + k] * double(unary[voxel]);
+		}
+	}
+
+	return scale*cost + offset*line_length[k];
+}
+
+template<typename Voxel>
+void BasicStencilLineIntegral<Voxel>::index_axes(bool x, bool y, bool z, int min_length)
+{
+	data_term.index_axes(x, y, z);
+
+	const bool indexed[3] = {x, y, z};
+	row_axis.clear();
+	if (!x && !y && !z) {
+		return;
+	}
+
+	row_axis.resize(num_directions, -1);
+	for (int k = 0; k < num_directions; ++k) {
+		const int* d = &offsets[3*k];
+		for (int a = 0; a < 3; ++a) {
+			bool along_axis = d[(a + 1) % 3] == 0 && d[(a + 2) % 3] == 0;
+			if (indexed[a] && along_axis && std::abs(d[a]) >= std::max(min_length, 2)) {
+				row_axis[k] = a;
+			}
+		}
+	}
+}
 
-		// Which dimension did we cross?
-		source_id += next->second;
+template<typename Voxel>
+void BasicStencilLineIntegral<Voxel>::evaluate_line_integrals(int x, int y, int z, double* integrals) const
+{
+	const int K = num_directions;
+
+	for (int k = 0; k < K; ++k) {
+		integrals[k] = 0;
+	}
+
+	// One pass over the stencils per crossed voxel, for all directions
+	// at once. The loop over the directions has no branches so that it
+	// can be vectorized. Lines leaving the volume read clamped voxels
+	// and are set to infinity afterwards; padding has zero weight and is
+	// masked so that infinite voxels do not give NaN.
+	if (layout.is_column_major()) {
+		const int start_voxel = x + M*y + M*N*z;
+		const int last_voxel = M*N*O - 1;
+
+		for (int i = 0; i < stencil_length; ++i) {
+			const int* voxels = &voxel_offset[i*K];
+			const double* w = &weight[i*K];
+
+			#ifdef USE_OPENMP
+			#pragma omp simd
+			#endif
+			for (int k = 0; k < K; ++k) {
+				int voxel = std::min(std::max(start_voxel + voxels[k], 0), last_voxel);
+				double value = w[k] * double(unary[voxel]);
+				integrals[k] += w[k] > 0 ? value : 0.0;
+			}
+		}
+	}
+	else {
+		for (int i = 0; i < stencil_length; ++i) {
+			const int* dx = &voxel_x[i*K];
+			const int* dy = &voxel_y[i*K];
+			const int* dz = &voxel_z[i*K];
+			const double* w = &weight[i*K];
+
+			#ifdef USE_OPENMP
+			#pragma omp simd
+			#endif
+			for (int k = 0; k < K; ++k) {
+				int vx = std::min(std::max(x + dx[k], 0), M - 1);
+				int vy = std::min(std::max(y + dy[k], 0), N - 1);
+				int vz = std::min(std::max(z + dz[k], 0), O - 1);
+				double value = w[k] * double(unary[layout.index(vx, vy, vz)]);
+				integrals[k] += w[k] > 0 ? value : 0.0;
+			}
+		}
 	}
 
-	return cost;
+	for (int k = 0; k < K; ++k) {
+		const int* d = &offsets[3*k];
+		if (!inside_volume(x, y, z) ||
+		    !inside_volume(x + d[0], y + d[1], z + d[2])) {
+			integrals[k] = std::numeric_limits<double>::infinity();
+		}
+		else {
+			integrals[k] = scale*integrals[k] + offset*line_length[k];
+		}
+	}
+}
+
+template<typename Voxel>
+double BasicStencilLineIntegral<Voxel>::evaluate_line_integral(double x1, double y1, double z1,
+                                                   double x2, double y2, double z2) const
+{
+	int x = int(x1), y = int(y1), z = int(z1);
+	int dx = int(x2) - x, dy = int(y2) - y, dz = int(z2) - z;
+
+	bool on_grid = x == x1 && y == y1 && z == z1 &&
+	               x + dx == x2 && y + dy == y2 && z + dz == z2;
+
+	int k = on_grid ? direction(dx, dy, dz) : -1;
+	if (k < 0) {
+		return data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2);
+	}
+
+	return evaluate_line_integral(x, y, z, k);
 }
 
 }  // namespace curve_extraction
@@ -208,9 +578,18 @@ typedef fadbad::F<double, 6> F6;
 typedef fadbad::F<fadbad::F<double, 3>, 3> FF3;
 typedef fadbad::F<fadbad::F<double, 6>, 6> FF6;
 typedef fadbad::F<fadbad::F<double, 9>, 9> FF9;
-INSTANTIATE(PieceWiseConstant, double)
-INSTANTIATE(PieceWiseConstant, F3)
-INSTANTIATE(PieceWiseConstant, F6)
-INSTANTIATE(PieceWiseConstant, FF3)
-INSTANTIATE(PieceWiseConstant, FF6)
-INSTANTIATE(PieceWiseConstant, FF9)
+
+#define INSTANTIATE_VOXEL(Voxel) \
+	template class curve_extraction::BasicPieceWiseConstant<Voxel>; \
+	template class curve_extraction::BasicStencilLineIntegral<Voxel>; \
+	INSTANTIATE(BasicPieceWiseConstant<Voxel>, double) \
+	INSTANTIATE(BasicPieceWiseConstant<Voxel>, F3) \
+	INSTANTIATE(BasicPieceWiseConstant<Voxel>, F6) \
+	INSTANTIATE(BasicPieceWiseConstant<Voxel>, FF3) \
+	INSTANTIATE(BasicPieceWiseConstant<Voxel>, FF6) \
+	INSTANTIATE(BasicPieceWiseConstant<Voxel>, FF9)
+
+INSTANTIATE_VOXEL(double)
+INSTANTIATE_VOXEL(float)
+INSTANTIATE_VOXEL(unsigned short)
+INSTANTIATE_VOXEL(unsigned char)
@@ -0,0 +1,364 @@
+// Voxel traversal shared by the data terms.
+#ifndef CURVE_EXTRACTION_LINE_SEGMENTS_H
+#define CURVE_EXTRACTION_LINE_SEGMENTS_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <spii-thirdparty/fadiff.h>
+#include <spii/auto_diff_term.h>
+using spii::to_double;
+
+#include <curve_extraction/data_term.h>
+
+namespace fadbad
+{
+
+template<unsigned n>
+F<double, n> abs(F<double, n> x)
+{
+	if (to_double(x) < 0) {
+		return -x;
+	}
+	else {
+		return x;
+	}
+}
+
+template<unsigned n>
+F<F<double, n>, n> abs(F<F<double, n>, n> x)
+{
+	if (to_double(x) < 0) {
+		return -x;
+	}
+	else {
+		return x;
+	}
+}
+
+}
+
+namespace curve_extraction
+{
+
+template<typename R> 
+R fractional_part(R x)
+{
+	double integer_part;
+	modf(spii::to_double(x), &integer_part);
+	return x - integer_part;
+}
+
+template<typename Voxel>
+template<typename R, typename Segment>
+void BasicPieceWiseConstant<Voxel>::line_segments(R sx, R sy, R sz,
+                                                  R ex, R ey, R ez,
+                                                  Segment segment) const
+{
+	using std::sqrt;
+	using std::abs;
+
+	R dx = (ex - sx)*voxeldimensions[0];
+	R dy = (ey - sy)*voxeldimensions[1];
+	R dz = (ez - sz)*voxeldimensions[2];
+
+	R line_length = sqrt(dx*dx + dy*dy + dz*dz);
+
+	// Incremental voxel traversal (Amanatides and Woo). For every axis,
+	// t[a] is the distance along the line to the next voxel boundary,
+	// found by stepping the boundary coordinate one voxel at a time.
+	// The boundaries are visited in increasing t without any sorting.
+	R start[3]  = {sx, sy, sz};
+	R delta[3]  = {ex - sx, ey - sy, ez - sz};
+	int step[3] = {1, 1, 1};
+	int voxel[3] = {int(to_double(sx) + 0.5), int(to_double(sy) + 0.5), int(to_double(sz) + 0.5)};
+
+	R current[3], k[3], t[3];
+	bool active[3];
+
+	for (int a = 0; a < 3; a++) {
+		k[a] = delta[a]/line_length;
+		active[a] = abs(to_double(k[a])) > 1e-4f;
+
+		if (!active[a]) {
+			continue;
+		}
+
+		// Distance (in voxels) to the first boundary.
+		current[a] = 1.0 - fractional_part(start[a] + 0.5);
+
+		if (k[a] < 0) {
+			current[a] = 1.0 - current[a];
+			step[a] = -step[a];
+		}
+
+		active[a] = to_double(current[a]) <= abs(to_double(delta[a]));
+		if (active[a]) {
+			t[a] = abs(current[a]/k[a]);
+		}
+	}
+
+	// Lines may extend beyond the volume (TriLinear integrates the
+	// extended border values), so the voxel is clamped to the volume.
+	auto voxel_index = [this](const int voxel[3]) -> int
+	{
+		return layout.index(std::min(std::max(voxel[0], 0), layout.M - 1),
+		                    std::min(std::max(voxel[1], 0), layout.N - 1),
+		                    std::min(std::max(voxel[2], 0), layout.O - 1));
+	};
+	int source_id = voxel_index(voxel);
+
+	R previous = 0;
+	int previous_axis = -1;
+	while (true)
+	{
+		// Which dimension do we cross next?
+		int axis = -1;
+		for (int a = 0; a < 3; a++) {
+			if (active[a] && (axis < 0 || to_double(t[a]) < to_double(t[axis]))) {
+				axis = a;
+			}
+		}
+
+		bool last_stretch = axis < 0 || to_double(t[axis]) >= to_double(line_length);
+		R next = last_stretch ? line_length : t[axis];
+		R distance = next - previous;
+
+		// Removes small distances without this small numerical
+		// error might lead the data cost to sample in the wrong region.
+		// If the cost is \inf this is a problem no matter how tiny the distance.
+		if (distance > 1e-6)
+			segment(previous, next, source_id, previous_axis, last_stretch ? -1 : axis);
+
+		if (last_stretch) {
+			break;
+		}
+
+		voxel[axis] += step[axis];
+		source_id = voxel_index(voxel);
+		previous = next;
+		previous_axis = axis;
+
+		current[axis] = current[axis] + 1.0;
+		active[axis] = to_double(current[axis]) <= abs(to_double(delta[axis]));
+		if (active[axis]) {
+			t[axis] = abs(current[axis]/k[axis]);
+		}
+	}
+}
+
+// The gradient and Hessian of a line integral with respect to the end
+// points (x1, y1, z1, x2, y2, z2), accumulated over the segments of the
+// voxel traversal.
+//
+// With p(t) = p1 + t*(p2 - p1), the integral is length*J, where J is
+// the integral of the integrand f(p(t)) over t in [0, 1]. A segment
+// boundary on a voxel boundary along axis a is at t = (b - x1)/(x2 - x1)
+// (for a = x), which moves with the end points; its derivatives give
+// the terms at the ends of every segment. The result is what automatic
+// differentiation of the traversal computes, without carrying dense
+// derivative arrays through it.
+class LineIntegralDerivatives
+{
+public:
+	LineIntegralDerivatives(double x1, double y1, double z1,
+	                        double x2, double y2, double z2,
+	                        const std::vector<double>& voxeldimensions,
+	                        bool with_hessian)
+		: start{x1, y1, z1}, delta{x2 - x1, y2 - y1, z2 - z1},
+		  with_hessian(with_hessian), J(0)
+	{
+		length = 0;
+		for (int d = 0; d < 3; ++d) {
+			weight[d] = voxeldimensions[d]*voxeldimensions[d];
+			length += weight[d]*delta[d]*delta[d];
+		}
+		length = std::sqrt(length);
+
+		for (int i = 0; i < 6; ++i) {
+			gradient[i] = 0;
+		}
+		for (int i = 0; i < 36; ++i) {
+			hessian[i] = 0;
+		}
+	}
+
+	double line_length() const { return length; }
+
+	// The integral is infinite, e.g. because the line leaves the volume.
+	void add_infinite()
+	{
+		J = std::numeric_limits<double>::infinity();
+	}
+
+	// Adds the segment between distances begin and end along the line,
+	// whose boundaries are voxel boundaries along begin_axis and
+	// end_axis (or the ends of the line if -1), with a constant
+	// integrand.
+	void add_constant(double begin, double end, int begin_axis, int end_axis, double value)
+	{
+		double t0 = begin / length;
+		double t1 = end / length;
+		J += value*(t1 - t0);
+		add_boundary(t1, end_axis, 1.0, value, nullptr);
+		add_boundary(t0, begin_axis, -1.0, value, nullptr);
+	}
+
+	// As add_constant, where integrand(p, &f, df, d2f) computes the value,
+	// gradient and Hessian (3 x 3) of the integrand at point p. Simpson's
+	// rule is exact if the integrand is cubic along the segment.
+	template<typename Integrand>
+	void add(double begin, double end, int begin_axis, int end_axis, Integrand integrand)
+	{
+		const double t[3] = {begin / length, (begin + end) / (2*length), end / length};
+		const double simpson[3] = {1.0/6.0, 4.0/6.0, 1.0/6.0};
+
+		double f[3], df[3][3], d2f[3][9];
+		for (int i = 0; i < 3; ++i) {
+			double p[3];
+			for (int d = 0; d < 3; ++d) {
+				p[d] = start[d] + t[i]*delta[d];
+			}
+			integrand(p, &f[i], df[i], d2f[i]);
+
+			double w = simpson[i]*(t[2] - t[0]);
+			double u[2] = {1 - t[i], t[i]};
+			J += w*f[i];
+			for (int j = 0; j < 2; ++j) {
+				for (int d = 0; d < 3; ++d) {
+					gradient[3*j + d] += w*u[j]*df[i][d];
+				}
+			}
+
+			if (with_hessian) {
+				for (int j = 0; j < 2; ++j) {
+				for (int k = 0; k < 2; ++k) {
+					for (int d = 0; d < 3; ++d) {
+					for (int e = 0; e < 3; ++e) {
+						hessian[6*(3*j + d) + 3*k + e] += w*u[j]*u[k]*d2f[i][3*d + e];
+					}}
+				}}
+			}
+		}
+
+		add_boundary(t[2], end_axis, 1.0, f[2], df[2]);
+		add_boundary(t[0], begin_axis, -1.0, f[0], df[0]);
+	}
+
+	// Returns the integral and writes its gradient and Hessian (6 x 6,
+	// row major; may be null). The derivatives are zero if the
+	// integral is not finite.
+	double finish(double* gradient_out, double* hessian_out) const
+	{
+		double integral = length*J;
+		if (!std::isfinite(integral) || length <= 0) {
+			for (int i = 0; i < 6; ++i) {
+				gradient_out[i] = 0;
+			}
+			for (int i = 0; hessian_out && i < 36; ++i) {
+				hessian_out[i] = 0;
+			}
+			return integral;
+		}
+
+		// The line length depends on p2 - p1 only.
+		double length_gradient[6];
+		for (int d = 0; d < 3; ++d) {
+			length_gradient[3 + d] = weight[d]*delta[d] / length;
+			length_gradient[d] = -length_gradient[3 + d];
+		}
+
+		for (int i = 0; i < 6; ++i) {
+			gradient_out[i] = J*length_gradient[i] + length*gradient[i];
+		}
+
+		if (hessian_out) {
+			for (int i = 0; i < 6; ++i) {
+			for (int j = 0; j < 6; ++j) {
+				int d = i % 3;
+				int e = j % 3;
+				double length_hessian = ((d == e ? weight[d] : 0.0)
+				                         - length_gradient[3 + d]*length_gradient[3 + e]) / length;
+				if ((i < 3) != (j < 3)) {
+					length_hessian = -length_hessian;
+				}
+
+				hessian_out[6*i + j] = J*length_hessian
+				                     + length_gradient[i]*gradient[j]
+				                     + gradient[i]*length_gradient[j]
+				                     + length*hessian[6*i + j];
+			}}
+		}
+
+		return integral;
+	}
+
+private:
+	// Adds sign*f(p(t))*dt, where t is on a voxel boundary along axis,
+	// to the derivatives. df is the gradient of the integrand at p(t),
+	// or null if it is zero.
+	void add_boundary(double t, int axis, double sign, double f, const double* df)
+	{
+		if (axis < 0) {
+			return;
+		}
+
+		// Derivatives of t with respect to x1 and x2 (for the x axis).
+		const int index[2] = {axis, 3 + axis};
+		const double d = delta[axis];
+		const double dt[2] = {-(1 - t) / d, -t / d};
+		gradient[index[0]] += sign*f*dt[0];
+		gradient[index[1]] += sign*f*dt[1];
+
+		if (!with_hessian) {
+			return;
+		}
+
+		const double d2t[2][2] = {{-2*(1 - t) / (d*d), (1 - 2*t) / (d*d)},
+		                          {(1 - 2*t) / (d*d),  2*t / (d*d)}};
+		for (int j = 0; j < 2; ++j) {
+			for (int k = 0; k < 2; ++k) {
+				hessian[6*index[j] + index[k]] += sign*f*d2t[j][k];
+			}
+		}
+
+		if (df == nullptr) {
+			return;
+		}
+
+		// The integrand at p(t) changes with the end points both
+		// directly and through t.
+		double slope = 0;
+		double dg[6];
+		for (int e = 0; e < 3; ++e) {
+			slope += df[e]*delta[e];
+			dg[e] = (1 - t)*df[e];
+			dg[3 + e] = t*df[e];
+		}
+
+		for (int j = 0; j < 2; ++j) {
+			for (int i = 0; i < 6; ++i) {
+				hessian[6*index[j] + i] += sign*dt[j]*dg[i];
+				hessian[6*i + index[j]] += sign*dg[i]*dt[j];
+			}
+			for (int k = 0; k < 2; ++k) {
+				hessian[6*index[j] + index[k]] += sign*slope*dt[j]*dt[k];
+			}
+		}
+	}
+
+	double start[3], delta[3], weight[3];
+	double length;
+	bool with_hessian;
+
+	// J and its derivatives with respect to the end points.
+	double J;
+	double gradient[6];
+	double hessian[36];
+};
+
+}  // namespace curve_extraction
+
+#endif
@@ -0,0 +1,112 @@
+// Petter Strandmark 2013.
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include <curve_extraction/multi_view_data_term.h>
+
+namespace curve_extraction
+{
+
+MultiViewDataTerm::MultiViewDataTerm(const Mesh& mesh_,
+                                     const std::vector<View>& views,
+                                     Aggregation aggregation_,
+                                     double temperature_)
+	: mesh(mesh_), num_views(int(views.size())),
+	  aggregation(aggregation_), temperature(temperature_)
+{
+	if (aggregation == soft_max_aggregation && !(temperature > 0)) {
+		throw std::runtime_error("MultiViewDataTerm: the temperature must be positive.");
+	}
+
+	std::vector<double> voxeldimensions(3, 1.0);
+	for (const auto& view: views) {
+		images.emplace_back(view.image, view.width, view.height, 1, voxeldimensions);
+	}
+
+	int num_points = mesh.number_of_points();
+	projections.resize(2*std::size_t(num_points)*num_views);
+
+	#ifdef USE_OPENMP
+	#pragma omp parallel for
+	#endif
+	for (int p = 0; p < num_points; ++p) {
+		const auto& point = mesh.get_point(p);
+		double X[4] = {point.x, point.y, point.z, 1.0};
+
+		for (int v = 0; v < num_views; ++v) {
+			const double* P = views[v].camera;
+			double x[3];
+			for (int i = 0; i < 3; ++i) {
+				x[i] = P[4*i]*X[0] + P[4*i + 1]*X[1] + P[4*i + 2]*X[2] + P[4*i + 3]*X[3];
+			}
+
+			double* projection = &projections[2*(std::size_t(p)*num_views + v)];
+			projection[0] = std::max(0.0, std::min(double(views[v].width - 1),  x[0] / x[2]));
+			projection[1] = std::max(0.0, std::min(double(views[v].height - 1), x[1] / x[2]));
+		}
+	}
+}
+
+double MultiViewDataTerm::evaluate_line_integral(int p1, int p2) const
+{
+	const double* start = &projections[2*std::size_t(p1)*num_views];
+	const double* end   = &projections[2*std::size_t(p2)*num_views];
+
+	double max_cost = 0;
+	double sum_cost = 0;
+	// The soft-max is max_cost + temperature*log(sum_exp), where the
+	// terms of sum_exp are relative to the maximum to avoid overflow.
+	double sum_exp = 0;
+
+	for (int v = 0; v < num_views; ++v) {
+		double cost = images[v].evaluate_line_integral(start[2*v], start[2*v + 1], 0.0,
+		                                               end[2*v],   end[2*v + 1],   0.0);
+
+		if (aggregation == soft_max_aggregation && !std::isinf(max_cost)) {
+			if (v == 0) {
+				sum_exp = 1;
+			}
+			else if (cost > max_cost) {
+				sum_exp = sum_exp*std::exp((max_cost - cost) / temperature) + 1;
+			}
+			else {
+				sum_exp += std::exp((cost - max_cost) / temperature);
+			}
+		}
+
+		max_cost = v == 0 ? cost : std::max(max_cost, cost);
+		sum_cost += cost;
+	}
+
+	if (aggregation == sum_aggregation) {
+		return sum_cost;
+	}
+	else if (aggregation == soft_max_aggregation && num_views > 0) {
+		return max_cost + temperature*std::log(sum_exp);
+	}
+	return max_cost;
+}
+
+double MultiViewDataTerm::evaluate_edge(int e) const
+{
+	if (edge_cache.empty()) {
+		const auto& edge = mesh.get_edge(e);
+		return evaluate_line_integral(edge.first, edge.second);
+	}
+
+	double& cost = edge_cache[e];
+	if (cost != cost) {
+		const auto& edge = mesh.get_edge(e);
+		cost = evaluate_line_integral(edge.first, edge.second);
+	}
+	return cost;
+}
+
+void MultiViewDataTerm::enable_edge_cache()
+{
+	edge_cache.resize(mesh.number_of_edges(), std::numeric_limits<double>::quiet_NaN());
+}
+
+}  // namespace curve_extraction
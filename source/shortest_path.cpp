@@ -17,6 +17,21 @@ double shortest_path(int n, const std::set<int>& start_set, const std::set<int>&
                      const std::function<void(int, std::vector<Neighbor>* neighbors)>& neighbors,
                      std::vector<int>* path, const std::function<double(int)>* get_lower_bound,
                      const ShortestPathOptions& options)
+{
+	std::vector<std::pair<int, double>> start_distances;
+	start_distances.reserve(start_set.size());
+	for (auto itr = start_set.begin(); itr != start_set.end(); ++itr) {
+		start_distances.push_back(std::make_pair(*itr, 0.0));
+	}
+
+	return shortest_path(n, start_distances, end_set, neighbors, path, get_lower_bound, options);
+}
+
+double shortest_path(int n, const std::vector<std::pair<int, double>>& start_set,
+                     const std::set<int>& end_set,
+                     const std::function<void(int, std::vector<Neighbor>* neighbors)>& neighbors,
+                     std::vector<int>* path, const std::function<double(int)>* get_lower_bound,
+                     const ShortestPathOptions& options)
 {
 	// Datatype used for the internal storage. Using float saves memory
 	// for really large problems.
@@ -58,12 +73,34 @@ double shortest_path(int n, const std::set<int>& start_set, const std::set<int>&
 		throw std::runtime_error("shortest_path: empty start set");
 	}
 	for (auto itr = start_set.begin(); itr != start_set.end(); ++itr) {
-		if (*itr < 0 || *itr >= n) {
+		if (itr->first < 0 || itr->first >= n) {
 			throw std::runtime_error("shortest_path: Invalid start set.");
 		}
-		distance[*itr] = 0;
-		prio_queue.insert(std::make_pair(0, *itr));
+		if (itr->second < 0) {
+			throw std::runtime_error("shortest_path: Negative initial distance.");
+		}
+		// A node listed twice keeps its smallest distance.
+		distance[itr->first] = std::min(distance[itr->first], queue_cost(itr->second));
+	}
+
+	// Insert all start nodes at once. The set is built from sorted
+	// input, which takes linear time.
+	std::vector<std::pair<queue_cost, int> > initial_queue;
+	initial_queue.reserve(start_set.size());
+	for (auto itr = start_set.begin(); itr != start_set.end(); ++itr) {
+		int i = itr->first;
+		if (distance[i] != queue_cost(itr->second)) {
+			continue;
+		}
+		queue_cost est = distance[i];
+		if (get_lower_bound) {
+			est += (*get_lower_bound)(i);
+			estimation[i] = est;
+		}
+		initial_queue.push_back(std::make_pair(est, i));
 	}
+	std::sort(initial_queue.begin(), initial_queue.end());
+	prio_queue.insert(initial_queue.begin(), initial_queue.end());
 	// Check end_set.
 	for (auto itr = end_set.begin(); itr != end_set.end(); ++itr) {
 		if (*itr < 0 || *itr >= n) {
@@ -115,7 +152,7 @@ double shortest_path(int n, const std::set<int>& start_set, const std::set<int>&
 			end_node = i;
 			int j = i;
 			path->clear();
-			while (start_set.find(j) == start_set.end()) {
+			while (previous[j] != -1) {
 				path->push_back(j);
 				j = previous[j];
 			}
@@ -1,6 +1,8 @@
 // Petter Strandmark 2013.
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
 
 #ifdef USE_OPENMP
 #include <omp.h>
@@ -11,116 +13,257 @@
 using spii::to_double;
 
 #include <curve_extraction/data_term.h>
+#include "line_segments.h"
 
 namespace curve_extraction
 {
 
-TriLinear::TriLinear(const double * unary_,
-                     int M_, int N_, int O_,
-                     const std::vector<double>& voxeldimensions_)
-	: M(M_), N(N_), O(O_), unary(unary_), voxeldimensions(voxeldimensions_)
+template<typename Voxel>
+BasicTriLinear<Voxel>::BasicTriLinear(const Voxel * unary_,
+                                      int M_, int N_, int O_,
+                                      const std::vector<double>& voxeldimensions_,
+                                      double scale_, double offset_)
+	: BasicTriLinear(unary_, VolumeLayout(M_, N_, O_), voxeldimensions_, scale_, offset_)
 { }
 
+template<typename Voxel>
+BasicTriLinear<Voxel>::BasicTriLinear(const Voxel * unary_,
+                                      const VolumeLayout& layout_,
+                                      const std::vector<double>& voxeldimensions_,
+                                      double scale_, double offset_)
+	: cells(unary_, layout_, voxeldimensions_),
+	  M(layout_.M), N(layout_.N), O(layout_.O), unary(unary_), layout(layout_),
+	  voxeldimensions(voxeldimensions_), scale(scale_), offset(offset_)
+{ }
+
+template<typename Voxel>
+int BasicTriLinear<Voxel>::xyz_to_ind(int x, int y, int z) const
+{
+	int ix = std::max(std::min(x, M - 1), 0);
+	int iy = std::max(std::min(y, N - 1), 0);
+	int iz = std::max(std::min(z, O - 1), 0);
+	return layout.index(ix, iy, iz);
+}
 
-//
-//  pixel ix = 5 has real coordinates [4.5, 5.5).
-//
-int TriLinear::xyz_to_ind(double x, double y, double z) const
+template<typename Voxel>
+bool BasicTriLinear<Voxel>::cell_values(int x, int y, int z, double V[8]) const
 {
-	int ix = std::max(std::min(int(x + 0.5), M - 1), 0);
-	int iy = std::max(std::min(int(y + 0.5), N - 1), 0);
-	int iz = std::max(std::min(int(z + 0.5), O - 1), 0);
-	return ix + M * iy + M * N * iz;
+	if (layout.is_column_major() &&
+	    x >= 0 && x < M - 1 && y >= 0 && y < N - 1 && z >= 0 && z < O - 1) {
+		const Voxel* corner = unary + x + M*y + M*N*z;
+		V[0] = corner[0];
+		V[1] = corner[1];
+		V[2] = corner[M];
+		V[3] = corner[M + 1];
+		V[4] = corner[M*N];
+		V[5] = corner[M*N + 1];
+		V[6] = corner[M*N + M];
+		V[7] = corner[M*N + M + 1];
+	}
+	else {
+		for (int i = 0; i < 8; ++i) {
+			V[i] = unary[xyz_to_ind(x + (i & 1), y + ((i >> 1) & 1), z + ((i >> 2) & 1))];
+		}
+	}
+
+	bool finite = true;
+	for (int i = 0; i < 8; ++i) {
+		finite = finite && V[i] < std::numeric_limits<double>::infinity();
+	}
+	return finite;
 }
 
+template<typename Voxel>
 template<typename R>
-R TriLinear::evaluate(R x, R y, R z) const
+R BasicTriLinear<Voxel>::interpolate(const double V[8], bool finite,
+                                     const R& rx, const R& ry, const R& rz)
+{
+	if (finite) {
+		R V00 = V[0] + (V[1] - V[0])*rx;
+		R V10 = V[2] + (V[3] - V[2])*rx;
+		R V01 = V[4] + (V[5] - V[4])*rx;
+		R V11 = V[6] + (V[7] - V[6])*rx;
+		R V0 = V00 + (V10 - V00)*ry;
+		R V1 = V01 + (V11 - V01)*ry;
+		return V0 + (V1 - V0)*rz;
+	}
+
+	// Infinite voxels only count where their weight is positive,
+	// otherwise a line along the border of a cell would be infinite
+	// (or NaN, if rounding makes the weight slightly negative).
+	R value = 0;
+	for (int i = 0; i < 8; ++i) {
+		R weight = (i & 1 ? rx : 1 - rx) *
+		           (i & 2 ? ry : 1 - ry) *
+		           (i & 4 ? rz : 1 - rz);
+		if (V[i] < std::numeric_limits<double>::infinity() || to_double(weight) > 0) {
+			value += V[i]*weight;
+		}
+	}
+	return value;
+}
+
+template<typename Voxel>
+void BasicTriLinear<Voxel>::interpolate(const double V[8], bool finite,
+                                        double rx, double ry, double rz,
+                                        double* value, double gradient[3], double hessian[9])
 {
-	return 0;
+	const double r[3] = {rx, ry, rz};
+
+	*value = 0;
+	for (int d = 0; d < 3; ++d) {
+		gradient[d] = 0;
+	}
+	for (int i = 0; i < 9; ++i) {
+		hessian[i] = 0;
+	}
+
+	for (int i = 0; i < 8; ++i) {
+		// The weight of voxel i is the product of w, whose derivatives
+		// are dw.
+		double w[3], dw[3];
+		for (int d = 0; d < 3; ++d) {
+			bool upper = (i >> d) & 1;
+			w[d] = upper ? r[d] : 1 - r[d];
+			dw[d] = upper ? 1 : -1;
+		}
+
+		// As above for infinite voxels.
+		if (!finite && !(V[i] < std::numeric_limits<double>::infinity()) && !(w[0]*w[1]*w[2] > 0)) {
+			continue;
+		}
+
+		*value += V[i]*w[0]*w[1]*w[2];
+		gradient[0] += V[i]*dw[0]*w[1]*w[2];
+		gradient[1] += V[i]*w[0]*dw[1]*w[2];
+		gradient[2] += V[i]*w[0]*w[1]*dw[2];
+		hessian[1] += V[i]*dw[0]*dw[1]*w[2];
+		hessian[2] += V[i]*dw[0]*w[1]*dw[2];
+		hessian[5] += V[i]*w[0]*dw[1]*dw[2];
+	}
+
+	hessian[3] = hessian[1];
+	hessian[6] = hessian[2];
+	hessian[7] = hessian[5];
 }
 
+template<typename Voxel>
 template<typename R>
-R TriLinear::evaluate_line_integral(R sx, R sy, R sz,
-                                    R ex, R ey, R ez) const
+R BasicTriLinear<Voxel>::evaluate(R x, R y, R z) const
 {
-	using std::sqrt;
 	using std::floor;
 
-	int interpolation_points = 25;
+	int vx = int(floor(to_double(x)));
+	int vy = int(floor(to_double(y)));
+	int vz = int(floor(to_double(z)));
+
+	double V[8];
+	bool finite = cell_values(vx, vy, vz, V);
+	return scale*interpolate(V, finite, x - R(vx), y - R(vy), z - R(vz)) + offset;
+}
 
-	R dx = ((ex - sx)*voxeldimensions[0]);
-	R dy = ((ey - sy)*voxeldimensions[1]);
-	R dz = ((ez - sz)*voxeldimensions[2]);
+template<typename Voxel>
+template<typename R>
+R BasicTriLinear<Voxel>::evaluate_line_integral(R sx, R sy, R sz,
+                                                R ex, R ey, R ez) const
+{
+	using std::sqrt;
+	using std::floor;
 
-	R segment_length = sqrt(dx*dx +dy*dy+dz*dz) / interpolation_points;
+	R dx = ex - sx;
+	R dy = ey - sy;
+	R dz = ez - sz;
 
-	dx /= (interpolation_points - 1);
-	dy /= (interpolation_points - 1);
-	dz /= (interpolation_points - 1);
+	R line_length = sqrt( dx*dx*voxeldimensions[0]*voxeldimensions[0]
+	                    + dy*dy*voxeldimensions[1]*voxeldimensions[1]
+	                    + dz*dz*voxeldimensions[2]*voxeldimensions[2]);
 
 	R cost = 0;
+	R length = 0;
+
+	// The interpolant is continuous, so the value at the end of a
+	// segment is reused at the start of the next one.
+	double previous_end = -1;
+	R previous_value = 0;
 
-	// Goes along the line connecting the start and end point
-	// in each point we perform trilinear interpolation
-	for (int i = 0; i < interpolation_points; i++)
-	{
-		// Current location along the line connecting start and stop
-		// +0.5 since we define (0,0,0) to be center of voxel 0 0 0.
-		R cx = sx + dx*R(i) + R(0.5);
-		R cy = sy + dy*R(i) + R(0.5);
-		R cz = sz + dz*R(i) + R(0.5);
-
-		if (dx == 0)
-			cx = 0;
-
-		if (dy == 0)
-			cy = 0;
-
-		if (dz == 0)
-			cz = 0;
-
-		// What voxel are we currently inside
-		int vx = floor( to_double(cx) );
-		int vy = floor( to_double(cy) );
-		int vz = floor( to_double(cz) );
-
-		// Relative to center of voxel how far away is
-		// each dimension?
-		R rx = cx - R(vx);
-		R ry = cy - R(vy);
-		R rz = cz - R(vz);
-
-		// Set values
-		auto get_intensity =
-			[&]
-			(int x, int y, int z) -> double
+	// The interpolation cells are the voxels of a grid shifted by
+	// half a voxel. Within a cell the interpolant is a cubic
+	// polynomial along the line, which Simpson's rule integrates
+	// exactly.
+	cells.line_segments(sx + 0.5, sy + 0.5, sz + 0.5,
+	                    ex + 0.5, ey + 0.5, ez + 0.5,
+		[&](const R& begin, const R& end, int, int, int) -> void
 		{
-			return unary[xyz_to_ind(x, y, z)];
-		};
-
-		// Intensity at neighboring voxels
-		double V000 = get_intensity(vx + 0,vy + 0,vz + 0);
-		double V001 = get_intensity(vx + 0,vy + 0,vz + 1);
-		double V010 = get_intensity(vx + 0,vy + 1,vz + 0);
-		double V011 = get_intensity(vx + 0,vy + 1,vz + 1);
-		double V100 = get_intensity(vx + 1,vy + 0,vz + 0);
-		double V101 = get_intensity(vx + 1,vy + 0,vz + 1);
-		double V110 = get_intensity(vx + 1,vy + 1,vz + 0);
-		double V111 = get_intensity(vx + 1,vy + 1,vz + 1);
-
-		// Trilinear interpolation
-		cost += V000*(1 - rx)*(1 - ry)*(1 - rz) +
-						V100*(0 + rx)*(1 - ry)*(1 - rz) + 
-						V010*(1 - rx)*(0 + ry)*(1 - rz) + 
-						V001*(1 - rx)*(1 - ry)*(0 + rz) +
-						V101*(0 + rx)*(1 - ry)*(0 + rz) + 
-						V011*(1 - rx)*(0 + ry)*(0 + rz) + 
-						V110*(0 + rx)*(0 + ry)*(1 - rz) + 
-						V111*(0 + rx)*(0 + ry)*(1 - rz);
-	}
+			R t0 = begin / line_length;
+			R t1 = end / line_length;
+			R tm = (t0 + t1) / 2.0;
+
+			int vx = int(floor(to_double(sx + tm*dx)));
+			int vy = int(floor(to_double(sy + tm*dy)));
+			int vz = int(floor(to_double(sz + tm*dz)));
+
+			double V[8];
+			bool finite = cell_values(vx, vy, vz, V);
+
+			auto value = [&](const R& t) -> R
+			{
+				return interpolate(V, finite,
+				                   sx + t*dx - R(vx),
+				                   sy + t*dy - R(vy),
+				                   sz + t*dz - R(vz));
+			};
+
+			R start_value = to_double(begin) == previous_end ? previous_value : value(t0);
+			R end_value = value(t1);
+			cost += (end - begin) * (start_value + 4.0*value(tm) + end_value) / 6.0;
+
+			length += end - begin;
+			previous_end = to_double(end);
+			previous_value = end_value;
+		});
 
-	cost *= segment_length;
-	return cost;
+	return scale*cost + offset*length;
+}
+
+template<typename Voxel>
+double BasicTriLinear<Voxel>::evaluate_line_integral(double sx, double sy, double sz,
+                                                     double ex, double ey, double ez,
+                                                     double* gradient, double* hessian) const
+{
+	using std::floor;
+
+	LineIntegralDerivatives derivatives(sx, sy, sz, ex, ey, ez, voxeldimensions, hessian != nullptr);
+	const double start[3] = {sx, sy, sz};
+	const double delta[3] = {ex - sx, ey - sy, ez - sz};
+
+	cells.line_segments(sx + 0.5, sy + 0.5, sz + 0.5,
+	                    ex + 0.5, ey + 0.5, ez + 0.5,
+		[&](double begin, double end, int, int begin_axis, int end_axis) -> void
+		{
+			double tm = (begin + end) / (2*derivatives.line_length());
+			int corner[3];
+			for (int d = 0; d < 3; ++d) {
+				corner[d] = int(floor(start[d] + tm*delta[d]));
+			}
+
+			double V[8];
+			bool finite = cell_values(corner[0], corner[1], corner[2], V);
+
+			derivatives.add(begin, end, begin_axis, end_axis,
+				[&](const double p[3], double* f, double df[3], double d2f[9]) -> void
+				{
+					interpolate(V, finite, p[0] - corner[0], p[1] - corner[1], p[2] - corner[2], f, df, d2f);
+					*f = scale*(*f) + offset;
+					for (int i = 0; i < 3; ++i) {
+						df[i] *= scale;
+					}
+					for (int i = 0; i < 9; ++i) {
+						d2f[i] *= scale;
+					}
+				});
+		});
+
+	return derivatives.finish(gradient, hessian);
 }
 
 }  // namespace curve_extraction
@@ -134,10 +277,19 @@ typedef fadbad::F<double, 6> F6;
 typedef fadbad::F<fadbad::F<double, 3>, 3> FF3;
 typedef fadbad::F<fadbad::F<double, 6>, 6> FF6;
 typedef fadbad::F<fadbad::F<double, 9>, 9> FF9;
-INSTANTIATE(TriLinear, double)
-INSTANTIATE(TriLinear, F3)
-INSTANTIATE(TriLinear, F6)
-INSTANTIATE(TriLinear, FF3)
-INSTANTIATE(TriLinear, FF6)
-INSTANTIATE(TriLinear, FF9)
+
+#define INSTANTIATE_VOXEL(Voxel) \
+	template class curve_extraction::BasicTriLinear<Voxel>; \
+	INSTANTIATE(BasicTriLinear<Voxel>, double) \
+	INSTANTIATE(BasicTriLinear<Voxel>, F3) \
+	INSTANTIATE(BasicTriLinear<Voxel>, F6) \
+	INSTANTIATE(BasicTriLinear<Voxel>, FF3) \
+	INSTANTIATE(BasicTriLinear<Voxel>, FF6) \
+	INSTANTIATE(BasicTriLinear<Voxel>, FF9)
+
+INSTANTIATE_VOXEL(double)
+INSTANTIATE_VOXEL(float)
+INSTANTIATE_VOXEL(unsigned short)
+INSTANTIATE_VOXEL(unsigned char)
+#undef INSTANTIATE_VOXEL
 #undef INSTANTIATE
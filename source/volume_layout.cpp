@@ -0,0 +1,70 @@
+// Petter Strandmark 2013.
+#include <stdexcept>
+
+#include <curve_extraction/volume_layout.h>
+
+namespace curve_extraction
+{
+
+VolumeLayout::VolumeLayout(int M_, int N_, int O_)
+	: M(M_), N(N_), O(O_), brick_size(0),
+	  num_voxels(std::size_t(M_)*N_*O_),
+	  x_offset(M_ + 2), y_offset(N_ + 2), z_offset(O_ + 2)
+{
+	for (int x = 0; x < M; ++x) {
+		x_offset[x + 1] = x;
+	}
+	for (int y = 0; y < N; ++y) {
+		y_offset[y + 1] = M*y;
+	}
+	for (int z = 0; z < O; ++z) {
+		z_offset[z + 1] = M*N*z;
+	}
+	clamp_borders();
+}
+
+void VolumeLayout::clamp_borders()
+{
+	x_offset.front() = x_offset[1];
+	x_offset.back()  = x_offset[M];
+	y_offset.front() = y_offset[1];
+	y_offset.back()  = y_offset[N];
+	z_offset.front() = z_offset[1];
+	z_offset.back()  = z_offset[O];
+}
+
+VolumeLayout VolumeLayout::bricked(int M, int N, int O, int brick_size)
+{
+	if (brick_size <= 0) {
+		throw std::runtime_error("VolumeLayout: brick_size must be positive.");
+	}
+
+	VolumeLayout layout(M, N, O);
+	layout.brick_size = brick_size;
+
+	// Number of bricks along each axis.
+	int bricks_x = (M + brick_size - 1) / brick_size;
+	int bricks_y = (N + brick_size - 1) / brick_size;
+	int bricks_z = (O + brick_size - 1) / brick_size;
+	int brick_voxels = brick_size*brick_size*brick_size;
+
+	for (int x = 0; x < M; ++x) {
+		layout.x_offset[x + 1] = (x / brick_size)*brick_voxels
+		                       + x % brick_size;
+	}
+	for (int y = 0; y < N; ++y) {
+		layout.y_offset[y + 1] = (y / brick_size)*bricks_x*brick_voxels
+		                       + (y % brick_size)*brick_size;
+	}
+	for (int z = 0; z < O; ++z) {
+		layout.z_offset[z + 1] = (z / brick_size)*bricks_x*bricks_y*brick_voxels
+		                       + (z % brick_size)*brick_size*brick_size;
+	}
+
+	layout.clamp_borders();
+
+	layout.num_voxels = std::size_t(bricks_x)*bricks_y*bricks_z*brick_voxels;
+	return layout;
+}
+
+}  // namespace curve_extraction
@@ -0,0 +1,315 @@
+// Petter Strandmark 2013.
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <curve_extraction/volume_source.h>
+
+namespace curve_extraction
+{
+
+namespace
+{
+	template<typename Voxel>
+	VolumeSource::VoxelType voxel_type_of();
+
+	template<>
+	VolumeSource::VoxelType voxel_type_of<unsigned char>()
+	{
+		return VolumeSource::uint8_voxels;
+	}
+
+	template<>
+	VolumeSource::VoxelType voxel_type_of<unsigned short>()
+	{
+		return VolumeSource::uint16_voxels;
+	}
+
+	template<>
+	VolumeSource::VoxelType voxel_type_of<float>()
+	{
+		return VolumeSource::float_voxels;
+	}
+
+	template<>
+	VolumeSource::VoxelType voxel_type_of<double>()
+	{
+		return VolumeSource::double_voxels;
+	}
+
+	const char* type_names[] = {"uint8", "uint16", "float", "double"};
+	const std::size_t type_sizes[] = {1, 2, 4, 8};
+
+	VolumeSource::VoxelType parse_type(const std::string& type)
+	{
+		if (type == "uchar" || type == "unsigned char" || type == "uint8" || type == "uint8_t") {
+			return VolumeSource::uint8_voxels;
+		}
+		if (type == "ushort" || type == "unsigned short" || type == "unsigned short int" ||
+		    type == "uint16" || type == "uint16_t") {
+			return VolumeSource::uint16_voxels;
+		}
+		if (type == "float") {
+			return VolumeSource::float_voxels;
+		}
+		if (type == "double") {
+			return VolumeSource::double_voxels;
+		}
+		throw std::runtime_error("VolumeSource: unsupported type \"" + type + "\".");
+	}
+
+	// Mapping or reading starts on a page boundary.
+	const std::size_t page_size = 4096;
+}
+
+VolumeSource::VolumeSource(const std::string& file_name, AccessPattern access)
+	: voxel_type(double_voxels), spacings(3, 1.0),
+	  mapping(nullptr), mapping_size(0), data(nullptr)
+{
+	std::ifstream fin(file_name, std::ios::binary);
+	if (!fin) {
+		throw std::runtime_error("VolumeSource: could not open " + file_name + ".");
+	}
+
+	std::string line;
+	std::getline(fin, line);
+	if (line.compare(0, 4, "NRRD") != 0) {
+		throw std::runtime_error("VolumeSource: " + file_name + " is not a NRRD file.");
+	}
+	header_text = line + "\n";
+
+	// The header ends with an empty line or, for detached headers, at
+	// the end of the file.
+	std::map<std::string, std::string> fields;
+	bool empty_line = false;
+	while (std::getline(fin, line)) {
+		if (!line.empty() && line[line.size() - 1] == '\r') {
+			line.erase(line.size() - 1);
+		}
+		if (line.empty()) {
+			empty_line = true;
+			break;
+		}
+		header_text += line + "\n";
+		std::size_t colon = line.find(": ");
+		if (line[0] == '#' || colon == std::string::npos) {
+			continue;
+		}
+		fields[line.substr(0, colon)] = line.substr(colon + 2);
+	}
+	std::size_t header_size = empty_line ? std::size_t(fin.tellg()) : 0;
+
+	auto field = [&](const std::string& name) -> std::string
+	{
+		auto itr = fields.find(name);
+		if (itr == fields.end()) {
+			throw std::runtime_error("VolumeSource: " + file_name + " has no " + name + ".");
+		}
+		return itr->second;
+	};
+
+	voxel_type = parse_type(field("type"));
+
+	int dimension = std::stoi(field("dimension"));
+	if (dimension != 2 && dimension != 3) {
+		throw std::runtime_error("VolumeSource: only 2D and 3D volumes are supported.");
+	}
+
+	sizes[2] = 1;
+	std::istringstream size_stream(field("sizes"));
+	for (int d = 0; d < dimension; ++d) {
+		if (!(size_stream >> sizes[d]) || sizes[d] <= 0) {
+			throw std::runtime_error("VolumeSource: invalid sizes in " + file_name + ".");
+		}
+	}
+
+	if (fields.count("spacings")) {
+		std::istringstream spacing_stream(fields["spacings"]);
+		for (int d = 0; d < dimension; ++d) {
+			std::string spacing;
+			spacing_stream >> spacing;
+			double value = std::atof(spacing.c_str());
+			if (value > 0 && std::isfinite(value)) {
+				spacings[d] = value;
+			}
+		}
+	}
+
+	if (field("encoding") != "raw") {
+		throw std::runtime_error("VolumeSource: only the raw encoding is supported.");
+	}
+
+	if (type_sizes[voxel_type] > 1 && fields.count("endian") && fields["endian"] != "little") {
+		throw std::runtime_error("VolumeSource: only little endian volumes are supported.");
+	}
+
+	if (fields.count("data file")) {
+		data_file_name = fields["data file"];
+		bool absolute_path = data_file_name.find_first_of("/\\") == 0 ||
+		                     data_file_name.find(':') != std::string::npos;
+		std::size_t slash = file_name.find_last_of("/\\");
+		if (!absolute_path && slash != std::string::npos) {
+			data_file_name = file_name.substr(0, slash + 1) + data_file_name;
+		}
+
+		long long byte_skip = fields.count("byte skip") ? std::stoll(fields["byte skip"]) : 0;
+		if (byte_skip < 0) {
+			throw std::runtime_error("VolumeSource: negative byte skip is not supported.");
+		}
+
+		map(data_file_name, std::size_t(byte_skip));
+	}
+	else {
+		if (!empty_line) {
+			throw std::runtime_error("VolumeSource: " + file_name + " has no data.");
+		}
+		data_file_name = file_name;
+		map(file_name, header_size);
+	}
+
+	advise(access);
+}
+
+VolumeSource::~VolumeSource()
+{
+#ifndef _WIN32
+	if (mapping) {
+		munmap(mapping, mapping_size);
+	}
+#endif
+}
+
+void VolumeSource::map(const std::string& data_file_name, std::size_t offset)
+{
+	std::size_t num_bytes = numel()*type_sizes[voxel_type];
+
+#ifndef _WIN32
+	int fd = ::open(data_file_name.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("VolumeSource: could not open " + data_file_name + ".");
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || std::size_t(info.st_size) < offset + num_bytes) {
+		::close(fd);
+		throw std::runtime_error("VolumeSource: " + data_file_name + " is too small.");
+	}
+
+	// Only the pages from the one containing offset are mapped.
+	std::size_t map_offset = offset - offset % page_size;
+	mapping_size = offset + num_bytes - map_offset;
+	void* address = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, off_t(map_offset));
+	::close(fd);
+
+	if (address == MAP_FAILED) {
+		throw std::runtime_error("VolumeSource: could not map " + data_file_name + ".");
+	}
+
+	mapping = static_cast<char*>(address);
+	data = mapping + (offset - map_offset);
+
+	// The voxels can not be used in place if the header size is not
+	// a multiple of the voxel size.
+	if ((offset - map_offset) % type_sizes[voxel_type] == 0) {
+		return;
+	}
+
+	buffer.resize((num_bytes + sizeof(double) - 1) / sizeof(double));
+	std::memcpy(&buffer[0], data, num_bytes);
+	munmap(mapping, mapping_size);
+	mapping = nullptr;
+	mapping_size = 0;
+	data = reinterpret_cast<const char*>(&buffer[0]);
+#else
+	std::ifstream fin(data_file_name, std::ios::binary);
+	buffer.resize((num_bytes + sizeof(double) - 1) / sizeof(double));
+	fin.seekg(offset);
+	if (!fin.read(reinterpret_cast<char*>(&buffer[0]), num_bytes)) {
+		throw std::runtime_error("VolumeSource: could not read " + data_file_name + ".");
+	}
+	data = reinterpret_cast<const char*>(&buffer[0]);
+#endif
+}
+
+void VolumeSource::advise(AccessPattern access) const
+{
+#ifndef _WIN32
+	if (!mapping) {
+		return;
+	}
+
+	int advice = MADV_NORMAL;
+	if (access == sequential_access) {
+		advice = MADV_SEQUENTIAL;
+	}
+	else if (access == random_access) {
+		advice = MADV_RANDOM;
+	}
+	madvise(mapping, mapping_size, advice);
+#endif
+}
+
+template<typename Voxel>
+const Voxel* VolumeSource::voxels() const
+{
+	if (voxel_type != voxel_type_of<Voxel>()) {
+		throw std::runtime_error(std::string("VolumeSource: the volume has type ") +
+		                         type_names[voxel_type] + ".");
+	}
+	return reinterpret_cast<const Voxel*>(data);
+}
+
+template<typename Voxel>
+void VolumeSource::write(const std::string& file_name,
+                         const Voxel* voxels,
+                         int M, int N, int O,
+                         const std::vector<double>& voxeldimensions)
+{
+	std::ostringstream header;
+	header.precision(17);
+	header << "NRRD0004\n"
+	       << "type: " << type_names[voxel_type_of<Voxel>()] << "\n"
+	       << "dimension: 3\n"
+	       << "sizes: " << M << " " << N << " " << O << "\n"
+	       << "spacings: " << voxeldimensions.at(0) << " "
+	                       << voxeldimensions.at(1) << " "
+	                       << voxeldimensions.at(2) << "\n"
+	       << "encoding: raw\n"
+	       << "endian: little\n";
+
+	// A comment pads the header to a whole page.
+	std::string text = header.str() + "# ";
+	text += std::string((page_size - (text.size() + 2) % page_size) % page_size, ' ');
+	text += "\n\n";
+
+	std::ofstream fout(file_name, std::ios::binary);
+	fout.write(text.data(), text.size());
+	fout.write(reinterpret_cast<const char*>(voxels), std::size_t(M)*N*O*sizeof(Voxel));
+	if (!fout) {
+		throw std::runtime_error("VolumeSource: could not write " + file_name + ".");
+	}
+}
+
+}  // namespace curve_extraction
+
+#define INSTANTIATE(Voxel) \
+	template const Voxel* curve_extraction::VolumeSource::voxels<Voxel>() const; \
+	template void curve_extraction::VolumeSource::write<Voxel>(const std::string&, const Voxel*, \
+	                                                           int, int, int, const std::vector<double>&);
+
+INSTANTIATE(unsigned char)
+INSTANTIATE(unsigned short)
+INSTANTIATE(float)
+INSTANTIATE(double)
+#undef INSTANTIATE
@@ -1,7 +1,9 @@
 // Petter Strandmark 2013.
 
+#include <array>
 #include <cmath>
 #include <random>
+#include <vector>
 
 #include <spii-thirdparty/fadiff.h>
 
@@ -36,7 +38,7 @@ TEST_CASE("compute_curvature/helix", "")
 	                                       x2,y2,z2,
 	                                       x3,y3,z3,
 	                                       power, false, n_points);
-	CHECK(curvature_cache_misses == 1);
+	CHECK(default_curvature_cache().misses() == 1);
 	EXPECT_NEAR(k2_int_pair, 0.495821512020759, 1e-6);
 
 	// Iterate to test cache.
@@ -45,8 +47,8 @@ TEST_CASE("compute_curvature/helix", "")
 										x2,y2,z2,
 										x3,y3,z3,
 										power, true, n_points);
-		CHECK(curvature_cache_misses == 2);
-		CHECK(curvature_cache_hits == iter - 1);
+		CHECK(default_curvature_cache().misses() == 2);
+		CHECK(default_curvature_cache().hits() == iter - 1);
 	}
 }
 
@@ -101,6 +103,87 @@ TEST_CASE("compute_torsion/crooked_line_in_plane", "")
 	EXPECT_NEAR(test, 0.0f, 1e-6f);
 }
 
+TEST_CASE("compute_curvature/cache_instance", "")
+{
+	std::size_t default_hits = default_curvature_cache().hits();
+	CurvatureCache cache(2);
+
+	double k1 = compute_curvature(0.0, 0.0, 0.0,  1.0, 0.0, 0.0,  2.0, 1.0, 0.0,  2.0, true, 200, &cache);
+	CHECK(cache.misses() == 1);
+	CHECK(cache.size() == 1);
+
+	// Translated points have the same key.
+	double k2 = compute_curvature(5.0, 5.0, 5.0,  6.0, 5.0, 5.0,  7.0, 6.0, 5.0,  2.0, true, 200, &cache);
+	CHECK(cache.hits() == 1);
+	CHECK(k2 == k1);
+
+	// Another power and float values are cached separately.
+	compute_curvature(0.0, 0.0, 0.0,  1.0, 0.0, 0.0,  2.0, 1.0, 0.0,  1.0, true, 200, &cache);
+	compute_curvature(0.0f, 0.0f, 0.0f,  1.0f, 0.0f, 0.0f,  2.0f, 1.0f, 0.0f,  2.0f, true, 200, &cache);
+	CHECK(cache.misses() == 3);
+	CHECK(cache.size() == 2);
+
+	cache.clear();
+	CHECK(cache.size() == 0);
+	CHECK(cache.hits() == 1);
+	compute_curvature(0.0, 0.0, 0.0,  1.0, 0.0, 0.0,  2.0, 1.0, 0.0,  2.0, true, 200, &cache);
+	CHECK(cache.misses() == 4);
+
+	cache.reset_counters();
+	CHECK(cache.hits() == 0);
+	CHECK(cache.misses() == 0);
+
+	cache.set_capacity(0);
+	compute_curvature(0.0, 0.0, 0.0,  1.0, 0.0, 0.0,  2.0, 1.0, 0.0,  2.0, true, 200, &cache);
+	CHECK(cache.size() == 0);
+
+	CHECK(default_curvature_cache().hits() == default_hits);
+}
+
+TEST_CASE("compute_torsion/cache_threads", "")
+{
+	TorsionCache cache(100000);
+	TorsionCache no_cache(0);
+
+	// The 26 neighbor offsets.
+	std::vector<std::array<double, 3>> offsets;
+	for (int k = 0; k < 27; ++k) {
+		if (k != 13) {
+			offsets.push_back({{double(k % 3 - 1), double(k / 3 % 3 - 1), double(k / 9 - 1)}});
+		}
+	}
+
+	// Quadruples along the x axis, so that many of them share keys.
+	const int n = 26 * 26 * 5;
+	std::vector<double> cached(n), uncached(n);
+
+	#ifdef USE_OPENMP
+	#pragma omp parallel for
+	#endif
+	for (int i = 0; i < n; ++i) {
+		const auto& a = offsets[i % 26];
+		const auto& b = offsets[i / 26 % 26];
+		double x1 = i / (26 * 26);
+		double x2 = x1 + a[0], y2 = a[1], z2 = a[2];
+		double x3 = x2 + b[0], y3 = y2 + b[1], z3 = z2 + b[2];
+		double x4 = x3 + 1, y4 = y3 + 0.5, z4 = z3;
+
+		cached[i] = compute_torsion(x1, 0.0, 0.0,  x2, y2, z2,  x3, y3, z3,  x4, y4, z4,
+		                            2.0, true, 20, &cache);
+		uncached[i] = compute_torsion(x1, 0.0, 0.0,  x2, y2, z2,  x3, y3, z3,  x4, y4, z4,
+		                              2.0, true, 20, &no_cache);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		CHECK(cached[i] == uncached[i]);
+	}
+	CHECK(cache.size() == 26 * 26);
+	std::size_t lookups = cache.hits() + cache.misses();
+	CHECK(lookups == n);
+	CHECK(cache.misses() >= 26 * 26);
+	CHECK(no_cache.hits() == 0);
+}
+
 TEST_CASE("differentiate_curvature")
 {
 	typedef fadbad::F<double, 9>Dual;
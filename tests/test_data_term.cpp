@@ -46,6 +46,16 @@ TEST_CASE("Interpolate/Length", "")
 	test_length(0,2,0,1,-1,4);
 	test_length(3,2,1,-1,1,1);
 	test_length(2,4,4,0,0,-2);
+
+	// Anisotropic voxels; the integral is the physical length.
+	voxeldimensions[0] = 2.0;
+	voxeldimensions[2] = 0.5;
+	PieceWiseConstant anisotropic(&un[0], M, N, O, voxeldimensions);
+
+	CHECK(Approx(anisotropic.evaluate_line_integral(1.0, 1.0, 1.0, 2.0, 1.0, 1.0)) == 2.0);
+	CHECK(Approx(anisotropic.evaluate_line_integral(0.0, 0.0, 0.0, 4.0, 4.0, 4.0)) == std::sqrt(84.0));
+	CHECK(Approx(anisotropic.evaluate_line_integral(3.2, 0.1, 4.0, 0.7, 2.9, 0.0)) ==
+	      std::sqrt(2.5*2.5*4 + 2.8*2.8 + 4.0*4.0*0.25));
 }
 
 TEST_CASE("Interpolate/Unary", "")
@@ -85,6 +95,14 @@ TEST_CASE("Interpolate/Unary", "")
 	test_unary(data_term, 4,0,2,	-1,4,0,		2.618172076554679e+02);
 	test_unary(data_term, 4,4,2,	0,-4,0,		256);
 
+	// Anisotropic voxels; each voxel is weighted by the physical
+	// length of the line inside it.
+	std::vector<double> anisotropic_dimensions = {2.0, 1.0, 0.5};
+	PieceWiseConstant anisotropic(&un[0], M, N, O, anisotropic_dimensions);
+
+	test_unary(anisotropic, 1,1,1,	1,0,0,		31*1.0 + 32*1.0);
+	test_unary(anisotropic, 2,2,1,	0,0,2,		37*0.25 + 62*0.5 + 87*0.25);
+
 	// Infinity tests
  	M = 4; N = 4; O = 1;
  	std::vector<double> un_inf(M*N*O);
@@ -122,6 +140,76 @@ TEST_CASE("Interpolate/Unary inf")
 
 }
 
+TEST_CASE("Interpolate/TriLinear", "")
+{
+	int M = 5;
+	int N = 5;
+	int O = 5;
+	std::vector<double> un(M*N*O);
+	std::vector<double> voxeldimensions(3,1.0);
+
+	// A linear function, which trilinear interpolation reproduces.
+	for (int i = 0; i < M; i++) {
+	for (int j = 0; j < N; j++) {
+	for (int k  =0; k < O; k++) {
+		un[i + j*M + k*M*N] = i + 2*j + 3*k;
+	}}}
+
+	TriLinear data_term(&un[0], M, N, O, voxeldimensions);
+
+	CHECK(data_term.evaluate(2.0, 3.0, 1.0) == 11.0);
+	CHECK(Approx(data_term.evaluate(2.5, 3.25, 0.5)) == 10.5);
+	// Border values are extended.
+	CHECK(data_term.evaluate(-0.5, 0.0, 4.5) == 12.0);
+
+	// The integral of a linear function is its value at the midpoint
+	// times the length.
+	auto test_line = []
+	(const TriLinear& data_term, const std::vector<double>& dims,
+	 double x1, double y1, double z1, double x2, double y2, double z2) -> void
+	{
+		double length = std::sqrt( (x2-x1)*(x2-x1)*dims[0]*dims[0]
+		                         + (y2-y1)*(y2-y1)*dims[1]*dims[1]
+		                         + (z2-z1)*(z2-z1)*dims[2]*dims[2]);
+		double midpoint = (x1 + x2)/2 + 2*(y1 + y2)/2 + 3*(z1 + z2)/2;
+		double forward_cost = data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2);
+		double backward_cost = data_term.evaluate_line_integral(x2, y2, z2, x1, y1, z1);
+
+		CAPTURE(x1);
+		CAPTURE(y1);
+		CAPTURE(z1);
+		CAPTURE(x2);
+		CAPTURE(y2);
+		CAPTURE(z2);
+		CHECK(Approx(forward_cost) == length*midpoint);
+		CHECK(Approx(backward_cost) == forward_cost);
+	};
+
+	test_line(data_term, voxeldimensions, 0,0,0, 4,4,4);
+	test_line(data_term, voxeldimensions, 1,2,3, 2,2,3);
+	test_line(data_term, voxeldimensions, 0.3,3.9,1.2, 3.7,0.1,2.6);
+	test_line(data_term, voxeldimensions, 2,2,2, 2,2,2);
+
+	std::vector<double> anisotropic_dimensions = {2.0, 1.0, 0.5};
+	TriLinear anisotropic(&un[0], M, N, O, anisotropic_dimensions);
+	test_line(anisotropic, anisotropic_dimensions, 1,1,1, 2,1,1);
+	test_line(anisotropic, anisotropic_dimensions, 0.3,3.9,1.2, 3.7,0.1,2.6);
+
+	// Lines beyond the volume integrate the extended border values.
+	double gradient[6];
+	CHECK(Approx(data_term.evaluate_line_integral(-20.0, 1.0, 1.0, 2.0, 1.0, 1.0)) == 20*5 + 2*6);
+	CHECK(Approx(data_term.evaluate_line_integral(2.0, 1.0, 1.0, -20.0, 1.0, 1.0, gradient, nullptr)) == 20*5 + 2*6);
+	CHECK(Approx(data_term.evaluate_line_integral(2.0, 2.0, -7.0, 2.0, 2.0, 10.0)) == 7*6 + 4*12 + 6*18);
+	CHECK(Approx(data_term.evaluate_line_integral(2.0, 2.0, 10.0, 2.0, 2.0, -7.0, gradient, nullptr)) == 7*6 + 4*12 + 6*18);
+	CHECK(Approx(data_term.evaluate_line_integral(-20.0, -5.0, 1.0, -10.0, -5.0, 1.0)) == 10*3);
+
+	// Infinite voxels only affect lines where they have weight.
+	un[2 + 3*M + 1*M*N] = std::numeric_limits<double>::infinity();
+	CHECK(data_term.evaluate_line_integral(0.0, 2.0, 1.0, 4.0, 2.0, 1.0) == 4*(2.0 + 4 + 3));
+	CHECK(data_term.evaluate_line_integral(0.0, 2.5, 1.0, 4.0, 2.5, 1.0) ==
+	      std::numeric_limits<double>::infinity());
+}
+
 template<typename DataTermImplementation>
 void perform_stress_test()
 {
@@ -194,13 +282,319 @@ TEST_CASE("Stress test -- PieceWiseConstant")
 	perform_stress_test<PieceWiseConstant>();
 }
 
+// Equal up to rounding. The vectorized loops of StencilLineIntegral
+// may contract multiply-adds differently from the scalar code, e.g.
+// with -march=native.
+bool same_integral(double a, double b)
+{
+	return a == b || Approx(a).epsilon(1e-12) == b;
+}
+
+TEST_CASE("StencilLineIntegral")
+{
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, 1.0), rng);
+
+	int M = 7;
+	int N = 6;
+	int O = 5;
+	std::vector<double> un(M*N*O);
+	for (auto& value : un) {
+		value = rand() < 0.05 ? std::numeric_limits<double>::infinity() : rand();
+	}
+
+	std::vector<double> voxeldimensions = {1.0, 1.5, 0.5};
+	PieceWiseConstant data_term(&un[0], M, N, O, voxeldimensions);
+	StencilLineIntegral stencils(&un[0], M, N, O, voxeldimensions, 3.0);
+
+	CHECK(stencils.direction(0, 0, 0) == -1);
+	CHECK(stencils.direction(2, 0, 0) == -1);
+	CHECK(stencils.direction(2, -1, 1) >= 0);
+
+	std::vector<double> integrals(stencils.size());
+	for (int z = 0; z < O; ++z) {
+	for (int y = 0; y < N; ++y) {
+	for (int x = 0; x < M; ++x) {
+		stencils.evaluate_line_integrals(x, y, z, &integrals[0]);
+
+		for (int dz = -3; dz <= 3; ++dz) {
+		for (int dy = -3; dy <= 3; ++dy) {
+		for (int dx = -3; dx <= 3; ++dx) {
+			int k = stencils.direction(dx, dy, dz);
+			if (k < 0) {
+				continue;
+			}
+
+			double expected = data_term.evaluate_line_integral<double>(x, y, z, x + dx, y + dy, z + dz);
+			CAPTURE(x);
+			CAPTURE(y);
+			CAPTURE(z);
+			CAPTURE(dx);
+			CAPTURE(dy);
+			CAPTURE(dz);
+			CHECK(stencils.evaluate_line_integral(x, y, z, k) == expected);
+			CHECK(same_integral(integrals[k], expected));
+		}}}
+	}}}
+
+	// Lines not along the stencils are evaluated directly.
+	CHECK(stencils.evaluate_line_integral(1.5, 2.0, 1.0, 3.0, 2.0, 1.0) ==
+	      data_term.evaluate_line_integral(1.5, 2.0, 1.0, 3.0, 2.0, 1.0));
+	CHECK(stencils.evaluate_line_integral(1.0, 2.0, 1.0, 5.0, 2.0, 1.0) ==
+	      data_term.evaluate_line_integral(1.0, 2.0, 1.0, 5.0, 2.0, 1.0));
+}
+
+template<typename Voxel>
+void perform_voxel_type_test()
+{
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, 1.0), rng);
+
+	int M = 7;
+	int N = 6;
+	int O = 5;
+	double scale = 0.25;
+	double offset = 1.5;
+	std::vector<Voxel> un(M*N*O);
+	std::vector<double> mapped(M*N*O);
+	for (int i = 0; i < un.size(); ++i) {
+		un[i] = Voxel(int(200*rand()));
+		mapped[i] = scale*un[i] + offset;
+	}
+
+	std::vector<double> voxeldimensions = {1.0, 1.5, 0.5};
+	BasicPieceWiseConstant<Voxel> data_term(&un[0], M, N, O, voxeldimensions, scale, offset);
+	BasicStencilLineIntegral<Voxel> stencils(&un[0], M, N, O, voxeldimensions, 2.0, scale, offset);
+	BasicTriLinear<Voxel> trilinear(&un[0], M, N, O, voxeldimensions, scale, offset);
+	PieceWiseConstant mapped_data_term(&mapped[0], M, N, O, voxeldimensions);
+	TriLinear mapped_trilinear(&mapped[0], M, N, O, voxeldimensions);
+
+	for (int iter = 0; iter < 100; ++iter) {
+		double x1 = rand() * (M - 1);
+		double y1 = rand() * (N - 1);
+		double z1 = rand() * (O - 1);
+		double x2 = rand() * (M - 1);
+		double y2 = rand() * (N - 1);
+		double z2 = rand() * (O - 1);
+
+		CAPTURE(x1);
+		CAPTURE(y1);
+		CAPTURE(z1);
+		CAPTURE(x2);
+		CAPTURE(y2);
+		CAPTURE(z2);
+		CHECK(Approx(data_term.evaluate(x1, y1, z1)) == mapped_data_term.evaluate(x1, y1, z1));
+		CHECK(Approx(trilinear.evaluate(x1, y1, z1)) == mapped_trilinear.evaluate(x1, y1, z1));
+		CHECK(Approx(data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2)) ==
+		      mapped_data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2));
+		CHECK(Approx(trilinear.evaluate_line_integral(x1, y1, z1, x2, y2, z2)) ==
+		      mapped_trilinear.evaluate_line_integral(x1, y1, z1, x2, y2, z2));
+	}
+
+	std::vector<double> integrals(stencils.size());
+	for (int z = 0; z < O; ++z) {
+	for (int y = 0; y < N; ++y) {
+	for (int x = 0; x < M; ++x) {
+		stencils.evaluate_line_integrals(x, y, z, &integrals[0]);
+
+		for (int dz = -2; dz <= 2; ++dz) {
+		for (int dy = -2; dy <= 2; ++dy) {
+		for (int dx = -2; dx <= 2; ++dx) {
+			int k = stencils.direction(dx, dy, dz);
+			bool inside = x + dx >= 0 && x + dx < M &&
+			              y + dy >= 0 && y + dy < N &&
+			              z + dz >= 0 && z + dz < O;
+			if (k < 0 || !inside) {
+				continue;
+			}
+
+			double expected = mapped_data_term.evaluate_line_integral<double>(x, y, z, x + dx, y + dy, z + dz);
+			CHECK(Approx(stencils.evaluate_line_integral(x, y, z, k)) == expected);
+			CHECK(Approx(integrals[k]) == expected);
+		}}}
+	}}}
+}
+
+TEST_CASE("Voxel types")
+{
+	perform_voxel_type_test<float>();
+	perform_voxel_type_test<unsigned short>();
+	perform_voxel_type_test<unsigned char>();
+}
+
+TEST_CASE("Bricked volume")
+{
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, 1.0), rng);
+
+	int M = 13;
+	int N = 11;
+	int O = 9;
+	std::vector<double> un(M*N*O);
+	for (auto& value : un) {
+		value = rand() < 0.05 ? std::numeric_limits<double>::infinity() : rand();
+	}
+
+	std::vector<double> voxeldimensions = {1.0, 1.5, 0.5};
+	PieceWiseConstant data_term(&un[0], M, N, O, voxeldimensions);
+	StencilLineIntegral stencils(&un[0], M, N, O, voxeldimensions, 3.0);
+	TriLinear trilinear(&un[0], M, N, O, voxeldimensions);
+
+	for (int brick_size : {1, 3, 4, 8, 16}) {
+		CAPTURE(brick_size);
+		auto layout = VolumeLayout::bricked(M, N, O, brick_size);
+
+		// Every voxel has its own position.
+		std::vector<int> positions;
+		for (int z = 0; z < O; ++z) {
+		for (int y = 0; y < N; ++y) {
+		for (int x = 0; x < M; ++x) {
+			positions.push_back(layout.index(x, y, z));
+		}}}
+		std::sort(positions.begin(), positions.end());
+		CHECK(std::unique(positions.begin(), positions.end()) == positions.end());
+		CHECK(positions.front() >= 0);
+		CHECK(positions.back() < layout.size());
+
+		auto bricks = layout.reorder(&un[0]);
+		PieceWiseConstant bricked_data_term(&bricks[0], layout, voxeldimensions);
+		StencilLineIntegral bricked_stencils(&bricks[0], layout, voxeldimensions, 3.0);
+		TriLinear bricked_trilinear(&bricks[0], layout, voxeldimensions);
+
+		// The same voxels in the same order, so the results are identical.
+		for (int iter = 0; iter < 200; ++iter) {
+			double x1 = rand() * (M - 1);
+			double y1 = rand() * (N - 1);
+			double z1 = rand() * (O - 1);
+			double x2 = rand() * (M - 1);
+			double y2 = rand() * (N - 1);
+			double z2 = rand() * (O - 1);
+
+			CHECK(bricked_data_term.evaluate(x1, y1, z1) == data_term.evaluate(x1, y1, z1));
+			CHECK(bricked_trilinear.evaluate(x1, y1, z1) == trilinear.evaluate(x1, y1, z1));
+			CHECK(bricked_data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2) ==
+			      data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2));
+			CHECK(bricked_trilinear.evaluate_line_integral(x1, y1, z1, x2, y2, z2) ==
+			      trilinear.evaluate_line_integral(x1, y1, z1, x2, y2, z2));
+		}
+
+		// Lines along the border.
+		CHECK(bricked_data_term.evaluate_line_integral(M - 0.5, 0.0, 0.0, M - 0.5, N - 1.0, O - 0.5) ==
+		      data_term.evaluate_line_integral(M - 0.5, 0.0, 0.0, M - 0.5, N - 1.0, O - 0.5));
+		CHECK(bricked_trilinear.evaluate_line_integral(M - 1.0, 0.0, 0.0, M - 1.0, N - 1.0, O - 1.0) ==
+		      trilinear.evaluate_line_integral(M - 1.0, 0.0, 0.0, M - 1.0, N - 1.0, O - 1.0));
+
+		std::vector<double> integrals(stencils.size());
+		std::vector<double> bricked_integrals(stencils.size());
+		for (int z = 0; z < O; ++z) {
+		for (int y = 0; y < N; ++y) {
+		for (int x = 0; x < M; ++x) {
+			stencils.evaluate_line_integrals(x, y, z, &integrals[0]);
+			bricked_stencils.evaluate_line_integrals(x, y, z, &bricked_integrals[0]);
+
+			for (int k = 0; k < stencils.size(); ++k) {
+				CHECK(same_integral(bricked_integrals[k], integrals[k]));
+				CHECK(bricked_stencils.evaluate_line_integral(x, y, z, k) ==
+				      stencils.evaluate_line_integral(x, y, z, k));
+			}
+		}}}
+	}
+}
+
+TEST_CASE("Prefix sums")
+{
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, 1.0), rng);
+
+	int M = 13;
+	int N = 11;
+	int O = 9;
+	std::vector<double> un(M*N*O);
+	for (auto& value : un) {
+		value = rand() < 0.02 ? std::numeric_limits<double>::infinity() : rand();
+	}
+
+	std::vector<double> voxeldimensions = {1.0, 1.5, 0.5};
+	auto layout = VolumeLayout::bricked(M, N, O, 4);
+	auto bricks = layout.reorder(&un[0]);
+
+	PieceWiseConstant data_term(&un[0], M, N, O, voxeldimensions, 2.0, 0.5);
+	PieceWiseConstant indexed(&un[0], M, N, O, voxeldimensions, 2.0, 0.5);
+	PieceWiseConstant bricked_indexed(&bricks[0], layout, voxeldimensions, 2.0, 0.5);
+	indexed.index_axes(true, true, true);
+	bricked_indexed.index_axes(true, true, true);
+
+	auto check_line = [&](double x1, double y1, double z1, double x2, double y2, double z2)
+	{
+		CAPTURE(x1);
+		CAPTURE(y1);
+		CAPTURE(z1);
+		CAPTURE(x2);
+		CAPTURE(y2);
+		CAPTURE(z2);
+		double expected = data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2);
+		double result = indexed.evaluate_line_integral(x1, y1, z1, x2, y2, z2);
+		if (std::isinf(expected)) {
+			CHECK(std::isinf(result));
+		}
+		else {
+			CHECK(Approx(result).epsilon(1e-12) == expected);
+		}
+		CHECK(bricked_indexed.evaluate_line_integral(x1, y1, z1, x2, y2, z2) == result);
+
+		typedef fadbad::F<double, 6> F;
+		F f[6] = {x1, y1, z1, x2, y2, z2};
+		for (int i = 0; i < 6; ++i) {
+			f[i].diff(i);
+		}
+		F expected_f = data_term.evaluate_line_integral(f[0], f[1], f[2], f[3], f[4], f[5]);
+		F result_f = indexed.evaluate_line_integral(f[0], f[1], f[2], f[3], f[4], f[5]);
+		if (std::isfinite(expected)) {
+			for (int i = 0; i < 6; ++i) {
+				CHECK(Approx(result_f.d(i)).epsilon(1e-9) == expected_f.d(i));
+			}
+		}
+	};
+
+	auto coordinate = [&](int size) { return rand() * size - 0.5; };
+	for (int iter = 0; iter < 500; ++iter) {
+		// Lines within one row along each axis, axis-aligned lines and
+		// arbitrary lines.
+		double y = coordinate(N), z = coordinate(O);
+		check_line(coordinate(M), y, z, coordinate(M), y + 0.1*(rand() - 0.5), z);
+		double x = coordinate(M);
+		check_line(x, coordinate(N), z, x, coordinate(N), z);
+		check_line(x, y, coordinate(O), x, y, coordinate(O));
+		check_line(int(x), int(y), 0.0, int(x), int(y), O - 1.0);
+		check_line(coordinate(M), coordinate(N), coordinate(O), coordinate(M), coordinate(N), coordinate(O));
+	}
+
+	// Long axis offsets in the stencils.
+	std::vector<int> offsets = {4, 0, 0,  0, -3, 0,  0, 0, 2,  1, 0, 0,  2, 1, 0};
+	StencilLineIntegral stencils(&un[0], M, N, O, voxeldimensions, offsets, 2.0, 0.5);
+	StencilLineIntegral indexed_stencils(&un[0], M, N, O, voxeldimensions, offsets, 2.0, 0.5);
+	indexed_stencils.index_axes(true, true, true, 2);
+	for (int z = 0; z < O; ++z) {
+	for (int y = 0; y < N; ++y) {
+	for (int x = 0; x < M; ++x) {
+		for (int k = 0; k < stencils.size(); ++k) {
+			double expected = stencils.evaluate_line_integral(x, y, z, k);
+			double result = indexed_stencils.evaluate_line_integral(x, y, z, k);
+			if (std::isinf(expected)) {
+				CHECK(std::isinf(result));
+			}
+			else {
+				CHECK(Approx(result).epsilon(1e-12) == expected);
+			}
+		}
+	}}}
+}
+
 
-/*
 TEST_CASE("Stress test -- TriLinear")
 {
-		perform_stress_test<TriLinear>();
+	perform_stress_test<TriLinear>();
 }
-*/
 
 template<typename DataTermImplementation>
 void perform_differentiation_test()
@@ -307,12 +701,106 @@ TEST_CASE("Differentiation test -- PieceWiseConstant")
 	perform_differentiation_test<PieceWiseConstant>();
 }
 
-/*
 TEST_CASE("Differentiation test -- TriLinear")
 {
 	perform_differentiation_test<TriLinear>();
 }
-*/
+
+// The analytic derivatives against automatic differentiation of the
+// same line integral.
+template<typename DataTermImplementation>
+void perform_analytic_derivative_test()
+{
+	typedef fadbad::F<fadbad::F<double, 6>, 6> FF6;
+
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, 1.0), rng);
+
+	for (int iter = 1; iter <= 100; ++iter) {
+		int size[3] = {4 + int(6*rand()), 4 + int(6*rand()), 4 + int(6*rand())};
+		std::vector<double> un(size[0]*size[1]*size[2]);
+		for (auto& value : un) {
+			value = rand();
+		}
+		std::vector<double> voxeldimensions = {0.5 + rand(), 0.5 + rand(), 0.5 + rand()};
+
+		DataTermImplementation data_term(&un[0], size[0], size[1], size[2], voxeldimensions, 2.0, 0.5);
+
+		double p[6];
+		for (int i = 0; i < 6; ++i) {
+			p[i] = rand() * (size[i % 3] - 1);
+		}
+		// Some lines in a plane or along an axis.
+		if (iter % 3 == 0) {
+			p[5] = p[2];
+		}
+		if (iter % 6 == 0) {
+			p[4] = p[1];
+		}
+
+		FF6 x[6];
+		for (int i = 0; i < 6; ++i) {
+			x[i] = p[i];
+			x[i].x().diff(i);
+			x[i].diff(i);
+		}
+		FF6 result = data_term.evaluate_line_integral(x[0], x[1], x[2], x[3], x[4], x[5]);
+
+		double gradient[6], hessian[36], gradient_only[6];
+		double value = data_term.evaluate_line_integral(p[0], p[1], p[2], p[3], p[4], p[5],
+		                                                gradient, hessian);
+		double value_only = data_term.evaluate_line_integral(p[0], p[1], p[2], p[3], p[4], p[5],
+		                                                     gradient_only);
+
+		CAPTURE(iter);
+		CHECK(Approx(value).epsilon(1e-12) == result.x().x());
+		CHECK(value_only == value);
+		for (int i = 0; i < 6; ++i) {
+			CAPTURE(i);
+			CHECK(Approx(gradient[i]).epsilon(1e-9) == result.d(i).x());
+			CHECK(gradient_only[i] == gradient[i]);
+			for (int j = 0; j < 6; ++j) {
+				CAPTURE(j);
+				CHECK(Approx(hessian[6*i + j]).epsilon(1e-9) == result.d(i).d(j));
+			}
+		}
+	}
+}
+
+TEST_CASE("Analytic derivatives -- PieceWiseConstant")
+{
+	perform_analytic_derivative_test<PieceWiseConstant>();
+}
+
+TEST_CASE("Analytic derivatives -- TriLinear")
+{
+	perform_analytic_derivative_test<TriLinear>();
+}
+
+TEST_CASE("Analytic derivatives -- infinite")
+{
+	int M = 5;
+	int N = 6;
+	int O = 7;
+	std::vector<unsigned char> un(M*N*O, 1);
+	std::vector<double> voxeldimensions(3, 1.0);
+	BasicStencilLineIntegral<unsigned char> data_term(&un[0], M, N, O, voxeldimensions, 2.0);
+
+	double gradient[6], hessian[36];
+	// Along the y axis through 3 voxels.
+	CHECK(Approx(data_term.evaluate_line_integral(1.0, 1.0, 1.0, 1.0, 4.0, 1.0, gradient, hessian)) == 3.0);
+	CHECK(Approx(gradient[1]) == -1.0);
+	CHECK(Approx(gradient[4]) == 1.0);
+
+	double infinity = std::numeric_limits<double>::infinity();
+	CHECK(data_term.evaluate_line_integral(1.0, 1.0, 1.0, 1.0, 8.0, 1.0, gradient, hessian) == infinity);
+	for (int i = 0; i < 6; ++i) {
+		CHECK(gradient[i] == 0);
+	}
+	for (int i = 0; i < 36; ++i) {
+		CHECK(hessian[i] == 0);
+	}
+}
 
 
 #ifdef USE_OPENMP
@@ -336,5 +824,389 @@ TEST_CASE("Interpolate/Benchmark", "")
 	double end_time = omp_get_wtime();
 	double elapsed_time = end_time - start_time;
 	std::cerr << "Elapsed time: " << elapsed_time << std::endl;
+
+	// Long lines crossing many voxels, with and without derivatives.
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, M - 1.0), rng);
+
+	std::vector<double> lines(6*1000);
+	for (auto& coordinate : lines) {
+		coordinate = rand();
+	}
+
+	double sum = 0;
+	start_time = omp_get_wtime();
+	for (int iter = 0; iter < 100; ++iter) {
+		for (int i = 0; i < lines.size(); i += 6) {
+			sum += data_term.evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+			                                        lines[i+3], lines[i+4], lines[i+5]);
+		}
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines): " << elapsed_time << std::endl;
+
+	typedef fadbad::F<double, 6> F6;
+	start_time = omp_get_wtime();
+	for (int iter = 0; iter < 10; ++iter) {
+		for (int i = 0; i < lines.size(); i += 6) {
+			F6 x1 = lines[i];   x1.diff(0);
+			F6 y1 = lines[i+1]; y1.diff(1);
+			F6 z1 = lines[i+2]; z1.diff(2);
+			F6 x2 = lines[i+3]; x2.diff(3);
+			F6 y2 = lines[i+4]; y2.diff(4);
+			F6 z2 = lines[i+5]; z2.diff(5);
+			sum += data_term.evaluate_line_integral(x1, y1, z1, x2, y2, z2).x();
+		}
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, F6): " << elapsed_time << std::endl;
+
+	double gradient[6];
+	start_time = omp_get_wtime();
+	for (int iter = 0; iter < 10; ++iter) {
+		for (int i = 0; i < lines.size(); i += 6) {
+			sum += data_term.evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+			                                        lines[i+3], lines[i+4], lines[i+5], gradient);
+		}
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, analytic gradient): " << elapsed_time << std::endl;
+
+	typedef fadbad::F<fadbad::F<double, 6>, 6> FF6;
+	start_time = omp_get_wtime();
+	for (int i = 0; i < lines.size(); i += 6) {
+		FF6 x[6];
+		for (int j = 0; j < 6; ++j) {
+			x[j] = lines[i + j];
+			x[j].x().diff(j);
+			x[j].diff(j);
+		}
+		sum += data_term.evaluate_line_integral(x[0], x[1], x[2], x[3], x[4], x[5]).x().x();
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, FF6): " << elapsed_time << std::endl;
+
+	double hessian[36];
+	start_time = omp_get_wtime();
+	for (int i = 0; i < lines.size(); i += 6) {
+		sum += data_term.evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+		                                        lines[i+3], lines[i+4], lines[i+5], gradient, hessian);
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, analytic Hessian): " << elapsed_time << std::endl;
+
+	// Grid edges from every voxel, directly, with one stencil at a
+	// time and with all stencils at once.
+	StencilLineIntegral stencils(&un[0], M, N, O, voxeldimensions, 3.0);
+	std::vector<int> offsets;
+	for (int dz = -3; dz <= 3; ++dz) {
+	for (int dy = -3; dy <= 3; ++dy) {
+	for (int dx = -3; dx <= 3; ++dx) {
+		if (stencils.direction(dx, dy, dz) >= 0) {
+			offsets.push_back(dx);
+			offsets.push_back(dy);
+			offsets.push_back(dz);
+		}
+	}}}
+
+	std::vector<double> integrals(stencils.size());
+	double direct_sum = 0, stencil_sum = 0, all_sum = 0;
+
+	start_time = omp_get_wtime();
+	for (int z = 3; z < O - 3; ++z) {
+	for (int y = 3; y < N - 3; ++y) {
+	for (int x = 3; x < M - 3; ++x) {
+		for (int i = 0; i < offsets.size(); i += 3) {
+			direct_sum += data_term.evaluate_line_integral<double>(x, y, z,
+				x + offsets[i], y + offsets[i+1], z + offsets[i+2]);
+		}
+	}}}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (grid edges): " << elapsed_time << std::endl;
+
+	start_time = omp_get_wtime();
+	for (int z = 3; z < O - 3; ++z) {
+	for (int y = 3; y < N - 3; ++y) {
+	for (int x = 3; x < M - 3; ++x) {
+		for (int k = 0; k < stencils.size(); ++k) {
+			stencil_sum += stencils.evaluate_line_integral(x, y, z, k);
+		}
+	}}}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (grid edges, stencils): " << elapsed_time << std::endl;
+
+	start_time = omp_get_wtime();
+	for (int z = 3; z < O - 3; ++z) {
+	for (int y = 3; y < N - 3; ++y) {
+	for (int x = 3; x < M - 3; ++x) {
+		stencils.evaluate_line_integrals(x, y, z, &integrals[0]);
+		for (double integral : integrals) {
+			all_sum += integral;
+		}
+	}}}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (grid edges, all stencils): " << elapsed_time << std::endl;
+
+	CHECK(Approx(stencil_sum) == direct_sum);
+	CHECK(Approx(all_sum) == direct_sum);
+	CHECK(sum > 0);
+
+	// TriLinear, integrated exactly and with 25 samples per line.
+	std::vector<double> random_un(M*N*O);
+	for (auto& value : random_un) {
+		value = rand();
+	}
+	TriLinear trilinear(&random_un[0], M, N, O, voxeldimensions);
+
+	auto sampled_integral = [&trilinear](const double* line) -> double
+	{
+		const int samples = 25;
+		double dx = line[3] - line[0];
+		double dy = line[4] - line[1];
+		double dz = line[5] - line[2];
+
+		double cost = 0;
+		for (int i = 0; i < samples; ++i) {
+			double t = double(i) / (samples - 1);
+			cost += trilinear.evaluate(line[0] + t*dx, line[1] + t*dy, line[2] + t*dz);
+		}
+		return cost * std::sqrt(dx*dx + dy*dy + dz*dz) / samples;
+	};
+
+	std::vector<double> exact(lines.size() / 6), sampled(lines.size() / 6);
+
+	start_time = omp_get_wtime();
+	for (int i = 0; i < 100000; ++i) {
+		sum += trilinear.evaluate_line_integral(1.0, 5.0, 3.0, 4.0, 2.0, 2.0);
+		sum += trilinear.evaluate_line_integral(1.0, 2.0, 2.0, 2.0, 2.0, 3.0);
+		sum += trilinear.evaluate_line_integral(1.5, 0.5, 0.0, 0.5, 0.0, 0.5);
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (TriLinear): " << elapsed_time << std::endl;
+
+	double short_lines[] = {1.0, 5.0, 3.0, 4.0, 2.0, 2.0,
+	                        1.0, 2.0, 2.0, 2.0, 2.0, 3.0,
+	                        1.5, 0.5, 0.0, 0.5, 0.0, 0.5};
+	start_time = omp_get_wtime();
+	for (int i = 0; i < 100000; ++i) {
+		sum += sampled_integral(short_lines);
+		sum += sampled_integral(short_lines + 6);
+		sum += sampled_integral(short_lines + 12);
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (TriLinear, 25 samples): " << elapsed_time << std::endl;
+
+	start_time = omp_get_wtime();
+	for (int iter = 0; iter < 100; ++iter) {
+		for (int i = 0; i < lines.size(); i += 6) {
+			exact[i / 6] = trilinear.evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+			                                                lines[i+3], lines[i+4], lines[i+5]);
+		}
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, TriLinear): " << elapsed_time << std::endl;
+
+	start_time = omp_get_wtime();
+	for (int iter = 0; iter < 100; ++iter) {
+		for (int i = 0; i < lines.size(); i += 6) {
+			sampled[i / 6] = sampled_integral(&lines[i]);
+		}
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, TriLinear, 25 samples): " << elapsed_time << std::endl;
+
+	double max_error = 0;
+	for (int i = 0; i < exact.size(); ++i) {
+		max_error = std::max(max_error, std::abs(sampled[i] - exact[i]) / exact[i]);
+	}
+	std::cerr << "Largest relative error with 25 samples: " << max_error << std::endl;
+
+	start_time = omp_get_wtime();
+	for (int iter = 0; iter < 10; ++iter) {
+		for (int i = 0; i < lines.size(); i += 6) {
+			F6 x[6];
+			for (int j = 0; j < 6; ++j) {
+				x[j] = lines[i + j];
+				x[j].diff(j);
+			}
+			sum += trilinear.evaluate_line_integral(x[0], x[1], x[2], x[3], x[4], x[5]).x();
+		}
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, TriLinear, F6): " << elapsed_time << std::endl;
+
+	start_time = omp_get_wtime();
+	for (int iter = 0; iter < 10; ++iter) {
+		for (int i = 0; i < lines.size(); i += 6) {
+			sum += trilinear.evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+			                                        lines[i+3], lines[i+4], lines[i+5], gradient);
+		}
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (long lines, TriLinear, analytic gradient): " << elapsed_time << std::endl;
+}
+
+// Large volumes, where the lines around a voxel in column major order
+// are spread over many cache lines and pages.
+TEST_CASE("Interpolate/Benchmark bricked volume", "")
+{
+	for (int side : {256, 512}) {
+		int M = side;
+		int N = side;
+		int O = side;
+		std::vector<unsigned char> un(std::size_t(M)*N*O);
+		for (std::size_t i = 0; i < un.size(); ++i) {
+			un[i] = (i*2654435761u) >> 24;
+		}
+		std::vector<double> voxeldimensions(3, 1.0);
+
+		auto layout = VolumeLayout::bricked(M, N, O);
+		auto bricks = layout.reorder(&un[0]);
+
+		BasicStencilLineIntegral<unsigned char> stencils(&un[0], M, N, O, voxeldimensions, 3.0);
+		BasicStencilLineIntegral<unsigned char> bricked_stencils(&bricks[0], layout, voxeldimensions, 3.0);
+		BasicPieceWiseConstant<unsigned char> data_term(&un[0], M, N, O, voxeldimensions);
+		BasicPieceWiseConstant<unsigned char> bricked_data_term(&bricks[0], layout, voxeldimensions);
+
+		// The voxels visited by a search are scattered over its front.
+		std::mt19937_64 rng(std::mt19937_64::default_seed);
+		std::uniform_int_distribution<int> coordinate(3, side - 4);
+		std::vector<int> voxels(3*100000);
+		for (auto& c : voxels) {
+			c = coordinate(rng);
+		}
+
+		std::vector<double> integrals(stencils.size());
+		double sum = 0, bricked_sum = 0;
+
+		double start_time = omp_get_wtime();
+		for (int i = 0; i < voxels.size(); i += 3) {
+			stencils.evaluate_line_integrals(voxels[i], voxels[i+1], voxels[i+2], &integrals[0]);
+			sum += integrals[0];
+		}
+		double elapsed_time = omp_get_wtime() - start_time;
+		std::cerr << "Elapsed time (" << side << "^3, stencils): " << elapsed_time << std::endl;
+
+		start_time = omp_get_wtime();
+		for (int i = 0; i < voxels.size(); i += 3) {
+			bricked_stencils.evaluate_line_integrals(voxels[i], voxels[i+1], voxels[i+2], &integrals[0]);
+			bricked_sum += integrals[0];
+		}
+		elapsed_time = omp_get_wtime() - start_time;
+		std::cerr << "Elapsed time (" << side << "^3, stencils, bricked): " << elapsed_time << std::endl;
+
+		// Lines between random voxels at most 10 voxels apart.
+		std::uniform_real_distribution<double> delta(-5.0, 5.0);
+		std::vector<double> lines;
+		for (int i = 0; i < voxels.size(); i += 3) {
+			for (int d = 0; d < 3; ++d) {
+				lines.push_back(voxels[i + d] + delta(rng));
+			}
+			for (int d = 0; d < 3; ++d) {
+				lines.push_back(voxels[i + d] + delta(rng));
+			}
+		}
+
+		start_time = omp_get_wtime();
+		for (int i = 0; i < lines.size(); i += 6) {
+			sum += data_term.evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+			                                        lines[i+3], lines[i+4], lines[i+5]);
+		}
+		elapsed_time = omp_get_wtime() - start_time;
+		std::cerr << "Elapsed time (" << side << "^3, lines): " << elapsed_time << std::endl;
+
+		start_time = omp_get_wtime();
+		for (int i = 0; i < lines.size(); i += 6) {
+			bricked_sum += bricked_data_term.evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+			                                                        lines[i+3], lines[i+4], lines[i+5]);
+		}
+		elapsed_time = omp_get_wtime() - start_time;
+		std::cerr << "Elapsed time (" << side << "^3, lines, bricked): " << elapsed_time << std::endl;
+
+		CHECK(bricked_sum == sum);
+	}
+}
+
+TEST_CASE("Interpolate/Benchmark prefix sums", "")
+{
+	int M = 128;
+	int N = 128;
+	int O = 128;
+	std::vector<unsigned char> un(std::size_t(M)*N*O);
+	for (std::size_t i = 0; i < un.size(); ++i) {
+		un[i] = (i*2654435761u) >> 24;
+	}
+	std::vector<double> voxeldimensions(3, 1.0);
+
+	// Long axis-aligned offsets, as in a connectivity which is not
+	// reduced to the shortest offset in every direction. Only the
+	// longest use the prefix sums.
+	std::vector<int> offsets;
+	for (int length : {8, 16, 64, 100}) {
+		for (int a = 0; a < 3; ++a) {
+			for (int sign : {-1, 1}) {
+				int offset[3] = {0, 0, 0};
+				offset[a] = sign*length;
+				offsets.insert(offsets.end(), offset, offset + 3);
+			}
+		}
+	}
+
+	BasicStencilLineIntegral<unsigned char> stencils(&un[0], M, N, O, voxeldimensions, offsets);
+	BasicStencilLineIntegral<unsigned char> indexed(&un[0], M, N, O, voxeldimensions, offsets);
+	double start_time = omp_get_wtime();
+	indexed.index_axes(true, true, true);
+	double elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (128^3, prefix sums): " << elapsed_time << std::endl;
+
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	std::uniform_int_distribution<int> coordinate(0, M - 1);
+	std::vector<int> voxels(3*100000);
+	for (auto& c : voxels) {
+		c = coordinate(rng);
+	}
+
+	for (auto data_term : {&stencils, &indexed}) {
+		double sum = 0;
+		start_time = omp_get_wtime();
+		for (int i = 0; i < voxels.size(); i += 3) {
+			for (int k = 0; k < data_term->size(); ++k) {
+				double integral = data_term->evaluate_line_integral(voxels[i], voxels[i+1], voxels[i+2], k);
+				sum += integral < 1e100 ? integral : 0;
+			}
+		}
+		elapsed_time = omp_get_wtime() - start_time;
+		std::cerr << "Elapsed time (128^3, axis offsets" << (data_term == &indexed ? ", prefix sums" : "")
+		          << "): " << elapsed_time << "  " << sum << std::endl;
+	}
+
+	// Lines along the axes between random points.
+	BasicPieceWiseConstant<unsigned char> data_term(&un[0], M, N, O, voxeldimensions);
+	BasicPieceWiseConstant<unsigned char> indexed_data_term(&un[0], M, N, O, voxeldimensions);
+	indexed_data_term.index_axes(true, true, true);
+
+	std::uniform_real_distribution<double> real_coordinate(0.0, M - 1.0);
+	std::vector<double> lines;
+	for (int i = 0; i < 100000; ++i) {
+		double start[3], end[3];
+		for (int d = 0; d < 3; ++d) {
+			start[d] = end[d] = real_coordinate(rng);
+		}
+		end[i % 3] = real_coordinate(rng);
+		lines.insert(lines.end(), start, start + 3);
+		lines.insert(lines.end(), end, end + 3);
+	}
+
+	for (auto term : {&data_term, &indexed_data_term}) {
+		double sum = 0;
+		start_time = omp_get_wtime();
+		for (int i = 0; i < lines.size(); i += 6) {
+			sum += term->evaluate_line_integral(lines[i],   lines[i+1], lines[i+2],
+			                                    lines[i+3], lines[i+4], lines[i+5]);
+		}
+		elapsed_time = omp_get_wtime() - start_time;
+		std::cerr << "Elapsed time (128^3, axis-aligned lines" << (term == &indexed_data_term ? ", prefix sums" : "")
+		          << "): " << elapsed_time << "  " << sum << std::endl;
+	}
 }
 #endif
@@ -0,0 +1,210 @@
+// Petter Strandmark 2013.
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main()
+#include <catch.hpp>
+
+#include <curve_extraction/grid_mesh.h>
+#include <curve_extraction/multi_view_data_term.h>
+
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+
+using namespace curve_extraction;
+
+namespace
+{
+	// Three cameras looking at the unit cube from different directions.
+	std::vector<MultiViewDataTerm::View> test_views(const std::vector<std::vector<double>>& images,
+	                                                int width, int height)
+	{
+		const double cameras[3][12] = {{20, 0, 0, 2,    0, 20, 0, 3,   0, 0, 0, 1},
+		                               {0, 0, 20, 1,    20, 0, 0, 2,   0, 0, 0, 1},
+		                               {10, 2, 0, 2,    0, 10, 3, 2,   0.1, 0.1, 0.1, 0.5}};
+		std::vector<MultiViewDataTerm::View> views(3);
+		for (int v = 0; v < 3; ++v) {
+			views[v].image = &images[v][0];
+			views[v].width = width;
+			views[v].height = height;
+			std::copy(cameras[v], cameras[v] + 12, views[v].camera);
+		}
+		return views;
+	}
+
+	std::vector<PieceWiseConstant> view_images(const std::vector<MultiViewDataTerm::View>& views)
+	{
+		std::vector<PieceWiseConstant> images;
+		for (const auto& view: views) {
+			images.emplace_back(view.image, view.width, view.height, 1, std::vector<double>(3, 1.0));
+		}
+		return images;
+	}
+
+	// The maximum cost, projecting the points for every line.
+	double reference_cost(const Mesh& mesh,
+	                      const std::vector<MultiViewDataTerm::View>& views,
+	                      const std::vector<PieceWiseConstant>& images,
+	                      int p1, int p2,
+	                      std::vector<double>* costs)
+	{
+		costs->clear();
+		for (int v = 0; v < views.size(); ++v) {
+			const auto& view = views[v];
+			double xy[2][2];
+			for (int i = 0; i < 2; ++i) {
+				const auto& point = mesh.get_point(i == 0 ? p1 : p2);
+				double X[4] = {point.x, point.y, point.z, 1.0};
+				double x[3] = {0, 0, 0};
+				for (int r = 0; r < 3; ++r) {
+					for (int c = 0; c < 4; ++c) {
+						x[r] += view.camera[4*r + c] * X[c];
+					}
+				}
+				xy[i][0] = std::max(0.0, std::min(view.width - 1.0,  x[0] / x[2]));
+				xy[i][1] = std::max(0.0, std::min(view.height - 1.0, x[1] / x[2]));
+			}
+			costs->push_back(images[v].evaluate_line_integral(xy[0][0], xy[0][1], 0.0,
+			                                                  xy[1][0], xy[1][1], 0.0));
+		}
+		return *std::max_element(costs->begin(), costs->end());
+	}
+}
+
+TEST_CASE("MultiViewDataTerm/Aggregation")
+{
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, 1.0), rng);
+
+	int width = 25;
+	int height = 20;
+	std::vector<std::vector<double>> images(3, std::vector<double>(width*height));
+	for (auto& image : images) {
+		for (auto& pixel : image) {
+			pixel = rand();
+		}
+	}
+	auto views = test_views(images, width, height);
+
+	GridMesh mesh(5, 5, 5, 2.0);
+	mesh.transform_points(0, 0, 0, 0.25, 0.25, 0.25);
+
+	MultiViewDataTerm max_term(mesh, views);
+	MultiViewDataTerm sum_term(mesh, views, MultiViewDataTerm::sum_aggregation);
+	MultiViewDataTerm soft_term(mesh, views, MultiViewDataTerm::soft_max_aggregation, 0.1);
+	MultiViewDataTerm sharp_term(mesh, views, MultiViewDataTerm::soft_max_aggregation, 1e-6);
+	CHECK(max_term.number_of_views() == 3);
+
+	auto view_data_terms = view_images(views);
+	std::vector<double> costs;
+	for (int e = 0; e < mesh.number_of_edges(); e += 7) {
+		int p1 = mesh.get_edge(e).first;
+		int p2 = mesh.get_edge(e).second;
+		double max_cost = reference_cost(mesh, views, view_data_terms, p1, p2, &costs);
+
+		double sum_cost = 0;
+		double sum_exp = 0;
+		for (double cost : costs) {
+			sum_cost += cost;
+			sum_exp += std::exp(cost / 0.1);
+		}
+
+		CHECK(Approx(max_term.evaluate_line_integral(p1, p2)) == max_cost);
+		CHECK(Approx(max_term.evaluate_edge(e)) == max_cost);
+		CHECK(Approx(sum_term.evaluate_edge(e)) == sum_cost);
+		CHECK(Approx(soft_term.evaluate_edge(e)) == 0.1 * std::log(sum_exp));
+		CHECK(Approx(sharp_term.evaluate_edge(e)) == max_cost);
+	}
+}
+
+TEST_CASE("MultiViewDataTerm/Infinite")
+{
+	int width = 10;
+	int height = 10;
+	std::vector<std::vector<double>> images(3, std::vector<double>(width*height, 1.0));
+	// Point (0, 0, 0) projects to pixel (2, 3) in the first view.
+	images[0][2 + width*3] = std::numeric_limits<double>::infinity();
+	auto views = test_views(images, width, height);
+
+	GridMesh mesh(2, 2, 2, 1.0);
+	mesh.transform_points(0, 0, 0, 0.1, 0.1, 0.1);
+
+	int e = mesh.find_edge(mesh.find_point(0, 0, 0), mesh.find_point(0.1f, 0, 0));
+	for (auto aggregation : {MultiViewDataTerm::max_aggregation,
+	                         MultiViewDataTerm::sum_aggregation,
+	                         MultiViewDataTerm::soft_max_aggregation}) {
+		MultiViewDataTerm data_term(mesh, views, aggregation);
+		CHECK(std::isinf(data_term.evaluate_edge(e)));
+	}
+
+	CHECK_THROWS_AS(MultiViewDataTerm(mesh, views, MultiViewDataTerm::soft_max_aggregation, 0.0),
+	                std::runtime_error);
+}
+
+TEST_CASE("MultiViewDataTerm/Edge cache")
+{
+	std::mt19937_64 rng(std::mt19937_64::default_seed);
+	auto rand = std::bind(std::uniform_real_distribution<double>(0.0, 1.0), rng);
+
+	int width = 25;
+	int height = 20;
+	std::vector<std::vector<double>> images(3, std::vector<double>(width*height));
+	for (auto& image : images) {
+		for (auto& pixel : image) {
+			pixel = rand();
+		}
+	}
+	auto views = test_views(images, width, height);
+
+	GridMesh mesh(4, 4, 4, 1.5);
+	mesh.transform_points(0, 0, 0, 0.3, 0.3, 0.3);
+
+	MultiViewDataTerm data_term(mesh, views);
+	MultiViewDataTerm cached_data_term(mesh, views);
+	cached_data_term.enable_edge_cache();
+
+	for (int iter = 0; iter < 2; ++iter) {
+		for (int e = 0; e < mesh.number_of_edges(); ++e) {
+			CHECK(cached_data_term.evaluate_edge(e) == data_term.evaluate_edge(e));
+		}
+	}
+}
+
+TEST_CASE("MultiViewDataTerm/Benchmark", "")
+{
+	int width = 400;
+	int height = 300;
+	std::vector<std::vector<double>> images(3, std::vector<double>(width*height, 1.0));
+	auto views = test_views(images, width, height);
+
+	GridMesh mesh(20, 20, 20, 2.0);
+	mesh.transform_points(0, 0, 0, 0.05, 0.05, 0.05);
+
+	auto view_data_terms = view_images(views);
+	std::vector<double> costs;
+	double sum = 0;
+	double start_time = omp_get_wtime();
+	for (int e = 0; e < mesh.number_of_edges(); ++e) {
+		const auto& edge = mesh.get_edge(e);
+		sum += reference_cost(mesh, views, view_data_terms, edge.first, edge.second, &costs);
+	}
+	double elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (projected per edge): " << elapsed_time << std::endl;
+
+	start_time = omp_get_wtime();
+	MultiViewDataTerm data_term(mesh, views);
+	double precomputed_sum = 0;
+	for (int e = 0; e < mesh.number_of_edges(); ++e) {
+		precomputed_sum += data_term.evaluate_edge(e);
+	}
+	elapsed_time = omp_get_wtime() - start_time;
+	std::cerr << "Elapsed time (MultiViewDataTerm): " << elapsed_time << std::endl;
+
+	CHECK(Approx(precomputed_sum) == sum);
+}
@@ -283,6 +283,44 @@ TEST_CASE("shortest_path/simple_grid8")
 }
 
 
+TEST_CASE("shortest_path/initial_distances")
+{
+	const int n = 10;
+	auto get_neighbors =
+		[n]
+		(int i, std::vector<Neighbor>* neighbors) -> void
+	{
+		if (i < n - 1) {
+			neighbors->push_back(Neighbor(i + 1, 1.0));
+		}
+	};
+
+	std::vector<std::pair<int, double>> start_set;
+	std::set<int> end_set;
+	std::vector<int> path;
+	end_set.insert(n - 1);
+
+	// Starting in 5 is cheaper than starting in 0 or 7.
+	start_set.push_back(std::make_pair(0, 1.0));
+	start_set.push_back(std::make_pair(5, 2.0));
+	start_set.push_back(std::make_pair(7, 10.0));
+	double min_dist = shortest_path(n, start_set, end_set, get_neighbors, &path);
+	EXPECT_NEAR(min_dist, 6.0, 1e-6);
+	ASSERT_EQ(path.size(), n - 5);
+	EXPECT_EQ(path[0], 5);
+	EXPECT_EQ(path[n - 6], n - 1);
+
+	// A start node can be reached more cheaply from another one.
+	start_set.push_back(std::make_pair(8, 100.0));
+	min_dist = shortest_path(n, start_set, end_set, get_neighbors, &path);
+	EXPECT_NEAR(min_dist, 6.0, 1e-6);
+	EXPECT_EQ(path[0], 5);
+
+	start_set.push_back(std::make_pair(2, -1.0));
+	EXPECT_THROW(shortest_path(n, start_set, end_set, get_neighbors, &path),
+	             std::runtime_error);
+}
+
 TEST_CASE("shortest_path/maximum_queue_size", "")
 {
 	//  0  1  2  3
@@ -0,0 +1,152 @@
+// Petter Strandmark 2013.
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN  // This tells Catch to provide a main()
+#include <catch.hpp>
+
+#include <curve_extraction/data_term.h>
+#include <curve_extraction/volume_source.h>
+
+using namespace curve_extraction;
+
+namespace
+{
+	template<typename Voxel>
+	std::vector<Voxel> test_volume(int M, int N, int O)
+	{
+		std::vector<Voxel> volume(M*N*O);
+		for (int i = 0; i < M*N*O; ++i) {
+			volume[i] = Voxel((7*i) % 251);
+		}
+		return volume;
+	}
+
+	template<typename Voxel>
+	void test_round_trip(VolumeSource::VoxelType type)
+	{
+		int M = 13;
+		int N = 11;
+		int O = 9;
+		auto volume = test_volume<Voxel>(M, N, O);
+		std::vector<double> voxeldimensions = {1.0, 1.5, 0.25};
+
+		VolumeSource::write("test_volume_source.nrrd", &volume[0], M, N, O, voxeldimensions);
+		{
+			VolumeSource source("test_volume_source.nrrd", VolumeSource::random_access);
+			CHECK(source.type() == type);
+			CHECK(source.size(0) == M);
+			CHECK(source.size(1) == N);
+			CHECK(source.size(2) == O);
+			CHECK(source.numel() == volume.size());
+			CHECK(source.voxel_dimensions() == voxeldimensions);
+
+			const Voxel* voxels = source.voxels<Voxel>();
+			CHECK(std::vector<Voxel>(voxels, voxels + source.numel()) == volume);
+
+			// The data terms use the voxels of the file directly.
+			BasicPieceWiseConstant<Voxel> in_memory(&volume[0], M, N, O, voxeldimensions);
+			BasicPieceWiseConstant<Voxel> mapped(voxels, M, N, O, voxeldimensions);
+			CHECK(mapped.evaluate_line_integral(0.5, 1.0, 2.0, 11.5, 9.0, 7.0) ==
+			      in_memory.evaluate_line_integral(0.5, 1.0, 2.0, 11.5, 9.0, 7.0));
+
+			source.advise(VolumeSource::sequential_access);
+			source.advise(VolumeSource::normal_access);
+		}
+		std::remove("test_volume_source.nrrd");
+	}
+
+	void write_text(const std::string& file_name, const std::string& text)
+	{
+		std::ofstream fout(file_name, std::ios::binary);
+		fout << text;
+	}
+}
+
+TEST_CASE("VolumeSource/Round trip")
+{
+	test_round_trip<unsigned char>(VolumeSource::uint8_voxels);
+	test_round_trip<unsigned short>(VolumeSource::uint16_voxels);
+	test_round_trip<float>(VolumeSource::float_voxels);
+	test_round_trip<double>(VolumeSource::double_voxels);
+}
+
+TEST_CASE("VolumeSource/Wrong type")
+{
+	std::vector<float> volume(8, 1.0f);
+	VolumeSource::write("test_volume_source.nrrd", &volume[0], 2, 2, 2, {1.0, 1.0, 1.0});
+	{
+		VolumeSource source("test_volume_source.nrrd");
+		CHECK_NOTHROW(source.voxels<float>());
+		CHECK_THROWS_AS(source.voxels<double>(), std::runtime_error);
+		CHECK_THROWS_AS(source.voxels<unsigned char>(), std::runtime_error);
+	}
+	std::remove("test_volume_source.nrrd");
+}
+
+TEST_CASE("VolumeSource/Detached header")
+{
+	int M = 6;
+	int N = 5;
+	auto volume = test_volume<unsigned short>(M, N, 1);
+
+	// Three bytes of junk before the voxels, so they are copied.
+	std::string raw = "abc";
+	raw += std::string(reinterpret_cast<const char*>(&volume[0]), volume.size()*sizeof(volume[0]));
+	write_text("test_volume_source.raw", raw);
+	write_text("test_volume_source.nhdr",
+	           "NRRD0004\n"
+	           "# A 2D image.\n"
+	           "type: unsigned short\n"
+	           "dimension: 2\n"
+	           "sizes: 6 5\n"
+	           "spacings: 0.5 2\n"
+	           "encoding: raw\n"
+	           "endian: little\n"
+	           "data file: test_volume_source.raw\n"
+	           "byte skip: 3\n");
+
+	{
+		VolumeSource source("test_volume_source.nhdr");
+		CHECK(source.type() == VolumeSource::uint16_voxels);
+		CHECK(source.size(0) == M);
+		CHECK(source.size(1) == N);
+		CHECK(source.size(2) == 1);
+		CHECK(source.voxel_dimensions() == std::vector<double>({0.5, 2.0, 1.0}));
+		CHECK(source.data_file() == "test_volume_source.raw");
+		CHECK(source.header().find("byte skip: 3\n") != std::string::npos);
+
+		const unsigned short* voxels = source.voxels<unsigned short>();
+		CHECK(std::vector<unsigned short>(voxels, voxels + source.numel()) == volume);
+	}
+
+	std::remove("test_volume_source.raw");
+	std::remove("test_volume_source.nhdr");
+}
+
+TEST_CASE("VolumeSource/Invalid files")
+{
+	CHECK_THROWS_AS(VolumeSource("test_volume_source_missing.nrrd"), std::runtime_error);
+
+	write_text("test_volume_source.nrrd", "P5\n2 2\n255\n");
+	CHECK_THROWS_AS(VolumeSource("test_volume_source.nrrd"), std::runtime_error);
+
+	// Compressed voxels.
+	write_text("test_volume_source.nrrd",
+	           "NRRD0004\ntype: uint8\ndimension: 3\nsizes: 2 2 2\nencoding: gzip\n\n12345678");
+	CHECK_THROWS_AS(VolumeSource("test_volume_source.nrrd"), std::runtime_error);
+
+	// Fewer voxels than the header says.
+	write_text("test_volume_source.nrrd",
+	           "NRRD0004\ntype: uint8\ndimension: 3\nsizes: 2 2 2\nencoding: raw\n\n1234567");
+	CHECK_THROWS_AS(VolumeSource("test_volume_source.nrrd"), std::runtime_error);
+
+	write_text("test_volume_source.nrrd",
+	           "NRRD0004\ntype: uint8\ndimension: 3\nsizes: 2 2 2\nencoding: raw\n\n12345678");
+	CHECK_NOTHROW(VolumeSource("test_volume_source.nrrd"));
+
+	std::remove("test_volume_source.nrrd");
+}